@@ -16,13 +16,50 @@
 
 #include "EMD_wrapper.h"
 
+#include <algorithm>
+#include <cmath>
+
+bool whole_numbers(const double* x, long long len)
+{
+  for (long long i = 0; i < len; i++) {
+    if (x[i] != std::floor(x[i]) || std::abs(x[i]) > MAX_INTEGER_DATA) {
+      return false;
+    }
+  }
+  return true;
+}
+
 int EMD_wrap(int n1, int n2, double* X, double* Y, double* D, double* cost, int maxIter)
+{
+  EMDWorkspace workspace(maxIter);
+  return workspace.solve(n1, n2, X, Y, D, cost);
+}
+
+EMDWorkspace::EMDWorkspace(int maxIter)
+  : _net(_di, true, 0, 0, maxIter)
+  , _netInt(_di, true, 0, 0, maxIter)
+{}
+
+int EMDWorkspace::solve(int n1, int n2, const double* X, const double* Y, const double* D, double* cost,
+                        bool warmStart)
+{
+  return solve(n1, n2, X, Y, D, cost, warmStart, whole_numbers(D, (long long)n1 * n2));
+}
+
+int EMDWorkspace::solve(int n1, int n2, const double* X, const double* Y, const double* D, double* cost,
+                        bool warmStart, bool integerCosts)
 {
   // beware M and C are stored in row major C style!!!
   int n, m, cur;
 
-  typedef FullBipartiteDigraph Digraph;
-  DIGRAPH_TYPEDEFS(FullBipartiteDigraph);
+  // The previous graph and supplies can be kept if only the costs have changed.
+  if (warmStart && n1 == (int)_X.size() && n2 == (int)_Y.size() && std::equal(X, X + n1, _X.begin()) &&
+      std::equal(Y, Y + n2, _Y.begin()) && (integerCosts || !_integer)) {
+    if (_integer) {
+      return solve_network(_netInt, (int)_indI.size(), (int)_indJ.size(), n2, D, cost, true);
+    }
+    return solve_network(_net, (int)_indI.size(), (int)_indJ.size(), n2, D, cost, true);
+  }
 
   // Get the number of non zero coordinates for r and c
   n = 0;
@@ -44,12 +81,14 @@ int EMD_wrap(int n1, int n2, double* X, double* Y, double* D, double* cost, int
     }
   }
 
-  // Define the graph
+  // Define the graph (reusing the memory from the previous problems)
 
-  std::vector<int> indI(n), indJ(m);
-  std::vector<double> weights1(n), weights2(m);
-  Digraph di(n, m);
-  NetworkSimplexSimple<Digraph, double, double, node_id_type> net(di, true, n + m, n * m, maxIter);
+  _indI.resize(n);
+  _indJ.resize(m);
+  _weights1.resize(n);
+  _weights2.resize(m);
+  _di = FullBipartiteDigraph(n, m);
+  _integer = integerCosts && whole_numbers(X, n1) && whole_numbers(Y, n2);
 
   // Set supply and demand, don't account for 0 values (faster)
 
@@ -57,8 +96,8 @@ int EMD_wrap(int n1, int n2, double* X, double* Y, double* D, double* cost, int
   for (int i = 0; i < n1; i++) {
     double val = *(X + i);
     if (val > 0) {
-      weights1[cur] = val;
-      indI[cur++] = i;
+      _weights1[cur] = val;
+      _indI[cur++] = i;
     }
   }
 
@@ -68,33 +107,50 @@ int EMD_wrap(int n1, int n2, double* X, double* Y, double* D, double* cost, int
   for (int i = 0; i < n2; i++) {
     double val = *(Y + i);
     if (val > 0) {
-      weights2[cur] = -val;
-      indJ[cur++] = i;
+      _weights2[cur] = -val;
+      _indJ[cur++] = i;
     }
   }
 
-  net.supplyMap(&weights1[0], n, &weights2[0], m);
+  _X.assign(X, X + n1);
+  _Y.assign(Y, Y + n2);
+
+  if (_integer) {
+    _netInt.reset(n + m, (long long)n * m);
+    _netInt.supplyMap(_weights1.data(), n, _weights2.data(), m);
+    return solve_network(_netInt, n, m, n2, D, cost, false);
+  }
+
+  _net.reset(n + m, (long long)n * m);
+  _net.supplyMap(_weights1.data(), n, _weights2.data(), m);
+  return solve_network(_net, n, m, n2, D, cost, false);
+}
+
+template<typename Network>
+int EMDWorkspace::solve_network(Network& net, int n, int m, int n2, const double* D, double* cost, bool warmStart)
+{
+  typedef FullBipartiteDigraph::Arc Arc;
 
   // Set the cost of each edge
   for (int i = 0; i < n; i++) {
     for (int j = 0; j < m; j++) {
-      double val = *(D + indI[i] * n2 + indJ[j]);
-      net.setCost(di.arcFromId(i * m + j), val);
+      double val = *(D + _indI[i] * n2 + _indJ[j]);
+      net.setCost(_di.arcFromId(i * m + j), val);
     }
   }
 
   // Solve the problem with the network simplex algorithm
 
-  int ret = net.run();
+  int ret = warmStart ? net.rerun() : net.run();
   if (ret == (int)net.OPTIMAL || ret == (int)net.MAX_ITER_REACHED) {
     *cost = 0;
     Arc a;
-    di.first(a);
-    for (; a != INVALID; di.next(a)) {
-      int i = di.source(a);
-      int j = di.target(a);
+    _di.first(a);
+    for (; a != INVALID; _di.next(a)) {
+      int i = _di.source(a);
+      int j = _di.target(a);
       double flow = net.flow(a);
-      *cost += flow * (*(D + indI[i] * n2 + indJ[j - n]));
+      *cost += flow * (*(D + _indI[i] * n2 + _indJ[j - n]));
     }
   }
 
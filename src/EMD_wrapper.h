@@ -33,4 +33,54 @@ enum ProblemType
 
 int EMD_wrap(int n1, int n2, double* X, double* Y, double* D, double* cost, int maxIter);
 
+// Weights and costs up to this size can be solved in integer arithmetic without the flows, node potentials
+// or the artificial arc costs overflowing
+const double MAX_INTEGER_DATA = 2147483648.0;
+
+// Whether x[0], ..., x[len - 1] are all whole numbers no larger (in absolute value) than MAX_INTEGER_DATA.
+bool whole_numbers(const double* x, long long len);
+
+// The network simplex solver and buffers behind EMD_wrap, kept so they can be reused (e.g. one per thread)
+// for a long sequence of small problems. Once it has grown to fit the largest problem, a solve doesn't
+// allocate any memory.
+class EMDWorkspace
+{
+public:
+  explicit EMDWorkspace(int maxIter);
+
+  // Same arguments and return value as EMD_wrap. With 'warmStart' set, if the previous problem had the same weights
+  // X and Y (only the costs D differ) and was solved to optimality, the simplex starts from its optimal basis.
+  // When the weights and costs are all (not too large) whole numbers, e.g. the costs between categorical or
+  // integer-coded data, the problem is solved in exact integer arithmetic.
+  int solve(int n1, int n2, const double* X, const double* Y, const double* D, double* cost, bool warmStart = false);
+
+  // The same, where the caller already knows whether the costs D are all such whole numbers (e.g. from how the cost
+  // matrix was put together), which saves scanning through them again for every problem.
+  int solve(int n1, int n2, const double* X, const double* Y, const double* D, double* cost, bool warmStart,
+            bool integerCosts);
+
+  // The number of simplex pivots made by the last solve.
+  int iterations() const { return _integer ? _netInt.iterations() : _net.iterations(); }
+
+  // Make sure the next solve starts from scratch.
+  void forget_basis()
+  {
+    _X.clear();
+    _Y.clear();
+  }
+
+private:
+  // Set the costs of the n x m problem already set up in 'net' and solve it
+  template<typename Network>
+  int solve_network(Network& net, int n, int m, int n2, const double* D, double* cost, bool warmStart);
+
+  FullBipartiteDigraph _di;
+  NetworkSimplexSimple<FullBipartiteDigraph, double, double, node_id_type> _net;
+  NetworkSimplexSimple<FullBipartiteDigraph, long long, long long, node_id_type> _netInt;
+  bool _integer = false; // Whether the previous problem was set up in _netInt rather than _net
+  std::vector<int> _indI, _indJ;
+  std::vector<double> _weights1, _weights2;
+  std::vector<double> _X, _Y; // The weights of the previous problem
+};
+
 #endif
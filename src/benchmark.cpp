@@ -14,6 +14,7 @@
 #endif
 #include <fmt/format.h>
 
+#include "EMD_wrapper.h"
 #include "cli.h"
 #include "common.h"
 #include "cpu.h"
@@ -24,13 +25,44 @@
 #define EIGEN_DONT_PARALLELIZE
 #include <Eigen/SVD>
 
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
 // Compiler flags tried on Windows: "/GL" and "/GL /LTCG", both slightly worse. "/O2" is the default.
 
+// Count every allocation made through 'operator new', so the benchmarks can report how many allocations
+// they make. (Eigen allocates with 'malloc' directly, so its allocations aren't counted.)
+static std::atomic<long long> numAllocations = 0;
+
+void* operator new(std::size_t size)
+{
+  numAllocations.fetch_add(1, std::memory_order_relaxed);
+  if (void* ptr = std::malloc(size > 0 ? size : 1)) {
+    return ptr;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept
+{
+  std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept
+{
+  std::free(ptr);
+}
+
 std::vector<std::string> lowLevelInputDumps = { "logmapsmall.json", "logmaplarge.json", "affectsmall.json",
                                                 "affectbige.json" };
 
 ConsoleIO io(0);
 
+// Not declared in the headers, as it is only used internally (and here & in the tests).
+std::unique_ptr<double[]> wasserstein_cost_matrix(const Manifold& M, const Manifold& Mp, int i, int j,
+                                                  const Options& opts, int& len_i, int& len_j);
+
 static void bm_basic_distances(benchmark::State& state)
 {
   std::string filename = lowLevelInputDumps[state.range(0)];
@@ -71,6 +103,69 @@ static void bm_wasserstein_distances(benchmark::State& state)
 
 BENCHMARK(bm_wasserstein_distances)->DenseRange(0, lowLevelInputDumps.size() - 1)->Unit(benchmark::kMillisecond);
 
+// Solve the transport problems between the first prediction point and each training point in turn (as
+// 'wasserstein_distances' does), either starting each network simplex from scratch or from the previous
+// problem's optimal basis. The equal-sized problems are included too, though 'wasserstein' solves those
+// as assignment problems instead. The 'pivots' counter is the average number of pivots per problem.
+static void bm_network_simplex_warm_start(benchmark::State& state)
+{
+  std::string filename = lowLevelInputDumps[state.range(0)];
+  bool warmStart = state.range(1);
+  state.SetLabel(fmt::format("{} ({} start)", filename, warmStart ? "warm" : "cold"));
+
+  Inputs vars = read_lowlevel_inputs_file(filename);
+  Manifold M = vars.generator.create_manifold(vars.E, vars.trainingRows, false, false);
+  Manifold Mp = vars.generator.create_manifold(vars.E, vars.predictionRows, false, true);
+
+  // Treat every variable as continuous, whatever distance the inputs were saved with.
+  Options opts = vars.opts;
+  opts.metrics.assign(M.E_actual(), Metric::Diff);
+
+  struct Problem
+  {
+    int len_i, len_j;
+    std::unique_ptr<double[]> C;
+  };
+
+  std::vector<Problem> problems;
+  for (int i = 0; i < M.nobs(); i++) {
+    Problem problem;
+    problem.C = wasserstein_cost_matrix(M, Mp, i, 0, opts, problem.len_i, problem.len_j);
+    if (problem.len_i > 0 && problem.len_j > 0) {
+      problems.push_back(std::move(problem));
+    }
+  }
+
+  EMDWorkspace emd(10000);
+  std::vector<double> w_1, w_2;
+  long long pivots = 0, solves = 0;
+
+  for (auto _ : state) {
+    emd.forget_basis();
+    for (const Problem& problem : problems) {
+      w_1.assign(problem.len_i, problem.len_j);
+      w_2.assign(problem.len_j, problem.len_i);
+      double cost;
+      emd.solve(problem.len_i, problem.len_j, w_1.data(), w_2.data(), problem.C.get(), &cost, warmStart);
+      benchmark::DoNotOptimize(cost);
+      pivots += emd.iterations();
+      solves += 1;
+    }
+  }
+
+  state.counters["pivots"] = (solves > 0) ? (double)pivots / solves : 0.0;
+}
+
+static void warm_start_arguments(benchmark::internal::Benchmark* b)
+{
+  for (int i = 0; i < (int)lowLevelInputDumps.size(); i++) {
+    b->Args({ i, 0 });
+    b->Args({ i, 1 });
+  }
+}
+
+BENCHMARK(bm_network_simplex_warm_start)->Apply(warm_start_arguments)->Unit(benchmark::kMillisecond);
+
 static void bm_nearest_neighbours(benchmark::State& state)
 {
   std::string filename = lowLevelInputDumps[state.range(0)];
@@ -88,6 +183,8 @@ static void bm_nearest_neighbours(benchmark::State& state)
 
   if (opts.distance == Distance::Wasserstein) {
     potentialNN = wasserstein_distances(Mp_i, vars.opts, M, Mp, tryInds);
+  } else if (opts.distance == Distance::Sinkhorn) {
+    potentialNN = sinkhorn_distances(Mp_i, vars.opts, M, Mp, tryInds);
   } else {
     potentialNN = lp_distances(Mp_i, vars.opts, M, Mp, tryInds);
   }
@@ -127,6 +224,8 @@ static void bm_simplex(benchmark::State& state)
 
   if (opts.distance == Distance::Wasserstein) {
     potentialNN = wasserstein_distances(Mp_i, vars.opts, M, Mp, tryInds);
+  } else if (opts.distance == Distance::Sinkhorn) {
+    potentialNN = sinkhorn_distances(Mp_i, vars.opts, M, Mp, tryInds);
   } else {
     potentialNN = lp_distances(Mp_i, vars.opts, M, Mp, tryInds);
   }
@@ -193,6 +292,8 @@ static void bm_smap(benchmark::State& state)
 
   if (opts.distance == Distance::Wasserstein) {
     potentialNN = wasserstein_distances(Mp_i, vars.opts, M, Mp, tryInds);
+  } else if (opts.distance == Distance::Sinkhorn) {
+    potentialNN = sinkhorn_distances(Mp_i, vars.opts, M, Mp, tryInds);
   } else {
     potentialNN = lp_distances(Mp_i, vars.opts, M, Mp, tryInds);
   }
@@ -254,6 +355,49 @@ static void bm_smap(benchmark::State& state)
 
 BENCHMARK(bm_smap)->DenseRange(0, lowLevelInputDumps.size() - 1);
 
+// Make the predictions one at a time, as the workers do. Each thread reuses its prediction buffers, so after
+// the first pass over the prediction points has grown them, the 'allocs' counter (the average number of
+// allocations per prediction) should be zero for the L^1 / L^2 distances. That only counts 'operator new' though:
+// any temporaries Eigen allocates (with 'malloc') slip past it, so a zero here doesn't rule those out. Checking for
+// them needs edm.cpp built with EIGEN_RUNTIME_NO_MALLOC and 'Eigen::internal::set_is_malloc_allowed(false)'.
+static void bm_make_prediction(benchmark::State& state)
+{
+  std::string filename = lowLevelInputDumps[state.range(0)];
+  state.SetLabel(filename);
+
+  Inputs vars = read_lowlevel_inputs_file(filename);
+  Manifold M = vars.generator.create_manifold(vars.E, vars.trainingRows, false, false);
+  Manifold Mp = vars.generator.create_manifold(vars.E, vars.predictionRows, false, true);
+
+  Options opts = vars.opts;
+  int numThetas = opts.thetas.size();
+  int numCoeffCols = M.E_actual() + 1;
+
+  std::vector<double> ystar(numThetas * Mp.nobs()), coeffs(Mp.nobs() * numCoeffCols);
+  std::vector<int> rc(numThetas * Mp.nobs()), kUsed(Mp.nobs());
+  Eigen::Map<MatrixXd> ystarView(ystar.data(), numThetas, Mp.nobs());
+  Eigen::Map<MatrixXi> rcView(rc.data(), numThetas, Mp.nobs());
+  Eigen::Map<MatrixXd> coeffsView(coeffs.data(), Mp.nobs(), numCoeffCols);
+
+  for (int Mp_i = 0; Mp_i < Mp.nobs(); Mp_i++) {
+    make_prediction(Mp_i, opts, M, Mp, ystarView, rcView, coeffsView, &(kUsed[Mp_i]), nullptr);
+  }
+
+  long long allocations = 0, predictions = 0;
+  int Mp_i = 0;
+  for (auto _ : state) {
+    long long before = numAllocations;
+    make_prediction(Mp_i, opts, M, Mp, ystarView, rcView, coeffsView, &(kUsed[Mp_i]), nullptr);
+    allocations += numAllocations - before;
+    predictions += 1;
+    Mp_i = (Mp_i + 1) % Mp.nobs();
+  }
+
+  state.counters["allocs"] = (predictions > 0) ? (double)allocations / predictions : 0.0;
+}
+
+BENCHMARK(bm_make_prediction)->DenseRange(0, lowLevelInputDumps.size() - 1)->Unit(benchmark::kMicrosecond);
+
 // Larger tests which indicate typical use-cases of the plugin
 std::vector<std::string> tests = {
   "chicago.json",             // ~ 1 min on 80 threads
@@ -6,7 +6,7 @@ std::atomic<bool> going = true;
 
 bool keep_going()
 {
-  return going;
+  return going.load(std::memory_order_relaxed);
 }
 
 int main(int argc, char* argv[])
@@ -110,10 +110,12 @@ json run_tests(json testInputs, int nthreads, IO* io)
     bool copredictMode = taskGroup["copredictMode"];
     std::vector<bool> usable = int_to_bool(taskGroup["usable"]);
     std::string rngState = taskGroup["rngState"];
+    bool nestedLibraries = taskGroup.value("nestedLibraries", false);
 
     std::vector<std::future<Prediction>> futures =
       launch_task_group(generator, opts, Es, libraries, k, numReps, crossfold, explore, full, saveFinalPredictions,
-                        saveFinalCoPredictions, saveSMAPCoeffs, copredictMode, usable, rngState, io, nullptr, nullptr);
+                        saveFinalCoPredictions, saveSMAPCoeffs, copredictMode, usable, rngState, io, nullptr, nullptr,
+                        nestedLibraries);
 
     // Collect the results of this task group before moving on to the next task group
     for (int f = 0; f < futures.size(); f++) {
@@ -20,6 +20,11 @@ void to_json(json& j, const Options& o)
             { "calcRhoMAE", o.calcRhoMAE },
             { "aspectRatio", o.aspectRatio },
             { "distance", o.distance },
+            { "sinkhornEpsilon", o.sinkhornEpsilon },
+            { "sinkhornTolerance", o.sinkhornTolerance },
+            { "distanceCacheMB", o.distanceCacheMB },
+            { "warmStartEMD", o.warmStartEMD },
+            { "pinThreads", o.pinThreads },
             { "metrics", o.metrics },
             { "cmdLine", o.cmdLine } };
 }
@@ -44,6 +49,11 @@ void from_json(const json& j, Options& o)
   j.at("calcRhoMAE").get_to(o.calcRhoMAE);
   j.at("aspectRatio").get_to(o.aspectRatio);
   j.at("distance").get_to(o.distance);
+  o.sinkhornEpsilon = j.value("sinkhornEpsilon", DEFAULT_SINKHORN_EPSILON);
+  o.sinkhornTolerance = j.value("sinkhornTolerance", DEFAULT_SINKHORN_TOLERANCE);
+  o.distanceCacheMB = j.value("distanceCacheMB", 0);
+  o.warmStartEMD = j.value("warmStartEMD", false);
+  o.pinThreads = j.value("pinThreads", false);
   j.at("metrics").get_to(o.metrics);
   j.at("cmdLine").get_to(o.cmdLine);
 }
@@ -14,6 +14,7 @@
 
 typedef int retcode;
 
+#include <atomic>
 #include <future>
 #include <memory> // For unique_ptr
 #include <queue>
@@ -32,7 +33,8 @@ enum class Distance
 {
   MeanAbsoluteError,
   Euclidean,
-  Wasserstein
+  Wasserstein,
+  Sinkhorn
 };
 
 enum class Metric
@@ -46,13 +48,25 @@ NLOHMANN_JSON_SERIALIZE_ENUM(Algorithm, { { Algorithm::Simplex, "Simplex" }, { A
 
 NLOHMANN_JSON_SERIALIZE_ENUM(Distance, { { Distance::MeanAbsoluteError, "MeanAbsoluteError" },
                                          { Distance::Euclidean, "Euclidean" },
-                                         { Distance::Wasserstein, "Wasserstein" } })
+                                         { Distance::Wasserstein, "Wasserstein" },
+                                         { Distance::Sinkhorn, "Sinkhorn" } })
 
 NLOHMANN_JSON_SERIALIZE_ENUM(Metric, {
                                        { Metric::Diff, "Diff" },
                                        { Metric::CheckSame, "CheckSame" },
                                      })
 
+// The Sinkhorn distance is an approximation of the Wasserstein distance (entropy-regularised with strength 'epsilon')
+// and its iterations stop once the transport plan's marginals are this close to the correct weights.
+const double DEFAULT_SINKHORN_EPSILON = 0.1;
+const double DEFAULT_SINKHORN_TOLERANCE = 1e-6;
+
+// Whether each observation is treated as a point cloud (one point per time lag) rather than a vector.
+inline bool is_transport_distance(Distance distance)
+{
+  return distance == Distance::Wasserstein || distance == Distance::Sinkhorn;
+}
+
 struct DistanceIndexPairs
 {
   std::vector<int> inds;
@@ -76,6 +90,11 @@ struct Options
   bool calcRhoMAE;
   double aspectRatio;
   Distance distance;
+  double sinkhornEpsilon = DEFAULT_SINKHORN_EPSILON;
+  double sinkhornTolerance = DEFAULT_SINKHORN_TOLERANCE;
+  int distanceCacheMB = 0; // The memory (in MB) explore mode may use to share Wasserstein distances between tasks
+  bool warmStartEMD = false; // Start each Wasserstein network simplex solve from the previous optimal basis
+  bool pinThreads = false;  // Pin each worker thread to its own CPU
   std::vector<Metric> metrics;
   std::string cmdLine;
   bool saveKUsed;
@@ -126,6 +145,7 @@ public:
   {
     if (verbosity > 0) {
       std::lock_guard<std::mutex> guard(bufferMutex);
+      render_progress();
       buffer += s;
     }
   }
@@ -133,37 +153,43 @@ public:
   virtual std::string get_and_clear_async_buffer()
   {
     std::lock_guard<std::mutex> guard(bufferMutex);
+    render_progress();
     std::string ret = buffer;
     buffer.clear();
     return ret;
   }
 
+  // The worker threads report their progress here, so (apart from starting a new bar with 'progress' = 0) this only
+  // records how far along the bar is in an atomic. The dots are written by whichever thread next collects the
+  // async buffer, so the workers never wait on 'bufferMutex' (nor on the thread polling for output).
   virtual void progress_bar(double progress)
   {
-    std::lock_guard<std::mutex> guard(bufferMutex);
-
     if (progress == 0.0) {
+      std::lock_guard<std::mutex> guard(bufferMutex);
+      render_progress();
       buffer += "Percent complete: 0";
-      nextMessage = 1.0 / 40;
+      progressSteps.store(0, std::memory_order_relaxed);
+      progressFinished.store(false, std::memory_order_relaxed);
+      renderedSteps = 0;
+      renderedFinished = false;
       dots = 0;
       tens = 0;
       return;
     }
 
+    int steps = 0;
+    double nextMessage = 1.0 / 40;
     while (progress >= nextMessage && nextMessage < 1.0) {
-      if (dots < 3) {
-        buffer += ".";
-        dots += 1;
-      } else {
-        tens += 1;
-        buffer += std::to_string(tens * 10);
-        dots = 0;
-      }
+      steps += 1;
       nextMessage += 1.0 / 40;
     }
 
+    int current = progressSteps.load(std::memory_order_relaxed);
+    while (current < steps && !progressSteps.compare_exchange_weak(current, steps, std::memory_order_relaxed)) {
+    }
+
     if (progress >= 1.0) {
-      buffer += "\n";
+      progressFinished.store(true, std::memory_order_release);
     }
   }
 
@@ -176,6 +202,34 @@ private:
   std::string buffer = "";
   std::mutex bufferMutex;
 
-  int dots, tens;
-  double nextMessage;
+  // Written by the workers, so kept on their own cache line
+  alignas(64) std::atomic<int> progressSteps{ 0 };
+  std::atomic<bool> progressFinished{ false };
+
+  // How much of the progress bar has been written to 'buffer' (guarded by 'bufferMutex')
+  alignas(64) int renderedSteps = 0;
+  bool renderedFinished = true;
+  int dots = 0, tens = 0;
+
+  void render_progress()
+  {
+    bool finished = progressFinished.load(std::memory_order_acquire);
+    int steps = progressSteps.load(std::memory_order_relaxed);
+
+    for (; renderedSteps < steps; renderedSteps++) {
+      if (dots < 3) {
+        buffer += ".";
+        dots += 1;
+      } else {
+        tens += 1;
+        buffer += std::to_string(tens * 10);
+        dots = 0;
+      }
+    }
+
+    if (finished && !renderedFinished) {
+      buffer += "\n";
+      renderedFinished = true;
+    }
+  }
 };
@@ -4,6 +4,73 @@
 #include <windows.h>
 #elif defined __APPLE__
 #include <sys/sysctl.h>
+#elif defined __linux__
+#include <algorithm>
+#include <cctype>
+#include <dirent.h>
+#include <fstream>
+#include <pthread.h>
+#include <sched.h>
+#include <set>
+#include <string>
+#include <tuple>
+#endif
+
+#ifdef __linux__
+struct LinuxCPU
+{
+  int id, node, package, core;
+};
+
+static int read_sysfs_int(const std::string& path, int fallback)
+{
+  std::ifstream file(path);
+  int value;
+  return (file >> value) ? value : fallback;
+}
+
+// The CPUs this process may run on, along with where they sit in the machine's topology
+// (read from /sys/devices/system/cpu, so this is empty if sysfs isn't mounted).
+static std::vector<LinuxCPU> linux_cpus()
+{
+  std::vector<LinuxCPU> cpus;
+
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+    return cpus;
+  }
+
+  for (int id = 0; id < CPU_SETSIZE; id++) {
+    if (!CPU_ISSET(id, &allowed)) {
+      continue;
+    }
+
+    std::string dir = "/sys/devices/system/cpu/cpu" + std::to_string(id);
+    int core = read_sysfs_int(dir + "/topology/core_id", -1);
+    if (core < 0) {
+      return {};
+    }
+    int package = read_sysfs_int(dir + "/topology/physical_package_id", 0);
+
+    // The CPU's NUMA node appears as a 'nodeN' link in its directory (none if the kernel isn't NUMA-aware)
+    int node = 0;
+    if (DIR* d = opendir(dir.c_str())) {
+      while (dirent* entry = readdir(d)) {
+        std::string name = entry->d_name;
+        if (name.size() > 4 && name.compare(0, 4, "node") == 0 && std::isdigit((unsigned char)name[4])) {
+          node = std::stoi(name.substr(4));
+          break;
+        }
+      }
+      closedir(d);
+    }
+
+    cpus.push_back({ id, node, package, core });
+  }
+
+  return cpus;
+}
 #endif
 
 size_t num_logical_cores()
@@ -100,14 +167,23 @@ size_t num_physical_cores()
     return 0;
   return num;
 
+#elif defined __linux__
+
+  std::set<std::pair<int, int>> cores;
+  for (const LinuxCPU& cpu : linux_cpus()) {
+    cores.insert({ cpu.package, cpu.core });
+  }
+  return cores.empty() ? std::thread::hardware_concurrency() : cores.size();
+
 #else
-  // TODO: Is there a proper 'linux' way to get # physical cores?
   return std::thread::hardware_concurrency();
 #endif
 }
 
 // Adapted from https://chrisgreendevelopmentblog.wordpress.com/2017/08/29/thread-pools-and-windows-processor-groups/
-void distribute_threads(std::vector<std::thread>& threads)
+// On Linux the threads are only moved when 'pin' is set, in which case each is pinned to its own CPU;
+// otherwise any earlier pinning is undone.
+void distribute_threads(std::vector<std::thread>& threads, bool pin)
 {
 #ifdef _MSC_VER
 
@@ -136,7 +212,47 @@ void distribute_threads(std::vector<std::thread>& threads)
     }
   }
 
-#else
-// TODO: https://eli.thegreenplace.net/2016/c11-threads-affinity-and-hyperthreading/
+#elif defined __linux__
+
+  // Inspired by https://eli.thegreenplace.net/2016/c11-threads-affinity-and-hyperthreading/
+  std::vector<LinuxCPU> cpus = linux_cpus();
+  if (cpus.empty()) {
+    return;
+  }
+
+  if (!pin) {
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    for (const LinuxCPU& cpu : cpus) {
+      CPU_SET(cpu.id, &allowed);
+    }
+    for (std::thread& thread : threads) {
+      pthread_setaffinity_np(thread.native_handle(), sizeof(allowed), &allowed);
+    }
+    return;
+  }
+
+  // Hand out one hyperthread of every physical core before doubling up on any core. Within that, fill up one NUMA
+  // node before moving onto the next, so a small pool keeps all its threads (and the memory they first touch,
+  // such as the manifolds built by the tasks) on the same node.
+  std::vector<std::tuple<int, int, int, int, int>> order; // (sibling, node, package, core, id)
+  for (const LinuxCPU& cpu : cpus) {
+    int sibling = 0;
+    for (const LinuxCPU& other : cpus) {
+      if (other.package == cpu.package && other.core == cpu.core && other.id < cpu.id) {
+        sibling += 1;
+      }
+    }
+    order.emplace_back(sibling, cpu.node, cpu.package, cpu.core, cpu.id);
+  }
+  std::sort(order.begin(), order.end());
+
+  for (size_t i = 0; i < threads.size(); i++) {
+    cpu_set_t target;
+    CPU_ZERO(&target);
+    CPU_SET(std::get<4>(order[i % order.size()]), &target);
+    pthread_setaffinity_np(threads[i].native_handle(), sizeof(target), &target);
+  }
+
 #endif
 }
\ No newline at end of file
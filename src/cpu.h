@@ -1,6 +1,8 @@
+#pragma once
+
 #include <thread>
 #include <vector>
 
 size_t num_logical_cores();
 size_t num_physical_cores();
-void distribute_threads(std::vector<std::thread>& threads);
\ No newline at end of file
+void distribute_threads(std::vector<std::thread>& threads, bool pin = false);
@@ -1,69 +1,1149 @@
 
 #include "distances.h"
 #include "EMD_wrapper.h"
+#include "edm.h" // for 'kNearestNeighbours' & 'prediction_workspace'
 
 #define EIGEN_NO_DEBUG
 #define EIGEN_DONT_PARALLELIZE
 #include <Eigen/Dense>
 
-#include <cmath> // for std::isnormal
+#include <algorithm> // for std::push_heap, std::pop_heap, std::sort
+#include <array>
+#include <cmath>     // for std::isnormal
+#include <limits>
+
+// Add the contributions of the columns j = start, ..., end - 1 to the running L^1 / L^2 sum 'dist_i'
+// between M[i] and Mp[Mp_i]. Returns MISSING_SENTINEL if a missing value makes the distance undefined.
+static inline double add_lp_terms(double dist_i, int i, int Mp_i, int start, int end, const Options& opts,
+                                  const Manifold& M, const Manifold& Mp)
+{
+  for (int j = start; j < end; j++) {
+    // Get the sub-distance between M[i,j] and Mp[Mp_i, j]
+    double dist_ij;
+
+    // If either of these values is missing, the distance from
+    // M[i,j] to Mp[Mp_i, j] is opts.missingdistance.
+    // However, if the user doesn't specify this, then the entire
+    // M[i] to Mp[Mp_i] distance is set as missing.
+    if ((M(i, j) == MISSING_SENTINEL) || (Mp(Mp_i, j) == MISSING_SENTINEL)) {
+      if (opts.missingdistance == 0) {
+        return MISSING_SENTINEL;
+      } else {
+        dist_ij = opts.missingdistance;
+      }
+    } else { // Neither M[i,j] nor Mp[Mp_i, j] is missing.
+      // How do we compare them? Do we treat them like continuous values and subtract them,
+      // or treat them like unordered categorical variables and just check if they're the same?
+      if (opts.metrics[j] == Metric::Diff) {
+        dist_ij = M(i, j) - Mp(Mp_i, j);
+      } else { // Metric::CheckSame
+        dist_ij = (M(i, j) != Mp(Mp_i, j));
+      }
+    }
+
+    if (opts.distance == Distance::MeanAbsoluteError) {
+      dist_i += abs(dist_ij) / M.E_actual();
+    } else { // Distance::Euclidean
+      dist_i += dist_ij * dist_ij;
+    }
+  }
+
+  return dist_i;
+}
+
+double lp_distance(int i, int Mp_i, const Options& opts, const Manifold& M, const Manifold& Mp)
+{
+  // Calculate the distance between M[i] and Mp[Mp_i]
+  double dist_i = 0.0;
+
+  // If we have panel data and the M[i] / Mp[Mp_j] observations come from different panels
+  // then add the user-supplied penalty/distance for the mismatch.
+  if (opts.panelMode && opts.idw > 0) {
+    dist_i += opts.idw * (M.panel(i) != Mp.panel(Mp_i));
+  }
+
+  dist_i = add_lp_terms(dist_i, i, Mp_i, 0, M.E_actual(), opts, M, Mp);
+
+  if (dist_i == MISSING_SENTINEL) {
+    return MISSING_SENTINEL;
+  }
+
+  if (opts.distance == Distance::MeanAbsoluteError) {
+    return dist_i;
+  } else { // Distance::Euclidean
+    return sqrt(dist_i);
+  }
+}
+
+// The L^1 / L^2 distances to Mp[Mp_i] are calculated for this many training points at once, one in each lane.
+const int LP_LANES = 4;
+
+// Calculate 'lp_distance(i, Mp_i, opts, M, Mp)' for each of the LP_LANES training points i = rows[l], when none of
+// these points (nor Mp[Mp_i]) have any missing values. Each lane adds up its terms in the same order as
+// 'add_lp_terms', so the distances are identical, but with no checks for missing values the loop over the columns is
+// just vector arithmetic. 'checkSame' says which columns use the 'CheckSame' metric.
+static void lp_distances_no_missing(const int* rows, int Mp_i, const Options& opts, const std::vector<char>& checkSame,
+                                    const Manifold& M, const Manifold& Mp, double* dists)
+{
+  using Lanes = Eigen::Array<double, LP_LANES, 1>;
+
+  Lanes dist = Lanes::Zero();
+  if (opts.panelMode && opts.idw > 0) {
+    for (int l = 0; l < LP_LANES; l++) {
+      dist[l] += opts.idw * (M.panel(rows[l]) != Mp.panel(Mp_i));
+    }
+  }
+
+  int E_actual = M.E_actual();
+  const double* y = Mp.data() + (size_t)Mp_i * E_actual;
+  std::array<const double*, LP_LANES> x;
+  for (int l = 0; l < LP_LANES; l++) {
+    x[l] = M.data() + (size_t)rows[l] * E_actual;
+  }
+
+  bool mae = (opts.distance == Distance::MeanAbsoluteError);
+  Lanes a, d;
+
+  for (int j = 0; j < E_actual; j++) {
+    for (int l = 0; l < LP_LANES; l++) {
+      a[l] = x[l][j];
+    }
+    Lanes b = Lanes::Constant(y[j]);
+
+    if (checkSame[j]) {
+      d = (a != b).cast<double>();
+    } else {
+      d = a - b;
+    }
+
+    if (mae) {
+      dist += d.abs() / (double)E_actual;
+    } else {
+      dist += d.square();
+    }
+  }
+
+  if (!mae) {
+    dist = dist.sqrt();
+  }
+
+  for (int l = 0; l < LP_LANES; l++) {
+    dists[l] = dist[l];
+  }
+}
+
+// Call 'visit(pos, lp_distance(inpInds[pos], Mp_i, opts, M, Mp))' for every candidate, though not in order.
+// The observations without missing values go through the vectorised kernel LP_LANES at a time, and any others
+// (or all of them, if Mp[Mp_i] has missing values) are compared one by one.
+template<typename Visit>
+static void for_each_lp_distance(int Mp_i, const Options& opts, const Manifold& M, const Manifold& Mp,
+                                 const std::vector<int>& inpInds, Visit visit)
+{
+  bool vectorise = !Mp.any_missing(Mp_i);
+
+  std::vector<char>& checkSame = prediction_workspace().checkSame;
+  checkSame.resize(M.E_actual());
+  for (int j = 0; j < M.E_actual(); j++) {
+    checkSame[j] = (opts.metrics[j] == Metric::CheckSame);
+  }
+
+  std::array<int, LP_LANES> rows, positions;
+  std::array<double, LP_LANES> laneDists;
+  int numLanes = 0;
+
+  for (int pos = 0; pos < (int)inpInds.size(); pos++) {
+    int i = inpInds[pos];
+    if (!vectorise || M.any_missing(i)) {
+      visit(pos, lp_distance(i, Mp_i, opts, M, Mp));
+      continue;
+    }
+
+    rows[numLanes] = i;
+    positions[numLanes] = pos;
+    numLanes += 1;
+
+    if (numLanes == LP_LANES) {
+      lp_distances_no_missing(rows.data(), Mp_i, opts, checkSame, M, Mp, laneDists.data());
+      for (int l = 0; l < LP_LANES; l++) {
+        visit(positions[l], laneDists[l]);
+      }
+      numLanes = 0;
+    }
+  }
+
+  for (int l = 0; l < numLanes; l++) {
+    visit(positions[l], lp_distance(rows[l], Mp_i, opts, M, Mp));
+  }
+}
 
 DistanceIndexPairs lp_distances(int Mp_i, const Options& opts, const Manifold& M, const Manifold& Mp,
-                                std::vector<int> inpInds)
+                                const std::vector<int>& inpInds)
+{
+  DistanceIndexPairs result;
+  lp_distances(Mp_i, opts, M, Mp, inpInds, result);
+  return result;
+}
+
+void lp_distances(int Mp_i, const Options& opts, const Manifold& M, const Manifold& Mp,
+                  const std::vector<int>& inpInds, DistanceIndexPairs& result)
+{
+  // Compare every observation in the M manifold to the
+  // Mp_i'th observation in the Mp manifold.
+  // Every distance is first stored at its position in 'inpInds', and the invalid ones are compacted out at the end.
+  std::vector<double>& allDists = result.dists;
+  allDists.resize(inpInds.size());
+  for_each_lp_distance(Mp_i, opts, M, Mp, inpInds, [&allDists](int pos, double dist) { allDists[pos] = dist; });
+
+  result.inds.clear();
+  int numValid = 0;
+  for (int pos = 0; pos < (int)inpInds.size(); pos++) {
+    double dist_i = allDists[pos];
+
+    if (dist_i != 0 && dist_i != MISSING_SENTINEL) {
+      allDists[numValid] = dist_i;
+      result.inds.push_back(inpInds[pos]);
+      numValid += 1;
+    }
+  }
+  allDists.resize(numValid);
+}
+
+void lp_distances(int Mp_i, const Options& opts, const Manifold& M, const Manifold& Mp,
+                  const std::vector<int>& inpInds, NearestNeighbourHeap& heap)
+{
+  for_each_lp_distance(Mp_i, opts, M, Mp, inpInds, [&heap](int pos, double dist) {
+    if (dist != 0 && dist != MISSING_SENTINEL) {
+      heap.add(dist, pos);
+    }
+  });
+}
+
+void NearestNeighbourHeap::finish(const std::vector<int>& inds, DistanceIndexPairs& kNNs, int& numValidDistances)
+{
+  numValidDistances = _numValid;
+
+  if (_numValid <= _k) {
+    std::sort(_heap.begin(), _heap.end(), [](const auto& a, const auto& b) { return a.second < b.second; });
+  } else {
+    std::sort_heap(_heap.begin(), _heap.end());
+  }
+
+  kNNs.inds.resize(_heap.size());
+  kNNs.dists.resize(_heap.size());
+  for (int j = 0; j < (int)_heap.size(); j++) {
+    kNNs.dists[j] = _heap[j].first;
+    kNNs.inds[j] = inds[_heap[j].second];
+  }
+}
+
+// The matrix product is computed for tiles of this many training points at a time.
+const int BATCH_TRAINING_TILE = 256;
+
+bool BatchEuclideanNeighbours::is_applicable(const Options& opts, const Manifold& M)
+{
+  if (opts.distance != Distance::Euclidean || opts.k <= 0) {
+    return false;
+  }
+
+  for (int j = 0; j < M.E_actual(); j++) {
+    if (opts.metrics[j] != Metric::Diff) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+BatchEuclideanNeighbours::BatchEuclideanNeighbours(const Options& opts, const Manifold& M)
+  : _opts(opts)
+  , _M(M)
+{
+  _sqNorms = M.map().rowwise().squaredNorm();
+
+  _missing.resize(M.nobs());
+  for (int i = 0; i < M.nobs(); i++) {
+    _missing[i] = M.any_missing(i);
+  }
+}
+
+void BatchEuclideanNeighbours::k_nearest_neighbours(int start, int end, const Manifold& Mp, int k,
+                                                    std::vector<DistanceIndexPairs>& kNNs,
+                                                    std::vector<int>& numValidDistances) const
+{
+  using RowMajorMatrix = Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>;
+
+  int E = _M.E_actual();
+  int numPredictions = end - start;
+
+  bool skipOtherPanels = _opts.panelMode && (_opts.idw < 0);
+  bool panelPenalty = _opts.panelMode && (_opts.idw > 0);
+
+  // The estimated squared distance and the one calculated by 'lp_distance' can each be off by a few
+  // rounding errors per dimension (relative to the squared norms), so we allow a generous margin for both.
+  const double tolerance = 8 * (E + 2) * std::numeric_limits<double>::epsilon();
+
+  Eigen::Map<const RowMajorMatrix> predictions(Mp.data() + (size_t)start * E, numPredictions, E);
+  Eigen::VectorXd predSqNorms = predictions.rowwise().squaredNorm();
+
+  // For each prediction point, keep a max-heap of the best (distance, index) pairs found so far,
+  // and the squared distance beyond which a candidate can't possibly displace the worst of these.
+  std::vector<std::vector<std::pair<double, int>>> heaps(numPredictions);
+  std::vector<double> cutoffs(numPredictions, std::numeric_limits<double>::infinity());
+  std::vector<int> numCandidates(numPredictions, 0), numZeros(numPredictions, 0);
+  std::vector<bool> skip(numPredictions);
+
+  for (int r = 0; r < numPredictions; r++) {
+    skip[r] = Mp.any_missing(start + r);
+    heaps[r].reserve(k);
+  }
+
+  RowMajorMatrix dotProducts;
+
+  for (int tileStart = 0; tileStart < _M.nobs(); tileStart += BATCH_TRAINING_TILE) {
+    int tileSize = std::min(BATCH_TRAINING_TILE, _M.nobs() - tileStart);
+    Eigen::Map<const RowMajorMatrix> training(_M.data() + (size_t)tileStart * E, tileSize, E);
+
+    dotProducts.noalias() = predictions * training.transpose();
+
+    for (int r = 0; r < numPredictions; r++) {
+      if (skip[r]) {
+        continue;
+      }
+
+      int Mp_i = start + r;
+      auto& heap = heaps[r];
+
+      for (int c = 0; c < tileSize; c++) {
+        int i = tileStart + c;
+
+        bool otherPanel = (skipOtherPanels || panelPenalty) && (_M.panel(i) != Mp.panel(Mp_i));
+        if (skipOtherPanels && otherPanel) {
+          continue;
+        }
+        numCandidates[r] += 1;
+
+        // A lower bound on the squared distance (the 'idw' penalty is left out, it only adds to the distance).
+        // The estimate is meaningless for training points with missing values, so these are always checked.
+        if (!_missing[i]) {
+          double sqNorms = predSqNorms[r] + _sqNorms[i];
+          double lowerBound = sqNorms - 2 * dotProducts(r, c) - tolerance * sqNorms;
+          if (lowerBound > cutoffs[r]) {
+            continue;
+          }
+        }
+
+        double dist = lp_distance(i, Mp_i, _opts, _M, Mp);
+        if (dist == MISSING_SENTINEL) {
+          numCandidates[r] -= 1;
+          continue;
+        }
+        if (dist == 0) {
+          numZeros[r] += 1;
+          continue;
+        }
+
+        std::pair<double, int> candidate = { dist, i };
+        if ((int)heap.size() < k) {
+          heap.push_back(candidate);
+          std::push_heap(heap.begin(), heap.end());
+        } else if (candidate < heap.front()) {
+          std::pop_heap(heap.begin(), heap.end());
+          heap.back() = candidate;
+          std::push_heap(heap.begin(), heap.end());
+        } else {
+          continue;
+        }
+
+        if ((int)heap.size() == k) {
+          // A tiny relative margin so that rounding in the sqrt can't turn a skipped tie into a missed neighbour.
+          double worst = heap.front().first;
+          cutoffs[r] = worst * worst * (1 + 1e-12);
+        }
+      }
+    }
+  }
+
+  kNNs.resize(numPredictions);
+  numValidDistances.resize(numPredictions);
+
+  for (int r = 0; r < numPredictions; r++) {
+    auto& heap = heaps[r];
+
+    if (skip[r]) {
+      kNNs[r] = {};
+      numValidDistances[r] = -1;
+      continue;
+    }
+
+    numValidDistances[r] = numCandidates[r] - numZeros[r];
+
+    if (numValidDistances[r] <= k) {
+      // Every valid point is a neighbour, so return them in index order (as 'lp_distances' would).
+      std::sort(heap.begin(), heap.end(),
+                [](const std::pair<double, int>& a, const std::pair<double, int>& b) { return a.second < b.second; });
+    } else {
+      std::sort_heap(heap.begin(), heap.end());
+    }
+
+    kNNs[r].inds.resize(heap.size());
+    kNNs[r].dists.resize(heap.size());
+    for (int j = 0; j < (int)heap.size(); j++) {
+      kNNs[r].dists[j] = heap[j].first;
+      kNNs[r].inds[j] = heap[j].second;
+    }
+  }
+}
+
+// Don't keep more than this many bytes of running sums, across all the E-sweeps in progress.
+const size_t E_SWEEP_MEMORY_BUDGET = (size_t)1 << 28;
+
+static std::atomic<size_t> eSweepMemoryUsed{ 0 };
+
+static size_t lagged_distance_sums_memory(int numTrainingPoints, int numPredictionPoints)
+{
+  return (size_t)numTrainingPoints * numPredictionPoints * sizeof(double);
+}
+
+bool LaggedDistanceSums::is_applicable(const Options& opts, int numTrainingPoints, int numPredictionPoints)
+{
+  return opts.distance == Distance::Euclidean &&
+         lagged_distance_sums_memory(numTrainingPoints, numPredictionPoints) <= E_SWEEP_MEMORY_BUDGET;
+}
+
+bool LaggedDistanceSums::reserve_memory(int numTrainingPoints, int numPredictionPoints)
+{
+  size_t size = lagged_distance_sums_memory(numTrainingPoints, numPredictionPoints);
+  size_t used = eSweepMemoryUsed.load();
+  do {
+    if (used + size > E_SWEEP_MEMORY_BUDGET) {
+      return false;
+    }
+  } while (!eSweepMemoryUsed.compare_exchange_weak(used, used + size));
+  return true;
+}
+
+LaggedDistanceSums::LaggedDistanceSums(const Manifold& M, const Manifold& Mp, bool reservedMemory)
+  : _M(M)
+  , _Mp(Mp)
+  , _rows(Mp.nobs())
+  , _reservedMemory(reservedMemory ? lagged_distance_sums_memory(M.nobs(), Mp.nobs()) : 0)
+{}
+
+LaggedDistanceSums::~LaggedDistanceSums()
+{
+  eSweepMemoryUsed -= _reservedMemory;
+}
+
+template<typename Visit>
+bool LaggedDistanceSums::for_each_distance(int Mp_i, const Options& opts, const Manifold& M, const Manifold& Mp,
+                                           const std::vector<int>& inds, Visit visit)
+{
+  if (M.nobs() != _M.nobs() || Mp.nobs() != _Mp.nobs() || M.E() > _M.E()) {
+    return false;
+  }
+
+  int E = M.E();
+  Row& row = _rows[Mp_i];
+  std::lock_guard<std::mutex> lock(row.mutex);
+
+  // Another task has already moved this row's sums beyond our E, so they're no use to us.
+  if (row.E > E) {
+    return false;
+  }
+
+  if (row.sums.empty()) {
+    row.sums.resize(_M.nobs());
+    for (int i = 0; i < _M.nobs(); i++) {
+      row.sums[i] = 0.0;
+      if (opts.panelMode && opts.idw > 0) {
+        row.sums[i] += opts.idw * (_M.panel(i) != _Mp.panel(Mp_i));
+      }
+    }
+  }
+
+  // Add on the lags of x which are new since the last time this row was used. (The lags of x are
+  // always the first columns of the manifolds, and always use the 'Diff' metric.)
+  if (row.E < E) {
+    for (int i = 0; i < _M.nobs(); i++) {
+      if (row.sums[i] != MISSING_SENTINEL) {
+        row.sums[i] = add_lp_terms(row.sums[i], i, Mp_i, row.E, E, opts, _M, _Mp);
+      }
+    }
+    row.E = E;
+  }
+
+  // Finish off the distances with the dt & extra variables, summing in the same order as 'lp_distance'.
+  for (int pos = 0; pos < (int)inds.size(); pos++) {
+    int i = inds[pos];
+    double dist_i = row.sums[i];
+    if (dist_i != MISSING_SENTINEL) {
+      dist_i = add_lp_terms(dist_i, i, Mp_i, E, M.E_actual(), opts, M, Mp);
+    }
+
+    if (dist_i != MISSING_SENTINEL) {
+      dist_i = sqrt(dist_i);
+      if (dist_i != 0) {
+        visit(pos, dist_i);
+      }
+    }
+  }
+
+  // No task will need this row again after the largest E, so free up the memory.
+  if (E == _M.E()) {
+    row.sums = {};
+    row.E = std::numeric_limits<int>::max();
+  }
+
+  return true;
+}
+
+bool LaggedDistanceSums::lp_distances(int Mp_i, const Options& opts, const Manifold& M, const Manifold& Mp,
+                                      const std::vector<int>& inds, DistanceIndexPairs& result)
+{
+  result.inds.clear();
+  result.dists.clear();
+  return for_each_distance(Mp_i, opts, M, Mp, inds, [&](int pos, double dist) {
+    result.dists.push_back(dist);
+    result.inds.push_back(inds[pos]);
+  });
+}
+
+bool LaggedDistanceSums::lp_distances(int Mp_i, const Options& opts, const Manifold& M, const Manifold& Mp,
+                                      const std::vector<int>& inds, NearestNeighbourHeap& heap)
+{
+  return for_each_distance(Mp_i, opts, M, Mp, inds, [&heap](int pos, double dist) { heap.add(dist, pos); });
+}
+
+// The part of the Wasserstein cost which doesn't depend on how the time series are matched up: the distance between
+// the unlagged extra variables of M(i,.) and Mp(j,.) plus any penalty for them coming from different panels.
+// Every entry of the cost matrix includes this, so it is added once to the final distance.
+static double wasserstein_unlagged_distance(const Manifold& M, const Manifold& Mp, int i, int j, const Options& opts,
+                                            int timeSeriesDim)
+{
+  double unlaggedDist = 0.0;
+  int numUnlaggedExtras = M.E_extras() - M.E_lagged_extras();
+  for (int e = 0; e < numUnlaggedExtras; e++) {
+    double x = M.unlagged_extras(i, e), y = Mp.unlagged_extras(j, e);
+    bool eitherMissing = (x == M.missing()) || (y == M.missing());
+
+    if (eitherMissing) {
+      unlaggedDist += opts.missingdistance;
+    } else {
+      if (opts.metrics[timeSeriesDim + e] == Metric::Diff) {
+        unlaggedDist += abs(x - y);
+      } else {
+        unlaggedDist += x != y;
+      }
+    }
+  }
+
+  // If we have panel data and the M[i] / Mp[j] observations come from different panels
+  // then add the user-supplied penalty/distance for the mismatch.
+  if (opts.panelMode && opts.idw > 0) {
+    unlaggedDist += opts.idw * (M.panel(i) != Mp.panel(j));
+  }
+
+  return unlaggedDist;
+}
+
+// When the 'dt' time series is included, the time differences are rescaled by this factor 'gamma'.
+static double wasserstein_time_scale(const Manifold& M, int i, const Options& opts)
+{
+  if (M.E_dt() == 0) {
+    return 1.0;
+  }
+
+  auto M_i = M.laggedObsMap(i);
+
+  // Imagine the M_i time series as a plot, and calculate the
+  // aspect ratio of this plot, so we can rescale the time variable
+  // to get the user-supplied aspect ratio.
+  double minData = std::numeric_limits<double>::max();
+  double maxData = std::numeric_limits<double>::min();
+  double maxTime = 0.0;
+  for (int t = 0; t < M_i.cols(); t++) {
+    if (M_i(0, t) != MISSING_SENTINEL) {
+      if (M_i(0, t) < minData) {
+        minData = M_i(0, t);
+      }
+      if (M_i(0, t) > maxData) {
+        maxData = M_i(0, t);
+      }
+    }
+    if (M_i(1, t) != MISSING_SENTINEL && M_i(1, t) > maxTime) {
+      maxTime = M_i(1, t);
+    }
+  }
+
+  double epsilon = 1e-6; // Some small number in case the following ratio gets wildly large/small
+  return opts.aspectRatio * (maxData - minData + epsilon) / (maxTime + epsilon);
+}
+
+// This function compares the M(i,.) multivariate time series to the Mp(j,.) multivariate time series.
+// The M(i,.) observation has data for E consecutive time points (e.g. time(i), time(i+1), ..., time(i+E-1)) and
+// the Mp(j,.) observation corresponds to E consecutive time points (e.g. time(j), time(j+1), ..., time(j+E-1)).
+// At each time instant we observe n >= 1 pieces of data.
+// These may either be continuous data or unordered categorical data.
+//
+// The Wasserstein distance (using the 'curve-matching' strategy) is equivalent to the (minimum) cost of turning
+// the first time series into the second time series. In a simple example, say E = 2 and n = 1, and
+//         M(i,.) = [ 1, 2 ] and Mp(j,.) = [ 2, 2 ].
+// To turn M(i,.) into Mp(j,.) the first element needs to be increased by 1, so the overall cost is
+//         Wasserstein( M(i,.), Mp(j,.) ) = 1.
+// The distance can also reorder the points, so for example say
+//         M(i,.) = [ 1, 100 ] and Mp(j,.) = [ 100, 1 ].
+// If we just change the 1 to 100 and the 100 to 1 then the cost of each is 99 + 99 = 198.
+// However, Wasserstein can instead reorder these points at a cost of
+//         Wasserstein( M(i,.), Mp(j,.) ) = 2 * gamma * (time(1)-time(2))
+// so if the observations occur on a regular grid so time(i) = i then the distance will just be 2 * gamma.
+//
+// The return value of this function is a matrix which shows the pairwise costs associated to each
+// potential Wasserstein solution. E.g. the (n,m) element of the returned matrix shows the cost
+// of turning the individual point M(i, n) into Mp(j, m).
+//
+// When there are missing values in one or other observation, we can either ignore this time period
+// and compute the Wasserstein for the mismatched regime where M(i,.) is of size len_i and Mp(j,.) is
+// of size len_j, where len_i != len_j is possible. Alternatively, we can fill in the affected elements
+// of the cost matrix with some user-supplied 'missingDistance' value and then len_i == len_j is upheld.
+//
+// The matrix is written (in row-major order) into the 'flatCostMatrix' buffer, which is resized to fit it.
+void wasserstein_cost_matrix(const Manifold& M, const Manifold& Mp, int i, int j, const Options& opts, int& len_i,
+                             int& len_j, std::vector<double>& flatCostMatrix)
+{
+  // The M(i,.) observation will be stored as one flat vector of length M.E_actual():
+  // - the first M.E() observations will the lagged version of the main time series
+  // - the next M.E() observations will be the lagged 'dt' time series (if it is included, i.e., if M.E_dt() > 0)
+  // - the next n * M.E() observations will be the n lagged extra variables,
+  //   so in total that is M.E_lagged_extras() = n * M.E() observations
+  // - the remaining M.E_actual() - M.E() - M.E_dt() - M.E_lagged_extras() are the unlagged extras and the distance
+  //   between those two vectors forms a kind of minimum distance which is added to the time-series curve matching
+  //   Wasserstein distance.
+
+  bool skipMissing = (opts.missingdistance == 0);
+
+  auto M_i = M.laggedObsMap(i);
+  auto Mp_j = Mp.laggedObsMap(j);
+
+  auto M_i_missing = (M_i.array() == M.missing()).colwise().any();
+  auto Mp_j_missing = (Mp_j.array() == Mp.missing()).colwise().any();
+
+  if (skipMissing) {
+    // N.B. Can't .sum() a vector of bools to count them in Eigen.
+    len_i = M.E() - M_i_missing.count();
+    len_j = Mp.E() - Mp_j_missing.count();
+  } else {
+    len_i = M.E();
+    len_j = Mp.E();
+  }
+
+  double gamma = wasserstein_time_scale(M, i, opts);
+
+  int timeSeriesDim = M_i.rows();
+
+  double unlaggedDist = wasserstein_unlagged_distance(M, Mp, i, j, opts, timeSeriesDim);
+
+  flatCostMatrix.assign(len_i * len_j, unlaggedDist);
+  Eigen::Map<Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>> costMatrix(flatCostMatrix.data(),
+                                                                                                len_i, len_j);
+  for (int k = 0; k < timeSeriesDim; k++) {
+    int n = 0;
+    for (int nn = 0; nn < M_i.cols(); nn++) {
+      if (skipMissing && M_i_missing[nn]) {
+        continue;
+      }
+
+      int m = 0;
+
+      for (int mm = 0; mm < Mp_j.cols(); mm++) {
+        if (skipMissing && Mp_j_missing[mm]) {
+          continue;
+        }
+        double dist;
+        bool eitherMissing = M_i_missing[nn] || Mp_j_missing[mm];
+
+        if (eitherMissing) {
+          dist = opts.missingdistance;
+        } else {
+          if (opts.metrics[k] == Metric::Diff) {
+            dist = abs(M_i(k, nn) - Mp_j(k, mm));
+          } else {
+            dist = M_i(k, nn) != Mp_j(k, mm);
+          }
+        }
+
+        // For the time data, we add in the 'gamma' scaling factor calculated earlier
+        if ((M.E_dt() > 0) && (k == 1)) {
+          dist *= gamma;
+        }
+
+        costMatrix(n, m) += dist;
+
+        m += 1;
+      }
+
+      n += 1;
+    }
+  }
+}
+
+std::unique_ptr<double[]> wasserstein_cost_matrix(const Manifold& M, const Manifold& Mp, int i, int j,
+                                                  const Options& opts, int& len_i, int& len_j)
+{
+  std::vector<double> C;
+  wasserstein_cost_matrix(M, Mp, i, j, opts, len_i, len_j, C);
+
+  auto flatCostMatrix = std::make_unique<double[]>(C.size());
+  std::copy(C.begin(), C.end(), flatCostMatrix.get());
+  return flatCostMatrix;
+}
+
+WassersteinCosts::WassersteinCosts(const Options& opts, const Manifold& M, const Manifold& Mp)
+  : _M(M)
+  , _Mp(Mp)
+  , _skipMissing(opts.missingdistance == 0)
+  , _E(M.E())
+  , _dims(1 + (M.E_dt() > 0) + M.E_lagged_extras() / M.E())
+{
+  preprocess(M, _rowsM);
+  preprocess(Mp, _rowsMp);
+
+  // Only the training point's time scale is used.
+  _rowsM.gammas.resize(M.nobs());
+  for (int i = 0; i < M.nobs(); i++) {
+    _rowsM.gammas[i] = wasserstein_time_scale(M, i, opts);
+  }
+}
+
+void WassersteinCosts::preprocess(const Manifold& M, Rows& rows) const
+{
+  rows.values.assign((size_t)M.nobs() * _dims * _E, MISSING_SENTINEL);
+  rows.missing.assign((size_t)M.nobs() * _E, false);
+  rows.anyMissing.assign(M.nobs(), false);
+  rows.lens.assign(M.nobs(), 0);
+  rows.whole.assign((size_t)M.nobs() * _dims, true);
+  rows.maxAbs.assign((size_t)M.nobs() * _dims, 0.0);
+  rows.means.assign((size_t)M.nobs() * _dims, 0.0);
+
+  for (int i = 0; i < M.nobs(); i++) {
+    auto M_i = M.laggedObsMap(i);
+    char* missing = &(rows.missing[(size_t)i * _E]);
+    double* block = &(rows.values[(size_t)i * _dims * _E]);
+
+    int len = 0;
+    for (int t = 0; t < _E; t++) {
+      missing[t] = (M_i.col(t).array() == M.missing()).any();
+      rows.anyMissing[i] = rows.anyMissing[i] || missing[t];
+
+      if (_skipMissing && missing[t]) {
+        continue;
+      }
+      for (int k = 0; k < _dims; k++) {
+        block[k * _E + len] = M_i(k, t);
+      }
+      missing[len] = missing[t];
+      len += 1;
+    }
+    rows.lens[i] = len;
+
+    for (int k = 0; k < _dims; k++) {
+      double sum = 0.0;
+      int count = 0;
+      for (int n = 0; n < len; n++) {
+        double x = block[k * _E + n];
+        if (!missing[n]) {
+          rows.whole[i * _dims + k] = rows.whole[i * _dims + k] && (x == std::floor(x));
+          rows.maxAbs[i * _dims + k] = std::max(rows.maxAbs[i * _dims + k], std::abs(x));
+          sum += x;
+          count += 1;
+        }
+      }
+      if (count > 0) {
+        rows.means[i * _dims + k] = sum / count;
+      }
+    }
+  }
+}
+
+// Each cost is 'unlaggedDist' plus a (scaled) term for each of the 'dims', so they are all whole numbers if each of
+// those terms is, and the largest of them is no more than the sum of the largest possible terms.
+bool WassersteinCosts::integer_costs(int i, int j, const Options& opts, double unlaggedDist, bool anyMissing) const
+{
+  auto whole = [](double x) { return x == std::floor(x); };
+
+  bool integer = whole(unlaggedDist) && (!anyMissing || whole(opts.missingdistance));
+  double maxCost = std::abs(unlaggedDist);
+
+  for (int k = 0; k < _dims && integer; k++) {
+    double scale = ((_M.E_dt() > 0) && (k == 1)) ? _rowsM.gammas[i] : 1.0;
+    double maxTerm = 1.0;
+    if (opts.metrics[k] == Metric::Diff) {
+      integer = _rowsM.whole[i * _dims + k] && _rowsMp.whole[j * _dims + k];
+      maxTerm = _rowsM.maxAbs[i * _dims + k] + _rowsMp.maxAbs[j * _dims + k];
+    }
+    if (anyMissing) {
+      maxTerm = std::max(maxTerm, opts.missingdistance);
+    }
+    integer = integer && whole(scale);
+    maxCost += std::abs(scale) * maxTerm;
+  }
+
+  return integer && maxCost <= MAX_INTEGER_DATA;
+}
+
+void WassersteinCosts::cost_matrix(int i, int j, const Options& opts, int& len_i, int& len_j,
+                                   std::vector<double>& flatCostMatrix, bool* integerCosts) const
+{
+  len_i = _rowsM.lens[i];
+  len_j = _rowsMp.lens[j];
+
+  double unlaggedDist = wasserstein_unlagged_distance(_M, _Mp, i, j, opts, _dims);
+  flatCostMatrix.assign(len_i * len_j, unlaggedDist);
+
+  const double* block_i = &(_rowsM.values[(size_t)i * _dims * _E]);
+  const double* block_j = &(_rowsMp.values[(size_t)j * _dims * _E]);
+  const char* missing_i = &(_rowsM.missing[(size_t)i * _E]);
+  const char* missing_j = &(_rowsMp.missing[(size_t)j * _E]);
+  bool anyMissing = !_skipMissing && (_rowsM.anyMissing[i] || _rowsMp.anyMissing[j]);
+
+  if (integerCosts != nullptr) {
+    *integerCosts = integer_costs(i, j, opts, unlaggedDist, anyMissing);
+  }
+
+  for (int k = 0; k < _dims; k++) {
+    const double* a = block_i + k * _E;
+    const double* b = block_j + k * _E;
+    bool diff = (opts.metrics[k] == Metric::Diff);
+
+    // For the time data, we add in the 'gamma' scaling factor
+    double scale = ((_M.E_dt() > 0) && (k == 1)) ? _rowsM.gammas[i] : 1.0;
+
+    for (int n = 0; n < len_i; n++) {
+      double* C_n = &(flatCostMatrix[n * len_j]);
+      double a_n = a[n];
+
+      if (anyMissing) {
+        for (int m = 0; m < len_j; m++) {
+          double dist;
+          if (missing_i[n] || missing_j[m]) {
+            dist = opts.missingdistance;
+          } else {
+            dist = diff ? abs(a_n - b[m]) : (a_n != b[m]);
+          }
+          C_n[m] += scale * dist;
+        }
+      } else if (diff) {
+        for (int m = 0; m < len_j; m++) {
+          C_n[m] += scale * abs(a_n - b[m]);
+        }
+      } else {
+        for (int m = 0; m < len_j; m++) {
+          C_n[m] += scale * (a_n != b[m]);
+        }
+      }
+    }
+  }
+}
+
+double WassersteinCosts::lower_bound(int i, int j, const Options& opts, bool& valid) const
+{
+  int len_i = _rowsM.lens[i];
+  int len_j = _rowsMp.lens[j];
+
+  valid = !_skipMissing || (len_i > 0 && len_j > 0);
+
+  double bound = wasserstein_unlagged_distance(_M, _Mp, i, j, opts, _dims);
+
+  if (!valid || (!_skipMissing && (_rowsM.anyMissing[i] || _rowsMp.anyMissing[j]))) {
+    return bound;
+  }
+
+  for (int k = 0; k < _dims; k++) {
+    if (opts.metrics[k] != Metric::Diff) {
+      continue;
+    }
+
+    double meanDiff = abs(_rowsM.means[i * _dims + k] - _rowsMp.means[j * _dims + k]);
+    if ((_M.E_dt() > 0) && (k == 1)) {
+      meanDiff *= _rowsM.gammas[i];
+    }
+    bound += meanDiff;
+  }
+
+  return bound;
+}
+
+// If 'integerCosts' is given, it is set to whether the costs are whole numbers (see 'whole_numbers'). Without the
+// preprocessed 'costs' to tell from, that means looking through the matrix.
+static void wasserstein_cost_matrix(const WassersteinCosts* costs, const Manifold& M, const Manifold& Mp, int i,
+                                    int j, const Options& opts, int& len_i, int& len_j,
+                                    std::vector<double>& flatCostMatrix, bool* integerCosts = nullptr)
+{
+  if (costs != nullptr) {
+    costs->cost_matrix(i, j, opts, len_i, len_j, flatCostMatrix, integerCosts);
+  } else {
+    wasserstein_cost_matrix(M, Mp, i, j, opts, len_i, len_j, flatCostMatrix);
+    if (integerCosts != nullptr) {
+      *integerCosts = whole_numbers(flatCostMatrix.data(), (long long)len_i * len_j);
+    }
+  }
+}
+
+// Millions of tiny transport problems are solved for one EDM command, so each thread keeps its solver and
+// buffers around rather than allocating them for every pair of observations.
+struct WassersteinWorkspace
+{
+  EMDWorkspace emd{ 10000 };
+  std::vector<double> w_1, w_2, C, CT;
+
+  // For a block of Sinkhorn problems
+  std::vector<double> sinkC, logA, f, g, sinkWork;
+  std::vector<int> sinkBlock;
+
+  // For the assignment problems which are too big to keep on the stack
+  std::vector<double> u, v, minv;
+  std::vector<int> p, way;
+  std::vector<char> used;
+};
+
+static WassersteinWorkspace& wasserstein_workspace()
+{
+  thread_local WassersteinWorkspace workspace;
+  return workspace;
+}
+
+// The assignment problems of size up to this are solved with stack-allocated arrays (and loops of a fixed length).
+constexpr int ASSIGNMENT_MAX_FIXED_SIZE = 8;
+
+// The minimum cost of matching up the rows and columns of the n x n cost matrix C (row-major), using the
+// Hungarian algorithm in its shortest augmenting path form (as in Jonker & Volgenant). The u & v arrays
+// hold the dual potentials, and p[j] is the row currently matched to column j (all arrays are 1-indexed).
+template<int N>
+static double assignment_cost(const double* C, int size, double* u, double* v, double* minv, int* p, int* way,
+                              char* used)
+{
+  const int n = (N > 0) ? N : size;
+  const double INF = std::numeric_limits<double>::infinity();
+
+  std::fill_n(u, n + 1, 0.0);
+  std::fill_n(v, n + 1, 0.0);
+  std::fill_n(p, n + 1, 0);
+
+  for (int i = 1; i <= n; i++) {
+    // Find the shortest augmenting path from row i to an unmatched column
+    p[0] = i;
+    int j0 = 0;
+    std::fill_n(minv, n + 1, INF);
+    std::fill_n(used, n + 1, false);
+
+    do {
+      used[j0] = true;
+      int i0 = p[j0], j1 = 0;
+      double delta = INF;
+      for (int j = 1; j <= n; j++) {
+        if (!used[j]) {
+          double reduced = C[(i0 - 1) * n + (j - 1)] - u[i0] - v[j];
+          if (reduced < minv[j]) {
+            minv[j] = reduced;
+            way[j] = j0;
+          }
+          if (minv[j] < delta) {
+            delta = minv[j];
+            j1 = j;
+          }
+        }
+      }
+
+      for (int j = 0; j <= n; j++) {
+        if (used[j]) {
+          u[p[j]] += delta;
+          v[j] -= delta;
+        } else {
+          minv[j] -= delta;
+        }
+      }
+      j0 = j1;
+    } while (p[j0] != 0);
+
+    // Flip the matching along the path
+    do {
+      int j1 = way[j0];
+      p[j0] = p[j1];
+      j0 = j1;
+    } while (j0 != 0);
+  }
+
+  double cost = 0.0;
+  for (int j = 1; j <= n; j++) {
+    cost += C[(p[j] - 1) * n + (j - 1)];
+  }
+  return cost;
+}
+
+// Call 'assignment_cost' with the fixed problem size N = n, if it's small enough.
+template<int N>
+static double assignment_cost_dispatch(const double* C, int n, WassersteinWorkspace& workspace)
+{
+  if (n == N) {
+    std::array<double, N + 1> u, v, minv;
+    std::array<int, N + 1> p, way;
+    std::array<char, N + 1> used;
+    return assignment_cost<N>(C, n, u.data(), v.data(), minv.data(), p.data(), way.data(), used.data());
+  }
+  return assignment_cost_dispatch<N + 1>(C, n, workspace);
+}
+
+template<>
+double assignment_cost_dispatch<ASSIGNMENT_MAX_FIXED_SIZE + 1>(const double* C, int n, WassersteinWorkspace& workspace)
+{
+  workspace.u.resize(n + 1);
+  workspace.v.resize(n + 1);
+  workspace.minv.resize(n + 1);
+  workspace.p.resize(n + 1);
+  workspace.way.resize(n + 1);
+  workspace.used.resize(n + 1);
+  return assignment_cost<Eigen::Dynamic>(C, n, workspace.u.data(), workspace.v.data(), workspace.minv.data(),
+                                         workspace.p.data(), workspace.way.data(), workspace.used.data());
+}
+
+// With 'warmStart' set, the network simplex begins from the optimal basis of the previous problem of the same size
+// solved on this thread (since the last 'forget_basis'). The 'integerCosts' flag says whether the costs are all
+// whole numbers (see 'whole_numbers').
+static double wasserstein(double* C, int len_i, int len_j, bool warmStart, bool integerCosts)
+{
+  WassersteinWorkspace& workspace = wasserstein_workspace();
+
+  // When both observations have the same number of points, each carrying the same mass, there is an optimal
+  // transport plan which moves each point onto just one other point (the optimal plans include the vertices of
+  // the set of doubly stochastic matrices, i.e. the permutation matrices). So the problem is just to find the
+  // cheapest assignment, which is quicker to solve directly than with the network simplex.
+  if (len_i == len_j) {
+    return assignment_cost_dispatch<1>(C, len_i, workspace) / len_i;
+  }
+
+  // Each point of M(i,.) has a mass of 1/len_i and each point of Mp(j,.) has 1/len_j. These are counted in units
+  // of 1/(len_i * len_j) so that every flow is a whole number, and so the simplex finds exactly the same flows for
+  // a given basis however it got there.
+  workspace.w_1.assign(len_i, len_j);
+  workspace.w_2.assign(len_j, len_i);
+
+  double cost;
+  workspace.emd.solve(len_i, len_j, workspace.w_1.data(), workspace.w_2.data(), C, &cost, warmStart, integerCosts);
+  return cost / ((double)len_i * len_j);
+}
+
+double wasserstein(double* C, int len_i, int len_j)
+{
+  return wasserstein(C, len_i, len_j, false, whole_numbers(C, (long long)len_i * len_j));
+}
+
+WassersteinDistanceTable::WassersteinDistanceTable(const std::vector<bool>& points, bool symmetric)
+  : _slots(points.size(), -1)
+  , _numPoints(0)
+  , _symmetric(symmetric)
+{
+  for (int p = 0; p < (int)points.size(); p++) {
+    if (points[p]) {
+      _slots[p] = (int)_numPoints++;
+    }
+  }
+
+  size_t size = memory_needed((int)_numPoints, symmetric) / sizeof(double);
+  _dists = std::make_unique<std::atomic<double>[]>(size);
+  for (size_t i = 0; i < size; i++) {
+    _dists[i].store(NOT_CALCULATED, std::memory_order_relaxed);
+  }
+}
+
+size_t WassersteinDistanceTable::memory_needed(int numPoints, bool symmetric)
+{
+  size_t n = numPoints;
+  return (symmetric ? n * (n + 1) / 2 : n * n) * sizeof(double);
+}
+
+WassersteinDistanceTable* WassersteinDistanceCache::table(int E, bool symmetric)
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  auto found = _tables.find(E);
+  if (found != _tables.end()) {
+    return found->second.get();
+  }
+
+  // An E which doesn't fit is remembered (as nullptr) so a smaller E can't take its place later on.
+  std::unique_ptr<WassersteinDistanceTable>& table = _tables[E];
+  int numPoints = (int)std::count(_points.begin(), _points.end(), true);
+  size_t size = WassersteinDistanceTable::memory_needed(numPoints, symmetric);
+  if (size <= _memoryLeft) {
+    table = std::make_unique<WassersteinDistanceTable>(_points, symmetric);
+    _memoryLeft -= size;
+  }
+  return table.get();
+}
+
+// The Wasserstein distance between M(i,.) and Mp(j,.), or MISSING_SENTINEL if one of them has no points to compare.
+// With a 'table', a distance which is already known is just looked up, and otherwise it is solved from a cold start
+// (in the orientation the table asks for, so the result doesn't depend on which task got to it first).
+static double wasserstein_distance(const WassersteinCosts* costs, const Manifold& M, const Manifold& Mp, int i, int j,
+                                   const Options& opts, bool warmStart, WassersteinDistanceTable* table)
+{
+  int p = 0, q = 0;
+  if (table != nullptr) {
+    p = M.point_num(i);
+    q = Mp.point_num(j);
+    double dist = table->lookup(p, q);
+    if (dist != WassersteinDistanceTable::NOT_CALCULATED) {
+      return dist;
+    }
+    warmStart = false;
+  }
+
+  int len_i, len_j;
+  WassersteinWorkspace& workspace = wasserstein_workspace();
+  std::vector<double>& C = workspace.C;
+  bool integerCosts;
+  wasserstein_cost_matrix(costs, M, Mp, i, j, opts, len_i, len_j, C, &integerCosts);
+
+  double dist;
+  if (len_i == 0 || len_j == 0) {
+    dist = MISSING_SENTINEL;
+  } else if (table != nullptr && table->transposed(p, q)) {
+    std::vector<double>& CT = workspace.CT;
+    CT.resize(C.size());
+    for (int n = 0; n < len_i; n++) {
+      for (int m = 0; m < len_j; m++) {
+        CT[m * len_i + n] = C[n * len_j + m];
+      }
+    }
+    dist = wasserstein(CT.data(), len_j, len_i, false, integerCosts);
+  } else {
+    dist = wasserstein(C.data(), len_i, len_j, warmStart, integerCosts);
+  }
+
+  if (table != nullptr) {
+    table->store(p, q, dist);
+  }
+  return dist;
+}
+
+DistanceIndexPairs wasserstein_distances(int Mp_i, const Options& opts, const Manifold& M, const Manifold& Mp,
+                                         std::vector<int> inpInds, const WassersteinCosts* costs, bool warmStart,
+                                         WassersteinDistanceTable* table)
 {
   std::vector<int> inds;
   std::vector<double> dists;
 
+  // Consecutive training points share all but one of their lagged values (shifted by one), so their transport
+  // problems against Mp(Mp_i,.) have similar solutions. Each problem can then start from the last one's optimal
+  // basis, though the chain is started afresh here so the results don't depend on what the thread did before.
+  wasserstein_workspace().emd.forget_basis();
+
   // Compare every observation in the M manifold to the
   // Mp_i'th observation in the Mp manifold.
   for (int i : inpInds) {
-    // Calculate the distance between M[i] and Mp[Mp_i]
-    double dist_i = 0.0;
-
-    // If we have panel data and the M[i] / Mp[Mp_j] observations come from different panels
-    // then add the user-supplied penalty/distance for the mismatch.
-    if (opts.panelMode && opts.idw > 0) {
-      dist_i += opts.idw * (M.panel(i) != Mp.panel(Mp_i));
-    }
-
-    for (int j = 0; j < M.E_actual(); j++) {
-      // Get the sub-distance between M[i,j] and Mp[Mp_i, j]
-      double dist_ij;
-
-      // If either of these values is missing, the distance from
-      // M[i,j] to Mp[Mp_i, j] is opts.missingdistance.
-      // However, if the user doesn't specify this, then the entire
-      // M[i] to Mp[Mp_i] distance is set as missing.
-      if ((M(i, j) == MISSING_SENTINEL) || (Mp(Mp_i, j) == MISSING_SENTINEL)) {
-        if (opts.missingdistance == 0) {
-          dist_i = MISSING_SENTINEL;
-          break;
-        } else {
-          dist_ij = opts.missingdistance;
-        }
-      } else { // Neither M[i,j] nor Mp[Mp_i, j] is missing.
-        // How do we compare them? Do we treat them like continuous values and subtract them,
-        // or treat them like unordered categorical variables and just check if they're the same?
-        if (opts.metrics[j] == Metric::Diff) {
-          dist_ij = M(i, j) - Mp(Mp_i, j);
-        } else { // Metric::CheckSame
-          dist_ij = (M(i, j) != Mp(Mp_i, j));
-        }
-      }
-
-      if (opts.distance == Distance::MeanAbsoluteError) {
-        dist_i += abs(dist_ij) / M.E_actual();
-      } else { // Distance::Euclidean
-        dist_i += dist_ij * dist_ij;
-      }
-    }
+    double dist_i = wasserstein_distance(costs, M, Mp, i, Mp_i, opts, warmStart, table);
 
-    if (dist_i != 0 && dist_i != MISSING_SENTINEL) {
-      if (opts.distance == Distance::MeanAbsoluteError) {
-        dists.push_back(dist_i);
-      } else { // Distance::Euclidean
-        dists.push_back(sqrt(dist_i));
-      }
+    if (dist_i != MISSING_SENTINEL && dist_i != 0 && std::isnormal(dist_i)) {
+      dists.push_back(dist_i);
       inds.push_back(i);
     }
   }
@@ -71,43 +1151,22 @@ DistanceIndexPairs lp_distances(int Mp_i, const Options& opts, const Manifold& M
   return { inds, dists };
 }
 
-// This function compares the M(i,.) multivariate time series to the Mp(j,.) multivariate time series.
-// The M(i,.) observation has data for E consecutive time points (e.g. time(i), time(i+1), ..., time(i+E-1)) and
-// the Mp(j,.) observation corresponds to E consecutive time points (e.g. time(j), time(j+1), ..., time(j+E-1)).
-// At each time instant we observe n >= 1 pieces of data.
-// These may either be continuous data or unordered categorical data.
-//
-// The Wasserstein distance (using the 'curve-matching' strategy) is equivalent to the (minimum) cost of turning
-// the first time series into the second time series. In a simple example, say E = 2 and n = 1, and
-//         M(i,.) = [ 1, 2 ] and Mp(j,.) = [ 2, 2 ].
-// To turn M(i,.) into Mp(j,.) the first element needs to be increased by 1, so the overall cost is
-//         Wasserstein( M(i,.), Mp(j,.) ) = 1.
-// The distance can also reorder the points, so for example say
-//         M(i,.) = [ 1, 100 ] and Mp(j,.) = [ 100, 1 ].
-// If we just change the 1 to 100 and the 100 to 1 then the cost of each is 99 + 99 = 198.
-// However, Wasserstein can instead reorder these points at a cost of
-//         Wasserstein( M(i,.), Mp(j,.) ) = 2 * gamma * (time(1)-time(2))
-// so if the observations occur on a regular grid so time(i) = i then the distance will just be 2 * gamma.
-//
-// The return value of this function is a matrix which shows the pairwise costs associated to each
-// potential Wasserstein solution. E.g. the (n,m) element of the returned matrix shows the cost
-// of turning the individual point M(i, n) into Mp(j, m).
-//
-// When there are missing values in one or other observation, we can either ignore this time period
-// and compute the Wasserstein for the mismatched regime where M(i,.) is of size len_i and Mp(j,.) is
-// of size len_j, where len_i != len_j is possible. Alternatively, we can fill in the affected elements
-// of the cost matrix with some user-supplied 'missingDistance' value and then len_i == len_j is upheld.
-std::unique_ptr<double[]> wasserstein_cost_matrix(const Manifold& M, const Manifold& Mp, int i, int j,
-                                                  const Options& opts, int& len_i, int& len_j)
+// A candidate's lower bound must be more than this (relative) amount above the k-th best distance before it is
+// pruned, so the rounding errors in the bound and in the network simplex solution can't change the neighbours found.
+const double WASSERSTEIN_BOUND_SLACK = 1e-10;
+
+// A cheap lower bound on the Wasserstein distance between M(i,.) and Mp(j,.). Every entry of the cost matrix
+// includes the unlagged extras/panel distance, and then for each continuous variable the cost of any transport plan
+// is at least the distance between the means of the two sets of points (as |E[X - Y]| <= E|X - Y|). When a missing
+// value is given the 'missingdistance', only the first part is used. Also sets 'valid' to whether the distance
+// can be calculated at all (i.e. whether both observations have some non-missing points).
+// With the preprocessed 'costs', the means of each row are already known.
+static double wasserstein_lower_bound(const WassersteinCosts* costs, const Manifold& M, const Manifold& Mp, int i,
+                                      int j, const Options& opts, bool& valid)
 {
-  // The M(i,.) observation will be stored as one flat vector of length M.E_actual():
-  // - the first M.E() observations will the lagged version of the main time series
-  // - the next M.E() observations will be the lagged 'dt' time series (if it is included, i.e., if M.E_dt() > 0)
-  // - the next n * M.E() observations will be the n lagged extra variables,
-  //   so in total that is M.E_lagged_extras() = n * M.E() observations
-  // - the remaining M.E_actual() - M.E() - M.E_dt() - M.E_lagged_extras() are the unlagged extras and the distance
-  //   between those two vectors forms a kind of minimum distance which is added to the time-series curve matching
-  //   Wasserstein distance.
+  if (costs != nullptr) {
+    return costs->lower_bound(i, j, opts, valid);
+  }
 
   bool skipMissing = (opts.missingdistance == 0);
 
@@ -117,187 +1176,453 @@ std::unique_ptr<double[]> wasserstein_cost_matrix(const Manifold& M, const Manif
   auto M_i_missing = (M_i.array() == M.missing()).colwise().any();
   auto Mp_j_missing = (Mp_j.array() == Mp.missing()).colwise().any();
 
-  if (skipMissing) {
-    // N.B. Can't .sum() a vector of bools to count them in Eigen.
-    len_i = M.E() - M_i_missing.count();
-    len_j = Mp.E() - Mp_j_missing.count();
-  } else {
-    len_i = M.E();
-    len_j = Mp.E();
+  int len_i = M.E() - M_i_missing.count();
+  int len_j = Mp.E() - Mp_j_missing.count();
+
+  valid = !skipMissing || (len_i > 0 && len_j > 0);
+
+  int timeSeriesDim = M_i.rows();
+  double bound = wasserstein_unlagged_distance(M, Mp, i, j, opts, timeSeriesDim);
+
+  if (!valid || (!skipMissing && (len_i < M.E() || len_j < Mp.E()))) {
+    return bound;
   }
 
-  double gamma = 1.0;
-  if (M.E_dt() > 0) {
-    // Imagine the M_i time series as a plot, and calculate the
-    // aspect ratio of this plot, so we can rescale the time variable
-    // to get the user-supplied aspect ratio.
-    double minData = std::numeric_limits<double>::max();
-    double maxData = std::numeric_limits<double>::min();
-    double maxTime = 0.0;
+  double gamma = wasserstein_time_scale(M, i, opts);
+
+  for (int k = 0; k < timeSeriesDim; k++) {
+    if (opts.metrics[k] != Metric::Diff) {
+      continue;
+    }
+
+    double mean_i = 0.0, mean_j = 0.0;
     for (int t = 0; t < M_i.cols(); t++) {
-      if (M_i(0, t) != MISSING_SENTINEL) {
-        if (M_i(0, t) < minData) {
-          minData = M_i(0, t);
-        }
-        if (M_i(0, t) > maxData) {
-          maxData = M_i(0, t);
-        }
+      if (!M_i_missing[t]) {
+        mean_i += M_i(k, t);
       }
-      if (M_i(1, t) != MISSING_SENTINEL && M_i(1, t) > maxTime) {
-        maxTime = M_i(1, t);
+    }
+    for (int t = 0; t < Mp_j.cols(); t++) {
+      if (!Mp_j_missing[t]) {
+        mean_j += Mp_j(k, t);
       }
     }
 
-    double epsilon = 1e-6; // Some small number in case the following ratio gets wildly large/small
-    gamma = opts.aspectRatio * (maxData - minData + epsilon) / (maxTime + epsilon);
+    double meanDiff = abs(mean_i / len_i - mean_j / len_j);
+    if ((M.E_dt() > 0) && (k == 1)) {
+      meanDiff *= gamma;
+    }
+    bound += meanDiff;
   }
 
-  int timeSeriesDim = M_i.rows();
+  return bound;
+}
 
-  double unlaggedDist = 0.0;
-  int numUnlaggedExtras = M.E_extras() - M.E_lagged_extras();
-  for (int e = 0; e < numUnlaggedExtras; e++) {
-    double x = M.unlagged_extras(i, e), y = Mp.unlagged_extras(j, e);
-    bool eitherMissing = (x == M.missing()) || (y == M.missing());
+void wasserstein_k_nearest_neighbours(int Mp_i, const Options& opts, const Manifold& M, const Manifold& Mp,
+                                      const std::vector<int>& inds, int k, DistanceIndexPairs& kNNs,
+                                      int& numValidDistances, const WassersteinCosts* costs,
+                                      WassersteinDistanceTable* table)
+{
+  struct Candidate
+  {
+    double bound;
+    int pos; // The position in 'inds'
+  };
 
-    if (eitherMissing) {
-      unlaggedDist += opts.missingdistance;
-    } else {
-      if (opts.metrics[timeSeriesDim + e] == Metric::Diff) {
-        unlaggedDist += abs(x - y);
-      } else {
-        unlaggedDist += x != y;
+  std::vector<Candidate> candidates;
+  candidates.reserve(inds.size());
+  for (int pos = 0; pos < (int)inds.size(); pos++) {
+    bool valid;
+    double bound = wasserstein_lower_bound(costs, M, Mp, inds[pos], Mp_i, opts, valid);
+    if (valid) {
+      candidates.push_back({ bound, pos });
+    }
+  }
+
+  std::sort(candidates.begin(), candidates.end(), [](const Candidate& a, const Candidate& b) {
+    return (a.bound != b.bound) ? (a.bound < b.bound) : (a.pos < b.pos);
+  });
+
+  // Solve the transport problems in order of increasing lower bound, keeping a max-heap of the k smallest distances.
+  // Once a bound is beyond the k-th smallest distance, so is every remaining candidate's distance. Those distances
+  // are all valid (they're bigger than a valid distance) though they can't be among the k nearest neighbours.
+  std::vector<std::pair<int, double>> found;
+  std::vector<double> best;
+  int numPruned = 0;
+
+  for (int c = 0; c < (int)candidates.size(); c++) {
+    if ((int)best.size() == k && candidates[c].bound > best.front() * (1 + WASSERSTEIN_BOUND_SLACK)) {
+      numPruned = (int)candidates.size() - c;
+      break;
+    }
+
+    int pos = candidates[c].pos;
+    double dist = wasserstein_distance(costs, M, Mp, inds[pos], Mp_i, opts, false, table);
+
+    if (dist != MISSING_SENTINEL && dist != 0 && std::isnormal(dist)) {
+      found.emplace_back(pos, dist);
+
+      best.push_back(dist);
+      std::push_heap(best.begin(), best.end());
+      if ((int)best.size() > k) {
+        std::pop_heap(best.begin(), best.end());
+        best.pop_back();
       }
     }
   }
 
-  // If we have panel data and the M[i] / Mp[j] observations come from different panels
-  // then add the user-supplied penalty/distance for the mismatch.
-  if (opts.panelMode && opts.idw > 0) {
-    unlaggedDist += opts.idw * (M.panel(i) != Mp.panel(j));
+  // Put the distances back in their original order, so ties are broken just like the brute-force search does.
+  std::sort(found.begin(), found.end());
+
+  DistanceIndexPairs potentialNN;
+  for (const auto& [pos, dist] : found) {
+    potentialNN.inds.push_back(inds[pos]);
+    potentialNN.dists.push_back(dist);
   }
 
-  auto flatCostMatrix = std::make_unique<double[]>(len_i * len_j);
-  std::fill_n(flatCostMatrix.get(), len_i * len_j, unlaggedDist);
-  Eigen::Map<Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>> costMatrix(flatCostMatrix.get(),
-                                                                                                len_i, len_j);
-  for (int k = 0; k < timeSeriesDim; k++) {
-    int n = 0;
-    for (int nn = 0; nn < M_i.cols(); nn++) {
-      if (skipMissing && M_i_missing[nn]) {
+  numValidDistances = (int)found.size() + numPruned;
+
+  if (k >= numValidDistances) {
+    kNNs = potentialNN;
+  } else {
+    kNNs = kNearestNeighbours(potentialNN, k);
+  }
+}
+
+// The Sinkhorn problems are solved for this many training points at once. Their cost matrices are interleaved so the
+// innermost loops run over the block of training points, which are contiguous in memory and easy to vectorise.
+const int SINKHORN_BLOCK_SIZE = 16;
+
+// The marginals of the transport plans are checked after every this many iterations. Once a point has annealed down
+// to the requested epsilon, it is given at most SINKHORN_MAX_ITERATIONS (a multiple of the above) more to converge.
+const int SINKHORN_CHECK_EVERY = 10;
+const int SINKHORN_MAX_ITERATIONS = 1000;
+
+// The log-sum-exp of the values v(0), ..., v(num - 1) for each of the training points in a block, where v(r)[b]
+// is at the 'stride * r + b' position of the 'values' array. Splitting it into two passes (one for the maximum
+// and one for the sum) avoids any overflow, and lets each pass be vectorised over the block.
+static void block_log_sum_exp(const double* values, int num, int stride, double* result)
+{
+  const int B = SINKHORN_BLOCK_SIZE;
+  double maxs[B], sums[B];
+
+  std::fill_n(maxs, B, -std::numeric_limits<double>::infinity());
+  for (int r = 0; r < num; r++) {
+    for (int b = 0; b < B; b++) {
+      maxs[b] = std::max(maxs[b], values[r * stride + b]);
+    }
+  }
+
+  std::fill_n(sums, B, 0.0);
+  for (int r = 0; r < num; r++) {
+    for (int b = 0; b < B; b++) {
+      sums[b] += std::exp(values[r * stride + b] - maxs[b]);
+    }
+  }
+
+  for (int b = 0; b < B; b++) {
+    result[b] = maxs[b] + std::log(sums[b]);
+  }
+}
+
+// Whether the Wasserstein distance for this cost matrix is exactly zero. The entropy-regularised plan always spreads
+// some mass onto costly pairs, so this is checked directly to exclude the same pairs as 'wasserstein_distances'.
+// The zero entries of C link identical points, so the distance is zero iff each group of identical points has the
+// same share of the mass in both point clouds.
+static bool zero_transport_cost(const std::vector<double>& C, int len_i, int len_j)
+{
+  for (int r = 0; r < len_i; r++) {
+    int c0 = -1, zerosInRow = 0;
+    for (int c = 0; c < len_j; c++) {
+      if (C[r * len_j + c] == 0) {
+        c0 = (c0 < 0) ? c : c0;
+        zerosInRow += 1;
+      }
+    }
+    if (c0 < 0) {
+      return false;
+    }
+
+    int zerosInCol = 0;
+    for (int r2 = 0; r2 < len_i; r2++) {
+      zerosInCol += (C[r2 * len_j + c0] == 0);
+    }
+    if (zerosInRow * len_i != zerosInCol * len_j) {
+      return false;
+    }
+  }
+  return true;
+}
+
+DistanceIndexPairs sinkhorn_distances(int Mp_i, const Options& opts, const Manifold& M, const Manifold& Mp,
+                                      const std::vector<int>& inpInds, const WassersteinCosts* costs)
+{
+  std::vector<int> inds;
+  std::vector<double> dists;
+
+  const int B = SINKHORN_BLOCK_SIZE;
+  const double eps = opts.sinkhornEpsilon;
+  const double NEG_INF = -std::numeric_limits<double>::infinity();
+
+  WassersteinWorkspace& workspace = wasserstein_workspace();
+  std::vector<double>& C = workspace.sinkC;
+  std::vector<double>& logA = workspace.logA;
+  std::vector<double>& f = workspace.f;
+  std::vector<double>& g = workspace.g;
+  std::vector<double>& work = workspace.sinkWork;
+  std::vector<int>& block = workspace.sinkBlock;
+
+  // Each training point has (up to) 'n' points in its time series, and the prediction point has 'm'.
+  int n = M.E();
+  int m = 0;
+
+  work.resize(std::max(n, Mp.E()) * B);
+
+  // The per-point state of a block is small enough to keep on the stack.
+  double blockDists[B], lse[B], epsB[B], invEps[B], maxErr[B], cost[B];
+  bool done[B];
+  int epsReachedAt[B];
+
+  for (int start = 0; start < (int)inpInds.size(); start += B) {
+    int end = std::min(start + B, (int)inpInds.size());
+
+    // Lay out the cost matrices as C[r][c][b] along with the log of the mass of each point, logA[r][b].
+    // Training points with fewer points (because of missing values) are padded out with points of zero mass,
+    // and the unused slots at the end of the final block are given a trivial problem.
+    block.clear();
+    for (int pos = start; pos < end; pos++) {
+      int len_i, len_j;
+      wasserstein_cost_matrix(costs, M, Mp, inpInds[pos], Mp_i, opts, len_i, len_j, workspace.C);
+      if (len_i == 0 || len_j == 0 || zero_transport_cost(workspace.C, len_i, len_j)) {
         continue;
       }
 
-      int m = 0;
+      if (block.empty()) {
+        m = len_j;
+        C.assign(n * m * B, 0.0);
+        logA.assign(n * B, NEG_INF);
+        for (int b = 0; b < B; b++) {
+          logA[b] = 0.0;
+        }
+      }
 
-      for (int mm = 0; mm < Mp_j.cols(); mm++) {
-        if (skipMissing && Mp_j_missing[mm]) {
-          continue;
+      int b = (int)block.size();
+      for (int r = 0; r < n; r++) {
+        logA[r * B + b] = (r < len_i) ? -std::log((double)len_i) : NEG_INF;
+        for (int c = 0; c < m; c++) {
+          C[(r * m + c) * B + b] = (r < len_i) ? workspace.C[r * m + c] : 0.0;
         }
-        double dist;
-        bool eitherMissing = M_i_missing[nn] || Mp_j_missing[mm];
+      }
+      block.push_back(inpInds[pos]);
+    }
 
-        if (eitherMissing) {
-          dist = opts.missingdistance;
-        } else {
-          if (opts.metrics[k] == Metric::Diff) {
-            dist = abs(M_i(k, nn) - Mp_j(k, mm));
-          } else {
-            dist = M_i(k, nn) != Mp_j(k, mm);
+    if (block.empty()) {
+      continue;
+    }
+
+    double logB = -std::log((double)m);
+
+    // Run Sinkhorn's algorithm on the dual potentials f & g (the 'log-domain' version, which can't overflow or
+    // divide by zero however small epsilon is). Each point's iterations are independent of the others in its block,
+    // so its distance is recorded at the first check where its plan's marginals are within the tolerance.
+    // A small epsilon takes many iterations to converge from scratch, so each point starts with an epsilon as
+    // large as its largest cost and halves it at every check until it reaches the requested epsilon. The iteration
+    // limit only starts counting from there, so every distance is calculated with the epsilon that was asked for.
+    f.assign(n * B, 0.0);
+    g.assign(m * B, 0.0);
+    for (int b = 0; b < B; b++) {
+      done[b] = (b >= (int)block.size());
+      epsB[b] = eps;
+      if (!done[b]) {
+        for (int rc = 0; rc < n * m; rc++) {
+          epsB[b] = std::max(epsB[b], C[rc * B + b]);
+        }
+      }
+      invEps[b] = 1.0 / epsB[b];
+      epsReachedAt[b] = 0;
+    }
+    int numDone = B - (int)block.size();
+
+    for (int iter = 1; numDone < B; iter++) {
+      // g(c) = -eps * log sum_r exp(logA(r) + (f(r) - C(r, c)) / eps)
+      for (int c = 0; c < m; c++) {
+        for (int r = 0; r < n; r++) {
+          for (int b = 0; b < B; b++) {
+            work[r * B + b] = logA[r * B + b] + (f[r * B + b] - C[(r * m + c) * B + b]) * invEps[b];
           }
         }
+        block_log_sum_exp(work.data(), n, B, lse);
+        for (int b = 0; b < B; b++) {
+          g[c * B + b] = -epsB[b] * lse[b];
+        }
+      }
 
-        // For the time data, we add in the 'gamma' scaling factor calculated earlier
-        if ((M.E_dt() > 0) && (k == 1)) {
-          dist *= gamma;
+      // f(r) = -eps * log sum_c exp(logB + (g(c) - C(r, c)) / eps)
+      for (int r = 0; r < n; r++) {
+        for (int c = 0; c < m; c++) {
+          for (int b = 0; b < B; b++) {
+            work[c * B + b] = logB + (g[c * B + b] - C[(r * m + c) * B + b]) * invEps[b];
+          }
+        }
+        block_log_sum_exp(work.data(), m, B, lse);
+        for (int b = 0; b < B; b++) {
+          f[r * B + b] = -epsB[b] * lse[b];
         }
+      }
 
-        costMatrix(n, m) += dist;
+      if (iter % SINKHORN_CHECK_EVERY != 0) {
+        continue;
+      }
 
-        m += 1;
+      // After the f update, the plan P(r, c) = exp(logA(r) + logB + (f(r) + g(c) - C(r, c)) / eps) has the right
+      // row sums, so check how far its column sums are from 1/m, and calculate its transport cost.
+      std::fill_n(maxErr, B, 0.0);
+      std::fill_n(cost, B, 0.0);
+      for (int c = 0; c < m; c++) {
+        std::fill_n(lse, B, 0.0);
+        for (int r = 0; r < n; r++) {
+          for (int b = 0; b < B; b++) {
+            int rcb = (r * m + c) * B + b;
+            double plan = std::exp(logA[r * B + b] + logB + (f[r * B + b] + g[c * B + b] - C[rcb]) * invEps[b]);
+            lse[b] += plan;
+            cost[b] += plan * C[rcb];
+          }
+        }
+        for (int b = 0; b < B; b++) {
+          maxErr[b] = std::max(maxErr[b], std::abs(lse[b] - 1.0 / m));
+        }
       }
 
-      n += 1;
+      for (int b = 0; b < B; b++) {
+        if (done[b]) {
+          continue;
+        }
+        if (epsB[b] > eps) {
+          epsB[b] = std::max(eps, epsB[b] / 2);
+          invEps[b] = 1.0 / epsB[b];
+          epsReachedAt[b] = iter;
+        } else if (maxErr[b] < opts.sinkhornTolerance || iter - epsReachedAt[b] >= SINKHORN_MAX_ITERATIONS) {
+          done[b] = true;
+          numDone += 1;
+          blockDists[b] = cost[b];
+        }
+      }
+    }
+
+    for (int b = 0; b < (int)block.size(); b++) {
+      if (blockDists[b] != 0 && std::isnormal(blockDists[b])) {
+        dists.push_back(blockDists[b]);
+        inds.push_back(block[b]);
+      }
     }
   }
-  return flatCostMatrix;
+
+  return { inds, dists };
 }
 
-// TODO: Subtract the D(x,x) and D(y,y) parts from this.
-double approx_wasserstein(double* C, int len_i, int len_j, double eps, double stopErr)
+bool UnivariateWasserstein::is_applicable(const Options& opts, const Manifold& M)
 {
-  Eigen::Map<Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>> costMatrix(C, len_i, len_j);
-
-  double r = 1.0 / len_i;
-  double c = 1.0 / len_j;
-
-  Eigen::MatrixXd K = Eigen::exp(-costMatrix.array() / eps);
-  Eigen::MatrixXd Kp = len_i * K.array();
-
-  Eigen::VectorXd u = Eigen::VectorXd::Ones(len_i) / len_i;
-  Eigen::VectorXd v = Eigen::VectorXd::Ones(len_j) / len_j;
+  return opts.distance == Distance::Wasserstein && M.E_dt() == 0 && M.E_lagged_extras() == 0 &&
+         !opts.metrics.empty() && opts.metrics[0] == Metric::Diff;
+}
 
-  int maxIter = 10000;
-  for (int iter = 0; iter < maxIter; iter++) {
+UnivariateWasserstein::UnivariateWasserstein(const Manifold& M, const Manifold& Mp)
+  : _M(M)
+  , _Mp(Mp)
+{
+  sort_rows(M, _sortedM);
+  sort_rows(Mp, _sortedMp);
+}
 
-    v = c / (K.transpose() * u).array();
-    u = 1.0 / (Kp * v).array();
+void UnivariateWasserstein::sort_rows(const Manifold& M, SortedRows& sorted)
+{
+  sorted.E = M.E();
+  sorted.values.resize((size_t)M.nobs() * M.E());
+  sorted.lens.resize(M.nobs());
 
-    if (iter % 10 == 0) {
-      // Compute right marginal (diag(u) K diag(v))^T1
-      Eigen::VectorXd tempColSums = (u.asDiagonal() * K * v.asDiagonal()).colwise().sum();
-      double LInfErr = (tempColSums.array() - c).abs().maxCoeff();
-      if (LInfErr < stopErr) {
-        break;
+  for (int i = 0; i < M.nobs(); i++) {
+    double* row = &(sorted.values[(size_t)i * M.E()]);
+    int len = 0;
+    for (int j = 0; j < M.E(); j++) {
+      if (M.x(i, j) != MISSING_SENTINEL) {
+        row[len] = M.x(i, j);
+        len += 1;
       }
     }
+    std::sort(row, row + len);
+    sorted.lens[i] = len;
   }
-
-  Eigen::MatrixXd transportPlan = u.asDiagonal() * K * v.asDiagonal();
-  double dist = (transportPlan.array() * costMatrix.array()).sum();
-  return dist;
 }
 
-double wasserstein(double* C, int len_i, int len_j)
+// The Wasserstein distance between the empirical distributions putting mass 1/len_a on each point of 'a' and 1/len_b
+// on each point of 'b' (both sorted), i.e. the integral of the distance between their quantile functions.
+// The masses are counted in units of 1/(len_a * len_b) so the matching of the two quantile functions is exact.
+static double sorted_matching_cost(const double* a, int len_a, const double* b, int len_b)
 {
-  // Create vectors which are just 1/len_i and 1/len_j of length len_i and len_j.
-  auto w_1 = std::make_unique<double[]>(len_i);
-  std::fill_n(w_1.get(), len_i, 1.0 / len_i);
-  auto w_2 = std::make_unique<double[]>(len_j);
-  std::fill_n(w_2.get(), len_j, 1.0 / len_j);
+  double cost = 0.0;
 
-  int maxIter = 10000;
-  double cost;
-  EMD_wrap(len_i, len_j, w_1.get(), w_2.get(), C, &cost, maxIter);
-  return cost;
+  if (len_a == len_b) {
+    for (int n = 0; n < len_a; n++) {
+      cost += abs(a[n] - b[n]);
+    }
+    return cost / len_a;
+  }
+
+  int n = 0, m = 0;
+  int massLeft_a = len_b, massLeft_b = len_a;
+  while (n < len_a && m < len_b) {
+    int mass = std::min(massLeft_a, massLeft_b);
+    cost += mass * abs(a[n] - b[m]);
+
+    massLeft_a -= mass;
+    massLeft_b -= mass;
+    if (massLeft_a == 0) {
+      n += 1;
+      massLeft_a = len_b;
+    }
+    if (massLeft_b == 0) {
+      m += 1;
+      massLeft_b = len_a;
+    }
+  }
+
+  return cost / ((double)len_a * len_b);
 }
 
-DistanceIndexPairs wasserstein_distances(int Mp_i, const Options& opts, const Manifold& M, const Manifold& Mp,
-                                         std::vector<int> inpInds)
+DistanceIndexPairs UnivariateWasserstein::distances(int Mp_i, const Options& opts,
+                                                    const std::vector<int>& inpInds) const
 {
   std::vector<int> inds;
   std::vector<double> dists;
 
-  // Compare every observation in the M manifold to the
-  // Mp_i'th observation in the Mp manifold.
-  for (int i : inpInds) {
-    int len_i, len_j;
-    auto C = wasserstein_cost_matrix(M, Mp, i, Mp_i, opts, len_i, len_j);
+  bool skipMissing = (opts.missingdistance == 0);
 
-    if (len_i > 0 && len_j > 0) {
-      double dist_i = wasserstein(C.get(), len_i, len_j);
+  const double* b = &(_sortedMp.values[(size_t)Mp_i * _sortedMp.E]);
+  int len_j = _sortedMp.lens[Mp_i];
+  bool Mp_i_missing = (len_j < _sortedMp.E);
 
-      // Alternatively, the approximate version based on Sinkhorn's algorithm can be called with something like:
-      // double dist_i = approx_wasserstein(C.get(), len_i, len_j, 0.1, 0.1)
-      // In that case, the "std::isnormal" is really needed on the next line, as some
-      // instability gives us some 'nan' distances using that method.
+  for (int i : inpInds) {
+    int len_i = _sortedM.lens[i];
+    double dist_i;
 
-      if (dist_i != 0 && std::isnormal(dist_i)) {
-        dists.push_back(dist_i);
-        inds.push_back(i);
+    if (!skipMissing && (Mp_i_missing || len_i < _sortedM.E)) {
+      // A missing value costs 'missingdistance' to move anywhere, so this pair isn't a problem on the line.
+      int rows, cols;
+      std::vector<double>& C = wasserstein_workspace().C;
+      wasserstein_cost_matrix(_M, _Mp, i, Mp_i, opts, rows, cols, C);
+      dist_i = wasserstein(C.data(), rows, cols);
+    } else {
+      if (len_i == 0 || len_j == 0) {
+        continue;
       }
+      const double* a = &(_sortedM.values[(size_t)i * _sortedM.E]);
+      dist_i = wasserstein_unlagged_distance(_M, _Mp, i, Mp_i, opts, 1) + sorted_matching_cost(a, len_i, b, len_j);
+    }
+
+    if (dist_i != 0 && std::isnormal(dist_i)) {
+      dists.push_back(dist_i);
+      inds.push_back(i);
     }
   }
 
   return { inds, dists };
-}
\ No newline at end of file
+}
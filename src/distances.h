@@ -2,7 +2,312 @@
 
 #include "common.h"
 
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <mutex>
+
+// The L^1 / L^2 distance between M[i] and Mp[Mp_i], or MISSING_SENTINEL if it can't be calculated.
+double lp_distance(int i, int Mp_i, const Options& opts, const Manifold& M, const Manifold& Mp);
+
 DistanceIndexPairs lp_distances(int Mp_i, const Options& opts, const Manifold& M, const Manifold& Mp,
-                                std::vector<int> inds);
+                                const std::vector<int>& inds);
+
+// The same, but stored in 'result' so that its vectors' capacity is reused from one prediction to the next.
+void lp_distances(int Mp_i, const Options& opts, const Manifold& M, const Manifold& Mp, const std::vector<int>& inds,
+                  DistanceIndexPairs& result);
+
+// Keeps the k nearest of the candidate neighbours offered to it in a bounded max-heap keyed on (distance, position
+// in the list of candidates), so it picks the same neighbours as 'kNearestNeighbours' (ties going to the earlier
+// candidate) while only ever storing k of them, however many candidates there are.
+class NearestNeighbourHeap
+{
+public:
+  void reset(int k)
+  {
+    _k = k;
+    _numValid = 0;
+    _heap.clear();
+  }
+
+  // Offer the candidate at position 'pos', which has the (valid) distance 'dist'.
+  void add(double dist, int pos)
+  {
+    _numValid += 1;
+    if ((int)_heap.size() < _k) {
+      _heap.emplace_back(dist, pos);
+      std::push_heap(_heap.begin(), _heap.end());
+    } else if (std::make_pair(dist, pos) < _heap.front()) {
+      std::pop_heap(_heap.begin(), _heap.end());
+      _heap.back() = { dist, pos };
+      std::push_heap(_heap.begin(), _heap.end());
+    }
+  }
+
+  // Store the neighbours found among the candidates 'inds' in 'kNNs', sorted by distance, or if there were no more
+  // than k valid candidates then all of them in their original order (as 'make_prediction' would use them).
+  void finish(const std::vector<int>& inds, DistanceIndexPairs& kNNs, int& numValidDistances);
+
+private:
+  int _k = 0, _numValid = 0;
+  std::vector<std::pair<double, int>> _heap;
+};
+
+// Offer the valid L^1 / L^2 distances to the candidates 'inds' to the 'heap' (without storing them all).
+void lp_distances(int Mp_i, const Options& opts, const Manifold& M, const Manifold& Mp, const std::vector<int>& inds,
+                  NearestNeighbourHeap& heap);
+
+// The Wasserstein cost matrices between the observations of M and Mp. Everything which only depends on one of the
+// observations (its lagged time series with any skipped points compacted out, which of its points are missing, and
+// the time scale 'gamma') is worked out once per row here, so building the cost matrix for a pair of observations
+// is just a loop broadcasting the differences between two small blocks. The unlagged extras are already contiguous
+// in each row of the manifold, so they are read in place.
+class WassersteinCosts
+{
+public:
+  WassersteinCosts(const Options& opts, const Manifold& M, const Manifold& Mp);
+
+  // Calculate the same matrix as 'wasserstein_cost_matrix(M, Mp, i, j, opts, len_i, len_j, flatCostMatrix)'.
+  // If 'integerCosts' is given, it is set to whether the costs are all whole numbers which the network simplex can
+  // work with exactly (see 'whole_numbers'), as worked out from the two rows rather than from the matrix itself.
+  void cost_matrix(int i, int j, const Options& opts, int& len_i, int& len_j, std::vector<double>& flatCostMatrix,
+                   bool* integerCosts = nullptr) const;
+
+  // Calculate the same lower bound on the Wasserstein distance between M(i,.) and Mp(j,.) as the search for the
+  // k nearest neighbours does without 'costs', but from the means of each row worked out once here.
+  double lower_bound(int i, int j, const Options& opts, bool& valid) const;
+
+private:
+  struct Rows
+  {
+    std::vector<double> values; // The 'dims' lagged time series of each row, each given E slots
+    std::vector<char> missing;  // Whether each point of each row is missing (E slots for each row)
+    std::vector<bool> anyMissing;
+    std::vector<int> lens; // The number of points kept in each row
+    std::vector<double> gammas;
+    std::vector<char> whole;     // Whether each row's (non-missing) points are whole numbers, in each of the 'dims'
+    std::vector<double> maxAbs;  // The largest absolute value of each row's (non-missing) points, in each of the 'dims'
+    std::vector<double> means;   // The mean of each row's (non-missing) points, in each of the 'dims'
+  };
+
+  void preprocess(const Manifold& M, Rows& rows) const;
+  bool integer_costs(int i, int j, const Options& opts, double unlaggedDist, bool anyMissing) const;
+
+  const Manifold& _M;
+  const Manifold& _Mp;
+  bool _skipMissing;
+  int _E, _dims;
+  Rows _rowsM, _rowsMp;
+};
+
+// The Wasserstein distances between every pair of a set of the generator's points (e.g. the 'usable' ones) for one E,
+// filled in as they are calculated. The entry for (p, q) is the distance from training point p to prediction point q.
+// Without a 'dt' variable the cost matrix for (q, p) is just the transpose of that for (p, q), so the table is
+// 'symmetric' and keeps one entry for both, which is always calculated the same way round (the smaller point number
+// as the training point). Several threads can read & fill in the table at once; a distance may occasionally be
+// calculated twice, but always to the same value.
+class WassersteinDistanceTable
+{
+public:
+  WassersteinDistanceTable(const std::vector<bool>& points, bool symmetric);
+
+  // The size of the table for 'numPoints' points.
+  static size_t memory_needed(int numPoints, bool symmetric);
+
+  // Marks a distance which hasn't been calculated yet. It is negative (so not a real distance) rather than NaN, as
+  // NaN checks are optimised away under -ffast-math.
+  static constexpr double NOT_CALCULATED = -1.0;
+
+  // The distance, NOT_CALCULATED if it hasn't been calculated yet (or either point isn't in the table), or
+  // MISSING_SENTINEL if it can't be calculated.
+  double lookup(int p, int q) const
+  {
+    if (!in_table(p, q)) {
+      return NOT_CALCULATED;
+    }
+    return _dists[index(p, q)].load(std::memory_order_relaxed);
+  }
+
+  void store(int p, int q, double dist)
+  {
+    if (in_table(p, q)) {
+      _dists[index(p, q)].store(dist, std::memory_order_relaxed);
+    }
+  }
+
+  // Whether the entry for (p, q) is calculated the other way round, as the distance from q to p.
+  bool transposed(int p, int q) const { return _symmetric && p > q; }
+
+private:
+  bool in_table(int p, int q) const { return _slots[p] >= 0 && _slots[q] >= 0; }
+
+  size_t index(int p, int q) const
+  {
+    size_t a = _slots[p], b = _slots[q];
+    if (!_symmetric) {
+      return a * _numPoints + b;
+    }
+    if (a > b) {
+      std::swap(a, b);
+    }
+    return a * (2 * _numPoints - a + 1) / 2 + (b - a);
+  }
+
+  std::vector<int> _slots; // The position of each point among those in the table
+  size_t _numPoints;
+  bool _symmetric;
+  std::unique_ptr<std::atomic<double>[]> _dists;
+};
+
+// In 'explore' mode with 'full' or 'crossfold', the tasks for the same E compare many of the same pairs of points
+// (e.g. with k folds, each pair appears once in each of two folds). The tasks share their Wasserstein distances
+// through this cache, which gives each E a table of distances until the memory budget runs out.
+class WassersteinDistanceCache
+{
+public:
+  WassersteinDistanceCache(const std::vector<bool>& points, size_t memoryBudget)
+    : _points(points)
+    , _memoryLeft(memoryBudget)
+  {}
+
+  // The table for this E (created the first time it is asked for), or nullptr if it doesn't fit in the budget.
+  WassersteinDistanceTable* table(int E, bool symmetric);
+
+private:
+  std::mutex _mutex;
+  std::vector<bool> _points;
+  size_t _memoryLeft;
+  std::map<int, std::unique_ptr<WassersteinDistanceTable>> _tables;
+};
+
+// The distance functions below calculate the cost matrices using 'costs' if it is supplied.
+// The transport problems for the points of 'inds' are solved in order, and with 'warmStart' set each starts from
+// the previous one's optimal basis. Where a problem has several optimal plans, this can change which one is found
+// and so the rounding of its cost, so it is only used when the 'warmStartEMD' option asks for it (the pruned search
+// 'wasserstein_k_nearest_neighbours' and the solves stored in a 'table' always start cold).
+// If a 'table' is given, the distances are looked up there before being calculated (cold-started, the way round the
+// table says) and then stored in it. The manifolds must be built without 'copredict' for the table's points to match.
 DistanceIndexPairs wasserstein_distances(int Mp_i, const Options& opts, const Manifold& M, const Manifold& Mp,
-                                         std::vector<int> inds);
+                                         std::vector<int> inds, const WassersteinCosts* costs = nullptr,
+                                         bool warmStart = false, WassersteinDistanceTable* table = nullptr);
+
+// The Sinkhorn approximations to the Wasserstein distances, computed in the log domain for blocks of training points
+// at a time. Each distance is the transport cost of the (entropy-regularised) plan found for that pair alone.
+DistanceIndexPairs sinkhorn_distances(int Mp_i, const Options& opts, const Manifold& M, const Manifold& Mp,
+                                      const std::vector<int>& inds, const WassersteinCosts* costs = nullptr);
+
+// Find the k nearest neighbours of Mp[Mp_i] under the Wasserstein distance, giving the same result as the cold-started
+// 'kNearestNeighbours(wasserstein_distances(Mp_i, opts, M, Mp, inds, costs, false, table), k)' (with the same
+// tie-breaking).
+// A cheap lower bound on each distance is calculated first, and the transport problems are solved in order of
+// increasing bound until the bound exceeds the k-th smallest distance found. 'numValidDistances' counts all the
+// valid distances, including those which were never calculated.
+void wasserstein_k_nearest_neighbours(int Mp_i, const Options& opts, const Manifold& M, const Manifold& Mp,
+                                      const std::vector<int>& inds, int k, DistanceIndexPairs& kNNs,
+                                      int& numValidDistances, const WassersteinCosts* costs = nullptr,
+                                      WassersteinDistanceTable* table = nullptr);
+
+// The Wasserstein distances for a univariate embedding, i.e. when each observation is just E lags of one time series
+// (no 'dt' and no lagged extra variables). The optimal way to move one set of points on the line onto another is to
+// match them up in sorted order, so each row of the manifolds is sorted once here and then each distance only takes
+// O(E) time rather than a network simplex solve. Pairs where 'missingdistance' is used for a missing value aren't
+// a problem on the line, so they fall back to the general method.
+class UnivariateWasserstein
+{
+public:
+  static bool is_applicable(const Options& opts, const Manifold& M);
+
+  UnivariateWasserstein(const Manifold& M, const Manifold& Mp);
+
+  // Calculate the same distances as 'wasserstein_distances(Mp_i, opts, M, Mp, inds)'.
+  DistanceIndexPairs distances(int Mp_i, const Options& opts, const std::vector<int>& inds) const;
+
+private:
+  struct SortedRows
+  {
+    int E;
+    std::vector<double> values; // The non-missing values of each row in increasing order (E slots for each row)
+    std::vector<int> lens;      // The number of non-missing values in each row
+  };
+
+  static void sort_rows(const Manifold& M, SortedRows& sorted);
+
+  const Manifold& _M;
+  const Manifold& _Mp;
+  SortedRows _sortedM, _sortedMp;
+};
+
+// Finds the k nearest neighbours (under the Euclidean distance) for a whole block of prediction points at once.
+//
+// The squared distances are estimated for a tile of (prediction, training) pairs at a time with the identity
+// ||a - b||^2 = ||a||^2 + ||b||^2 - 2 a.b, so the bulk of the work is a cache-blocked matrix product.
+// These estimates are only used to rule out training points which are clearly too far away to be neighbours;
+// the remaining candidates have their exact distance calculated by 'lp_distance', so the neighbours found
+// are exactly those the brute-force search would find (including the treatment of 0 distances & ties).
+class BatchEuclideanNeighbours
+{
+public:
+  // Only applicable to the Euclidean distance when every variable is continuous. Training points with missing
+  // values are always compared directly, and prediction points with missing values are left to the brute-force search.
+  static bool is_applicable(const Options& opts, const Manifold& M);
+
+  BatchEuclideanNeighbours(const Options& opts, const Manifold& M);
+
+  // Find the k nearest neighbours of the points Mp[start:end]. The results follow the same conventions as
+  // 'NeighbourIndex::k_nearest_neighbours', and numValidDistances[i] is set to -1 if Mp[start + i] was skipped.
+  void k_nearest_neighbours(int start, int end, const Manifold& Mp, int k, std::vector<DistanceIndexPairs>& kNNs,
+                            std::vector<int>& numValidDistances) const;
+
+private:
+  const Options& _opts;
+  const Manifold& _M;
+  Eigen::VectorXd _sqNorms;
+  std::vector<bool> _missing;
+};
+
+// When the same training & prediction points are used for a sequence of increasing E values (e.g. an 'explore'
+// over E = 2, ..., 20), the squared L^2 distance for one E is just that of the previous E plus the terms for the new
+// lags of x. This keeps those running sums for every (prediction, training) pair, so each task only needs to add the
+// new lags of x (and then the dt & extra variables, which change with E and are recalculated every time).
+//
+// Each prediction point's sums are advanced by whichever task gets to it first; if a task with a smaller E turns
+// up later, it is told to fall back to calculating its distances from scratch.
+class LaggedDistanceSums
+{
+public:
+  // Only the Euclidean distance can be split up like this (the mean absolute error rescales every term by E).
+  static bool is_applicable(const Options& opts, int numTrainingPoints, int numPredictionPoints);
+
+  // As all the tasks are launched at once, every E-sweep in progress shares one memory budget for its sums. This
+  // takes the room for one sweep's sums out of it, returning false if there isn't enough left. The reservation is
+  // then handed to the constructor, and given back when the sums are destroyed.
+  static bool reserve_memory(int numTrainingPoints, int numPredictionPoints);
+
+  // The 'M' and 'Mp' manifolds are created for the largest E of the sweep (keeping the points with missing values).
+  LaggedDistanceSums(const Manifold& M, const Manifold& Mp, bool reservedMemory = false);
+  ~LaggedDistanceSums();
+
+  // Calculate the same distances as 'lp_distances(Mp_i, opts, M, Mp, inds)', where 'M' and 'Mp' contain the same
+  // points as the constructor's manifolds but for a smaller (or equal) E. Returns false if this isn't possible.
+  bool lp_distances(int Mp_i, const Options& opts, const Manifold& M, const Manifold& Mp, const std::vector<int>& inds,
+                    DistanceIndexPairs& result);
+  bool lp_distances(int Mp_i, const Options& opts, const Manifold& M, const Manifold& Mp, const std::vector<int>& inds,
+                    NearestNeighbourHeap& heap);
+
+private:
+  struct Row
+  {
+    std::mutex mutex;
+    int E = 0;                 // The number of lags of x included in the sums so far
+    std::vector<double> sums;  // The running sums (or MISSING_SENTINEL) to each training point
+  };
+
+  const Manifold _M, _Mp;
+  std::vector<Row> _rows;
+  size_t _reservedMemory;
+
+  // Call 'visit(pos, dist)' for each candidate inds[pos] with a valid (non-zero) distance, in order.
+  template<typename Visit>
+  bool for_each_distance(int Mp_i, const Options& opts, const Manifold& M, const Manifold& Mp,
+                         const std::vector<int>& inds, Visit visit);
+};
@@ -11,8 +11,8 @@
 #pragma warning(disable : 4018)
 
 #include "edm.h"
-#include "cpu.h"
 #include "distances.h"
+#include "neighbour_index.h"
 #include "stats.h" // for correlation and mean_absolute_error
 #include "thread_pool.h"
 #include "train_predict_split.h"
@@ -23,14 +23,41 @@
 
 #define EIGEN_NO_DEBUG
 #define EIGEN_DONT_PARALLELIZE
+#include <Eigen/Cholesky>
 #include <Eigen/SVD>
 #include <algorithm> // std::partial_sort
 #include <cmath>
 #include <fstream> // just to create low-level input dumps
 
+// When the nearest neighbours are found in batches, each worker handles this many predictions at once.
+const int PREDICTION_BLOCK_SIZE = 32;
+
+// Predictions are handed to the workers in chunks of about this many floating-point operations, which is enough
+// to make the scheduling overhead negligible, though we always leave several chunks per thread to balance the load.
+const double PREDICTION_CHUNK_COST = 1e5;
+const int CHUNKS_PER_THREAD = 8;
+
+// The S-map system is solved with an LDLT decomposition unless its smallest pivot is below this fraction of the
+// largest, in which case it is treated as rank deficient and solved (more slowly) using an SVD.
+const double SMAP_LDLT_TOLERANCE = 1e-10;
+
+// The S-map systems are of size E_actual + 1, and are stack-allocated up to this size.
+constexpr int SMAP_MAX_FIXED_SIZE = 17;
+
+// For k up to this size, the brute-force L^1 / L^2 search only keeps the k nearest neighbours found so far (in a
+// bounded heap) rather than storing every distance and then sorting them. For a large k (like xmap's) most of the
+// candidates would pass through the heap, so it is quicker to sort the distances once at the end.
+const int NEAREST_NEIGHBOUR_HEAP_MAX_K = 64;
+
 std::atomic<int> numTasksStarted = 0;
 std::atomic<int> numTasksFinished = 0;
-ThreadPool workerPool(0), taskRunnerPool(0);
+ThreadPool workerPool(0);
+
+PredictionWorkspace& prediction_workspace()
+{
+  thread_local PredictionWorkspace workspace;
+  return workspace;
+}
 
 std::vector<std::future<Prediction>> launch_task_group(const ManifoldGenerator& generator, Options opts,
                                                        const std::vector<int>& Es, const std::vector<int>& libraries,
@@ -38,15 +65,16 @@ std::vector<std::future<Prediction>> launch_task_group(const ManifoldGenerator&
                                                        bool saveFinalPredictions, bool saveFinalCoPredictions,
                                                        bool saveSMAPCoeffs, bool copredictMode,
                                                        const std::vector<bool>& usable, const std::string& rngState,
-                                                       IO* io, bool keep_going(), void all_tasks_finished())
+                                                       IO* io, bool keep_going(), void all_tasks_finished(),
+                                                       bool nestedLibraries)
 {
 
-  workerPool.set_num_workers(opts.nthreads);
-  taskRunnerPool.set_num_workers(num_physical_cores());
+  // The tasks run on the same pool as the work they split up, so 'nthreads' caps the total number of threads working.
+  workerPool.set_num_workers(std::max(opts.nthreads, 1), opts.pinThreads);
 
   // Construct the instance which will (repeatedly) split the data
   // into either the training manifold or the prediction manifold.
-  TrainPredictSplitter splitter = TrainPredictSplitter(explore, full, crossfold, usable, rngState);
+  TrainPredictSplitter splitter = TrainPredictSplitter(explore, full, crossfold, usable, rngState, nestedLibraries);
 
   int numLibraries = (explore ? 1 : libraries.size());
 
@@ -69,6 +97,28 @@ std::vector<std::future<Prediction>> launch_task_group(const ManifoldGenerator&
 
   bool newTrainPredictSplit = true;
 
+  // In 'explore' mode, every E uses the same training & prediction points (for a given replicate/fold)
+  // so the distances calculated for one E can be extended to the next E rather than starting from scratch.
+  bool sweepE = explore && Es.size() > 1;
+  std::shared_ptr<Deferred<LaggedDistanceSums>> sums, coSums;
+
+  // In 'xmap' mode with nested libraries, each library's training set is a subset of the largest library's
+  // training set, so the neighbours for each library can be found from the distances for the largest library.
+  nestedLibraries = nestedLibraries && !explore && libraries.size() > 1;
+  int maxLibrary = nestedLibraries ? *std::max_element(libraries.begin(), libraries.end()) : 0;
+  std::shared_ptr<Deferred<NestedLibraryNeighbours>> nested, coNested;
+
+  // The tasks which use the same training or prediction manifold share one copy of it. The cache also holds the
+  // only copy of the generator which the tasks use (the caller's copy may be gone before they finish).
+  auto cache = std::make_shared<ManifoldCache>(std::make_shared<const ManifoldGenerator>(generator), &workerPool);
+
+  // With 'full' or 'crossfold', the tasks for each E compare many of the same pairs of points, so (given a memory
+  // budget for it) they share their Wasserstein distances. The copredictions use other points so they can't join in.
+  std::shared_ptr<WassersteinDistanceCache> distanceCache;
+  if (explore && (full || crossfold > 0) && opts.distance == Distance::Wasserstein && opts.distanceCacheMB > 0) {
+    distanceCache = std::make_shared<WassersteinDistanceCache>(usable, (size_t)opts.distanceCacheMB << 20);
+  }
+
   // Note: the 'numReps' either refers to the 'replicate' option
   // used for bootstrap resampling, or the 'crossfold' number of
   // cross-validation folds. Both options can't be used together,
@@ -89,6 +139,20 @@ std::vector<std::future<Prediction>> launch_task_group(const ManifoldGenerator&
           newTrainPredictSplit = true;
         }
 
+        if (nestedLibraries && l == 0) {
+          splitter.update_train_predict_split(maxLibrary, iter);
+          nested = std::make_shared<Deferred<NestedLibraryNeighbours>>(
+            [cache, opts, E, trainingRows = splitter.trainingRows(), predictionRows = splitter.predictionRows()] {
+              return make_nested_library_neighbours(cache->generator(), opts, E, trainingRows, predictionRows, false);
+            });
+          if (copredictMode) {
+            coNested = std::make_shared<Deferred<NestedLibraryNeighbours>>(
+              [cache, opts, E, trainingRows = splitter.trainingRows(), cousable] {
+                return make_nested_library_neighbours(cache->generator(), opts, E, trainingRows, cousable, true);
+              });
+          }
+        }
+
         if (explore) {
           library = trainSize;
         } else {
@@ -118,13 +182,26 @@ std::vector<std::future<Prediction>> launch_task_group(const ManifoldGenerator&
         if (newTrainPredictSplit) {
           splitter.update_train_predict_split(library, iter);
           newTrainPredictSplit = false;
+
+          if (sweepE) {
+            sums = std::make_shared<Deferred<LaggedDistanceSums>>(
+              [cache, opts, maxE, trainingRows = splitter.trainingRows(), predictionRows = splitter.predictionRows()] {
+                return make_lagged_distance_sums(cache->generator(), opts, maxE, trainingRows, predictionRows, false);
+              });
+            if (copredictMode) {
+              coSums = std::make_shared<Deferred<LaggedDistanceSums>>(
+                [cache, opts, maxE, trainingRows = splitter.trainingRows(), cousable] {
+                  return make_lagged_distance_sums(cache->generator(), opts, maxE, trainingRows, cousable, true);
+                });
+            }
+          }
         }
 
         opts.copredict = false;
         opts.k = kAdj;
 
-        futures.emplace_back(launch_edm_task(generator, opts, E, splitter.trainingRows(), splitter.predictionRows(), io,
-                                             keep_going, all_tasks_finished));
+        futures.emplace_back(launch_edm_task(cache, opts, E, splitter.trainingRows(), splitter.predictionRows(), io,
+                                             keep_going, all_tasks_finished, sums, nested, distanceCache));
 
         opts.taskNum += 1;
 
@@ -136,8 +213,8 @@ std::vector<std::future<Prediction>> launch_task_group(const ManifoldGenerator&
             opts.savePrediction = saveFinalCoPredictions && ((iter == numReps)) && lastConfig;
           }
           opts.saveSMAPCoeffs = false;
-          futures.emplace_back(
-            launch_edm_task(generator, opts, E, splitter.trainingRows(), cousable, io, keep_going, all_tasks_finished));
+          futures.emplace_back(launch_edm_task(cache, opts, E, splitter.trainingRows(), cousable, io, keep_going,
+                                               all_tasks_finished, coSums, coNested));
 
           opts.taskNum += 1;
         }
@@ -150,17 +227,63 @@ std::vector<std::future<Prediction>> launch_task_group(const ManifoldGenerator&
   return futures;
 }
 
-std::future<Prediction> launch_edm_task(const ManifoldGenerator& generator, Options opts, int E,
+// Set up the running distance sums for a sweep over E (up to 'maxE') with the given training & prediction points,
+// or return nullptr if this isn't possible (or there's no room left for them in the memory budget).
+std::shared_ptr<LaggedDistanceSums> make_lagged_distance_sums(const ManifoldGenerator& generator, const Options& opts,
+                                                              int maxE, const std::vector<bool>& trainingRows,
+                                                              const std::vector<bool>& predictionRows, bool copredict)
+{
+  int numTrainingPoints = std::count(trainingRows.begin(), trainingRows.end(), true);
+  int numPredictionPoints = std::count(predictionRows.begin(), predictionRows.end(), true);
+
+  if (!LaggedDistanceSums::is_applicable(opts, numTrainingPoints, numPredictionPoints) ||
+      !LaggedDistanceSums::reserve_memory(numTrainingPoints, numPredictionPoints)) {
+    return nullptr;
+  }
+
+  Manifold M = generator.create_manifold(maxE, trainingRows, copredict, false, opts.dtWeight);
+  Manifold Mp = generator.create_manifold(maxE, predictionRows, copredict, true, opts.dtWeight);
+  return std::make_shared<LaggedDistanceSums>(M, Mp, true);
+}
+
+// Set up the sorted neighbour lists for a sweep over nested libraries (for a given E), where the largest library
+// uses the given training points, or return nullptr if this isn't possible.
+std::shared_ptr<NestedLibraryNeighbours> make_nested_library_neighbours(const ManifoldGenerator& generator,
+                                                                        const Options& opts, int E,
+                                                                        const std::vector<bool>& trainingRows,
+                                                                        const std::vector<bool>& predictionRows,
+                                                                        bool copredict)
+{
+  int numTrainingPoints = std::count(trainingRows.begin(), trainingRows.end(), true);
+  int numPredictionPoints = std::count(predictionRows.begin(), predictionRows.end(), true);
+
+  if (!NestedLibraryNeighbours::is_applicable(numTrainingPoints, numPredictionPoints)) {
+    return nullptr;
+  }
+
+  bool skipMissing = (opts.algorithm == Algorithm::SMap);
+  Manifold M = generator.create_manifold(E, trainingRows, copredict, false, opts.dtWeight);
+  Manifold Mp = generator.create_manifold(E, predictionRows, copredict, true, opts.dtWeight);
+  bool skipOtherPanels = opts.panelMode && (opts.idw < 0);
+  return std::make_shared<NestedLibraryNeighbours>(M, Mp, trainingRows, skipMissing, skipOtherPanels);
+}
+
+std::future<Prediction> launch_edm_task(std::shared_ptr<ManifoldCache> cache, Options opts, int E,
                                         const std::vector<bool>& trainingRows, const std::vector<bool>& predictionRows,
-                                        IO* io, bool keep_going(), void all_tasks_finished())
+                                        IO* io, bool keep_going(), void all_tasks_finished(),
+                                        std::shared_ptr<Deferred<LaggedDistanceSums>> sums,
+                                        std::shared_ptr<Deferred<NestedLibraryNeighbours>> nested,
+                                        std::shared_ptr<WassersteinDistanceCache> distanceCache)
 {
+  const ManifoldGenerator& generator = cache->generator();
+
   // Expand the 'metrics' vector now that we know the value of E.
   std::vector<Metric> metrics;
 
   // For the Wasserstein distance, it's more convenient to have one 'metric' for each variable (before taking lags).
   // However, for the L^1 / L^2 distances, it's more convenient to have one 'metric' for each individual
   // point of each observations, so metrics.size() == M.E_actual().
-  if (opts.distance == Distance::Wasserstein) {
+  if (is_transport_distance(opts.distance)) {
     // Add a metric for the main variable and for the dt variable.
     // These are always treated as a continuous values (though perhaps in the future this will change).
     metrics.push_back(Metric::Diff);
@@ -214,16 +337,48 @@ std::future<Prediction> launch_edm_task(const ManifoldGenerator& generator, Opti
   // Note, we can't have missing data inside the training manifold when using the S-Map algorithm
   bool skipMissing = (opts.algorithm == Algorithm::SMap);
 
-  Manifold M = generator.create_manifold(E, trainingRows, opts.copredict, false, opts.dtWeight, skipMissing);
-  Manifold Mp = generator.create_manifold(E, predictionRows, opts.copredict, true, opts.dtWeight);
+  // The manifolds are built inside the task rather than here, so launching a task group returns straight away
+  // and building the later tasks' manifolds overlaps with making the earlier tasks' predictions.
+  return workerPool.enqueue([opts, E, trainingRows, predictionRows, skipMissing, cache, io, keep_going,
+                             all_tasks_finished, sums, nested, distanceCache] {
+    std::shared_ptr<const Manifold> M =
+      cache->create_manifold(E, trainingRows, opts.copredict, false, opts.dtWeight, skipMissing);
+    std::shared_ptr<const Manifold> Mp =
+      cache->create_manifold(E, predictionRows, opts.copredict, true, opts.dtWeight);
+
+    // Each library in a nested library sweep picks out its own training points from the largest library.
+    std::unique_ptr<NestedLibraryNeighbours> library;
+    const NestedLibraryNeighbours* largest = (nested != nullptr) ? nested->get() : nullptr;
+    if (largest != nullptr) {
+      library = std::make_unique<NestedLibraryNeighbours>(largest->restrict_to(trainingRows));
+    }
 
-  return taskRunnerPool.enqueue([opts, M, Mp, predictionRows, io, keep_going, all_tasks_finished] {
-    return edm_task(opts, M, Mp, predictionRows, io, keep_going, all_tasks_finished);
+    return edm_task(opts, *M, *Mp, predictionRows, io, keep_going, all_tasks_finished,
+                    (sums != nullptr) ? sums->get() : nullptr, library.get(), distanceCache.get());
   });
 }
 
-Prediction edm_task(const Options opts, const Manifold M, const Manifold Mp, const std::vector<bool> predictionRows,
-                    IO* io, bool keep_going(), void all_tasks_finished())
+// Choose how many blocks of predictions each worker takes at a time, from a rough estimate of the cost of
+// one prediction: comparing to each training point (unless an index narrows the search down), where a Wasserstein
+// comparison solves a transport problem of size ~E_actual, and then fitting the k neighbours for each theta.
+int prediction_grain_size(const Options& opts, const Manifold& M, int blockSize, int numBlocks, bool searchAll)
+{
+  double E = M.E_actual();
+  double k = (opts.k > 0) ? std::min(opts.k, M.nobs()) : M.nobs();
+
+  double perNeighbour = is_transport_distance(opts.distance) ? E * E * E : E;
+  double numCompared = searchAll ? M.nobs() : k * std::max(std::log2((double)M.nobs()), 1.0);
+  double perTheta = (opts.algorithm == Algorithm::SMap) ? k * (E + 1) * (E + 1) : k;
+  double cost = numCompared * perNeighbour + opts.thetas.size() * perTheta;
+
+  int grain = (int)(PREDICTION_CHUNK_COST / (cost * blockSize));
+  int maxGrain = numBlocks / (CHUNKS_PER_THREAD * std::max(opts.nthreads, 1));
+  return std::max(1, std::min(grain, maxGrain));
+}
+
+Prediction edm_task(const Options opts, const Manifold& M, const Manifold& Mp, const std::vector<bool> predictionRows,
+                    IO* io, bool keep_going(), void all_tasks_finished(), LaggedDistanceSums* sums,
+                    const NestedLibraryNeighbours* nested, WassersteinDistanceCache* distanceCache)
 {
   bool multiThreaded = opts.nthreads > 1;
   int numThetas = (int)opts.thetas.size();
@@ -248,37 +403,78 @@ Prediction edm_task(const Options opts, const Manifold M, const Manifold Mp, con
     kUsed.push_back(-1);
   }
 
+  // Build a spatial index over the training manifold (when it's worthwhile) so that each prediction
+  // doesn't need to compute the distance to every training point. For the Euclidean distance, unless the
+  // embedding is small enough for a KD-tree, it is faster still to find the neighbours for a block of
+  // predictions at once using matrix products. Neither is needed when the neighbours come from a nested library sweep.
+  std::unique_ptr<NeighbourIndex> index;
+  std::unique_ptr<BatchEuclideanNeighbours> batch;
+  if (nested != nullptr) {
+    // The neighbours are found by filtering the largest library's sorted neighbour lists.
+  } else if (M.E_actual() > KD_TREE_MAX_DIMS && BatchEuclideanNeighbours::is_applicable(opts, M)) {
+    batch = std::make_unique<BatchEuclideanNeighbours>(opts, M);
+  } else if (NeighbourIndex::is_applicable(opts, M)) {
+    index = std::make_unique<NeighbourIndex>(opts, M);
+  } else if (BatchEuclideanNeighbours::is_applicable(opts, M)) {
+    batch = std::make_unique<BatchEuclideanNeighbours>(opts, M);
+  }
+
+  // Univariate Wasserstein distances are much quicker to compute once each row is sorted.
+  std::unique_ptr<UnivariateWasserstein> univariate;
+  if (UnivariateWasserstein::is_applicable(opts, M)) {
+    univariate = std::make_unique<UnivariateWasserstein>(M, Mp);
+  }
+
+  // Otherwise, the Wasserstein cost matrices are built from blocks which are prepared once for each row.
+  std::unique_ptr<WassersteinCosts> costs;
+  if (univariate == nullptr && is_transport_distance(opts.distance)) {
+    costs = std::make_unique<WassersteinCosts>(opts, M, Mp);
+  }
+
+  // The distances already calculated by the other tasks for this E can be reused.
+  WassersteinDistanceTable* distanceTable = nullptr;
+  if (distanceCache != nullptr && univariate == nullptr) {
+    distanceTable = distanceCache->table(M.E(), M.E_dt() == 0);
+  }
+
+  int blockSize = (batch != nullptr) ? PREDICTION_BLOCK_SIZE : 1;
+  int numBlocks = (numPredictions + blockSize - 1) / blockSize;
+
+  auto predict_block = [&](int block) {
+    int start = block * blockSize;
+    int end = std::min(start + blockSize, numPredictions);
+    make_predictions(start, end, opts, M, Mp, ystarView, rcView, coeffsView, &(kUsed[start]), keep_going,
+                     index.get(), batch.get(), sums, nested, univariate.get(), costs.get(), distanceTable);
+  };
+
   if (opts.numTasks > 1 && opts.taskNum == 0) {
     io->progress_bar(0.0);
   }
 
   if (multiThreaded) {
-    std::vector<std::future<void>> results(numPredictions);
-    for (int i = 0; i < numPredictions; i++) {
-      results[i] = workerPool.enqueue(
-        [&, i] { make_prediction(i, opts, M, Mp, ystarView, rcView, coeffsView, &(kUsed[i]), keep_going); });
-    }
-
     if (opts.numTasks == 1) {
       io->progress_bar(0.0);
     }
-    for (int i = 0; i < numPredictions; i++) {
-      results[i].get();
-      if (opts.numTasks == 1) {
-        io->progress_bar((i + 1) / ((double)numPredictions));
-      }
+
+    std::function<void(int)> report_progress;
+    if (opts.numTasks == 1) {
+      report_progress = [io, numBlocks](int numDone) { io->progress_bar(numDone / ((double)numBlocks)); };
     }
+
+    bool searchAll = (index == nullptr && nested == nullptr);
+    int grain = prediction_grain_size(opts, M, blockSize, numBlocks, searchAll);
+    workerPool.parallel_for(0, numBlocks, grain, predict_block, report_progress);
   } else {
     if (opts.numTasks == 1) {
       io->progress_bar(0.0);
     }
-    for (int i = 0; i < numPredictions; i++) {
+    for (int b = 0; b < numBlocks; b++) {
       if (keep_going != nullptr && keep_going() == false) {
         break;
       }
-      make_prediction(i, opts, M, Mp, ystarView, rcView, coeffsView, &(kUsed[i]), keep_going);
+      predict_block(b);
       if (opts.numTasks == 1) {
-        io->progress_bar((i + 1) / ((double)numPredictions));
+        io->progress_bar((b + 1) / ((double)numBlocks));
       }
     }
   }
@@ -384,8 +580,16 @@ Prediction edm_task(const Options opts, const Manifold M, const Manifold Mp, con
 // In this case, the algorithm may cheat by pulling out the identical trajectory from the training manifold
 // and using this as the prediction. As such, we throw away any neighbours which have a distance of 0 from
 // the target point.
+//
+// If an 'index' over the training manifold is supplied, it is used to find the nearest neighbours
+// (falling back to the brute-force search when the index can't handle this particular point).
+// The brute-force search can reuse the distance 'sums' from the previous E in an E-sweep, or be replaced
+// by filtering the 'nested' library neighbours in a library sweep.
 void make_prediction(int Mp_i, const Options& opts, const Manifold& M, const Manifold& Mp, Eigen::Map<MatrixXd> ystar,
-                     Eigen::Map<MatrixXi> rc, Eigen::Map<MatrixXd> coeffs, int* kUsed, bool keep_going())
+                     Eigen::Map<MatrixXi> rc, Eigen::Map<MatrixXd> coeffs, int* kUsed, bool keep_going(),
+                     const NeighbourIndex* index, LaggedDistanceSums* sums, const NestedLibraryNeighbours* nested,
+                     const UnivariateWasserstein* univariate, const WassersteinCosts* costs,
+                     WassersteinDistanceTable* distanceTable)
 {
   // An impatient user may want to cancel a long-running EDM command, so we occasionally check using this
   // callback to see whether we ought to keep going with this EDM command. Of course, this adds a tiny inefficiency,
@@ -395,23 +599,112 @@ void make_prediction(int Mp_i, const Options& opts, const Manifold& M, const Man
     return;
   }
 
-  // Create a list of indices which may potentially be the neighbours of Mp(Mp_i,.)
-  std::vector<int> tryInds = potential_neighbour_indices(Mp_i, opts, M, Mp);
+  PredictionWorkspace& workspace = prediction_workspace();
+  DistanceIndexPairs& kNNs = workspace.kNNs;
+  int numValidDistances;
 
-  DistanceIndexPairs potentialNN;
-  if (opts.distance == Distance::Wasserstein) {
-    potentialNN = wasserstein_distances(Mp_i, opts, M, Mp, tryInds);
-  } else {
-    potentialNN = lp_distances(Mp_i, opts, M, Mp, tryInds);
+  bool usedIndex =
+    (nested != nullptr) && nested->k_nearest_neighbours(Mp_i, opts, M, Mp, opts.k, kNNs, numValidDistances);
+
+  if (!usedIndex && index != nullptr) {
+    usedIndex = index->k_nearest_neighbours(Mp_i, Mp, opts.k, kNNs, numValidDistances);
+  }
+
+  if (!usedIndex) {
+    // Create a list of indices which may potentially be the neighbours of Mp(Mp_i,.)
+    std::vector<int>& tryInds = workspace.tryInds;
+    potential_neighbour_indices(Mp_i, opts, M, Mp, tryInds);
+
+    if (univariate == nullptr && opts.distance == Distance::Wasserstein && opts.k > 0) {
+      // Only the k nearest neighbours are needed, so most of the (expensive) transport problems can be skipped.
+      wasserstein_k_nearest_neighbours(Mp_i, opts, M, Mp, tryInds, opts.k, kNNs, numValidDistances, costs,
+                                       distanceTable);
+    } else if (!is_transport_distance(opts.distance) && opts.k > 0 && opts.k <= NEAREST_NEIGHBOUR_HEAP_MAX_K) {
+      // Stream the distances through a heap of the k nearest neighbours, so they're never all stored.
+      NearestNeighbourHeap& heap = workspace.heap;
+      heap.reset(opts.k);
+      if (sums == nullptr || !sums->lp_distances(Mp_i, opts, M, Mp, tryInds, heap)) {
+        lp_distances(Mp_i, opts, M, Mp, tryInds, heap);
+      }
+      heap.finish(tryInds, kNNs, numValidDistances);
+    } else {
+      DistanceIndexPairs& potentialNN = workspace.potentialNN;
+      if (univariate != nullptr) {
+        potentialNN = univariate->distances(Mp_i, opts, tryInds);
+      } else if (opts.distance == Distance::Wasserstein) {
+        potentialNN = wasserstein_distances(Mp_i, opts, M, Mp, tryInds, costs, opts.warmStartEMD, distanceTable);
+      } else if (opts.distance == Distance::Sinkhorn) {
+        potentialNN = sinkhorn_distances(Mp_i, opts, M, Mp, tryInds, costs);
+      } else if (sums == nullptr || !sums->lp_distances(Mp_i, opts, M, Mp, tryInds, potentialNN)) {
+        lp_distances(Mp_i, opts, M, Mp, tryInds, potentialNN);
+      }
+
+      numValidDistances = potentialNN.inds.size();
+
+      // If we asked for all of the neighbours to be considered (e.g. with k = -1), return this index vector directly.
+      if (opts.k < 0 || opts.k >= numValidDistances) {
+        kNNs = potentialNN;
+      } else {
+        kNearestNeighbours(potentialNN, opts.k, kNNs, workspace.idx);
+      }
+    }
+  }
+
+  predict_using_neighbours(Mp_i, opts, M, Mp, kNNs, numValidDistances, ystar, rc, coeffs, kUsed, keep_going);
+}
+
+// Make the predictions for the block of points Mp[start:end], storing each 'kUsed' value in kUsed[0:(end-start)].
+// If a 'batch' neighbour search is supplied, the nearest neighbours of the whole block are found together.
+void make_predictions(int start, int end, const Options& opts, const Manifold& M, const Manifold& Mp,
+                      Eigen::Map<MatrixXd> ystar, Eigen::Map<MatrixXi> rc, Eigen::Map<MatrixXd> coeffs, int* kUsed,
+                      bool keep_going(), const NeighbourIndex* index, const BatchEuclideanNeighbours* batch,
+                      LaggedDistanceSums* sums, const NestedLibraryNeighbours* nested,
+                      const UnivariateWasserstein* univariate, const WassersteinCosts* costs,
+                      WassersteinDistanceTable* distanceTable)
+{
+  if (batch == nullptr) {
+    for (int Mp_i = start; Mp_i < end; Mp_i++) {
+      make_prediction(Mp_i, opts, M, Mp, ystar, rc, coeffs, &(kUsed[Mp_i - start]), keep_going, index, sums, nested,
+                      univariate, costs, distanceTable);
+    }
+    return;
+  }
+
+  if (keep_going != nullptr && keep_going() == false) {
+    for (int Mp_i = start; Mp_i < end; Mp_i++) {
+      rc(0, Mp_i) = BREAK_HIT;
+    }
+    return;
+  }
+
+  std::vector<DistanceIndexPairs> kNNs;
+  std::vector<int> numValidDistances;
+  batch->k_nearest_neighbours(start, end, Mp, opts.k, kNNs, numValidDistances);
+
+  for (int Mp_i = start; Mp_i < end; Mp_i++) {
+    int r = Mp_i - start;
+    if (numValidDistances[r] < 0) {
+      make_prediction(Mp_i, opts, M, Mp, ystar, rc, coeffs, &(kUsed[r]), keep_going, index, sums, nested, univariate,
+                      costs, distanceTable);
+    } else {
+      predict_using_neighbours(Mp_i, opts, M, Mp, kNNs[r], numValidDistances[r], ystar, rc, coeffs, &(kUsed[r]),
+                               keep_going);
+    }
   }
+}
 
+// Make the prediction for Mp(Mp_i,.) given its nearest neighbours in the training manifold. These are either
+// the k nearest neighbours sorted by distance, or (if there are no more than k valid neighbours) all of them.
+void predict_using_neighbours(int Mp_i, const Options& opts, const Manifold& M, const Manifold& Mp,
+                              const DistanceIndexPairs& kNNs, int numValidDistances, Eigen::Map<MatrixXd> ystar,
+                              Eigen::Map<MatrixXi> rc, Eigen::Map<MatrixXd> coeffs, int* kUsed, bool keep_going())
+{
   if (keep_going != nullptr && keep_going() == false) {
     rc(0, Mp_i) = BREAK_HIT;
     return;
   }
 
   // Do we have enough distances to find k neighbours?
-  int numValidDistances = potentialNN.inds.size();
   int k = opts.k;
   *kUsed = numValidDistances;
   if (k > numValidDistances) {
@@ -430,37 +723,30 @@ void make_prediction(int Mp_i, const Options& opts, const Manifold& M, const Man
     return;
   }
 
-  // If we asked for all of the neighbours to be considered (e.g. with k = -1), return this index vector directly.
-  DistanceIndexPairs kNNs;
-  if (k < 0 || k == potentialNN.inds.size()) {
-    kNNs = potentialNN;
-  } else {
-    kNNs = kNearestNeighbours(potentialNN, k);
-  }
-
-  if (keep_going != nullptr && keep_going() == false) {
-    rc(0, Mp_i) = BREAK_HIT;
-    return;
-  }
-
   if (opts.algorithm == Algorithm::Simplex) {
     for (int t = 0; t < opts.thetas.size(); t++) {
       simplex_prediction(Mp_i, t, opts, M, kNNs.dists, kNNs.inds, ystar, rc, kUsed);
     }
   } else if (opts.algorithm == Algorithm::SMap) {
-    for (int t = 0; t < opts.thetas.size(); t++) {
-      smap_prediction(Mp_i, t, opts, M, Mp, kNNs.dists, kNNs.inds, ystar, coeffs, rc, kUsed);
-    }
+    smap_predictions(Mp_i, opts, M, Mp, kNNs.dists, kNNs.inds, ystar, coeffs, rc, kUsed);
   } else {
     rc(0, Mp_i) = INVALID_ALGORITHM;
   }
 }
 
 std::vector<int> potential_neighbour_indices(int Mp_i, const Options& opts, const Manifold& M, const Manifold& Mp)
+{
+  std::vector<int> inds;
+  potential_neighbour_indices(Mp_i, opts, M, Mp, inds);
+  return inds;
+}
+
+void potential_neighbour_indices(int Mp_i, const Options& opts, const Manifold& M, const Manifold& Mp,
+                                 std::vector<int>& inds)
 {
   bool skipOtherPanels = opts.panelMode && (opts.idw < 0);
 
-  std::vector<int> inds;
+  inds.clear();
 
   for (int i = 0; i < M.nobs(); i++) {
     if (skipOtherPanels && (M.panel(i) != Mp.panel(Mp_i))) {
@@ -469,8 +755,6 @@ std::vector<int> potential_neighbour_indices(int Mp_i, const Options& opts, cons
 
     inds.push_back(i);
   }
-
-  return inds;
 }
 
 // For a given point, find the k nearest neighbours of this point.
@@ -483,36 +767,42 @@ std::vector<int> potential_neighbour_indices(int Mp_i, const Options& opts, cons
 // However for a typical 'edm xmap' the value of 'k' is set as large as possible.
 // If 'k' is small, the partial_sort is efficient as it only finds the 'k' smallest
 // distances. If 'k' is larger, then it is faster to simply sort the entire distance
-// vector.
+// vector. Either way, ties are split by the index, which gives the same order as a
+// stable sort without it needing to allocate a temporary buffer.
 DistanceIndexPairs kNearestNeighbours(const DistanceIndexPairs& potentialNeighbours, int k)
 {
-  std::vector<int> idx(potentialNeighbours.inds.size());
+  DistanceIndexPairs kNNs;
+  std::vector<int> idx;
+  kNearestNeighbours(potentialNeighbours, k, kNNs, idx);
+  return kNNs;
+}
+
+void kNearestNeighbours(const DistanceIndexPairs& potentialNeighbours, int k, DistanceIndexPairs& kNNs,
+                        std::vector<int>& idx)
+{
+  idx.resize(potentialNeighbours.inds.size());
   std::iota(idx.begin(), idx.end(), 0);
 
-  if (k >= (int)(idx.size() / 2)) {
-    auto comparator = [&potentialNeighbours](int i1, int i2) {
+  auto stableComparator = [&potentialNeighbours](int i1, int i2) {
+    if (potentialNeighbours.dists[i1] != potentialNeighbours.dists[i2])
       return potentialNeighbours.dists[i1] < potentialNeighbours.dists[i2];
-    };
-    std::stable_sort(idx.begin(), idx.end(), comparator);
+    else
+      return i1 < i2;
+  };
+
+  if (k >= (int)(idx.size() / 2)) {
+    std::sort(idx.begin(), idx.end(), stableComparator);
   } else {
-    auto stableComparator = [&potentialNeighbours](int i1, int i2) {
-      if (potentialNeighbours.dists[i1] != potentialNeighbours.dists[i2])
-        return potentialNeighbours.dists[i1] < potentialNeighbours.dists[i2];
-      else
-        return i1 < i2;
-    };
     std::partial_sort(idx.begin(), idx.begin() + k, idx.end(), stableComparator);
   }
 
-  std::vector<int> kNNInds(k);
-  std::vector<double> kNNDists(k);
+  kNNs.inds.resize(k);
+  kNNs.dists.resize(k);
 
   for (int i = 0; i < k; i++) {
-    kNNInds[i] = potentialNeighbours.inds[idx[i]];
-    kNNDists[i] = potentialNeighbours.dists[idx[i]];
+    kNNs.inds[i] = potentialNeighbours.inds[idx[i]];
+    kNNs.dists[i] = potentialNeighbours.dists[idx[i]];
   }
-
-  return { kNNInds, kNNDists };
 }
 
 // An alternative version of 'kNearestNeighbours' which doesn't sort the neighbours.
@@ -549,7 +839,8 @@ void simplex_prediction(int Mp_i, int t, const Options& opts, const Manifold& M,
   double minDist = *std::min_element(dists.begin(), dists.end());
 
   // Calculate our weighting of each neighbour, and the total sum of these weights.
-  std::vector<double> w(k);
+  std::vector<double>& w = prediction_workspace().w;
+  w.resize(k);
   double sumw = 0.0;
   const double theta = opts.thetas[t];
 
@@ -576,65 +867,160 @@ void simplex_prediction(int Mp_i, int t, const Options& opts, const Manifold& M,
   rc(t, Mp_i) = SUCCESS;
 }
 
-void smap_prediction(int Mp_i, int t, const Options& opts, const Manifold& M, const Manifold& Mp,
-                     const std::vector<double>& dists, const std::vector<int>& kNNInds, Eigen::Map<MatrixXd> ystar,
-                     Eigen::Map<MatrixXd> coeffs, Eigen::Map<MatrixXi> rc, int* kUsed)
+// The S-map coefficients solve the weighted least squares problem
+//
+//     min_c || w .* (X c - y) ||,
+//
+// where the rows of X are the nearest neighbours in M prefixed with a 1 and y are their targets, and we solve it
+// via the normal equations (X^T W^2 X) c = X^T W^2 y. Both sides are weighted sums over the neighbours, so we
+// gather each neighbour's contribution once: row i of this matrix holds the lower triangle of x_i x_i^T (row by
+// row) followed by y_i x_i. Then the normal equations for any set of weights come from a single matrix product.
+void smap_neighbour_products(const Manifold& M, const std::vector<int>& kNNInds, MatrixXd& products)
 {
-  int k = kNNInds.size();
+  int n = M.E_actual() + 1;
+  int numProducts = n * (n + 1) / 2 + n;
 
-  // Pull out the nearest neighbours from the manifold, and
-  // simultaneously prepend a column of ones in front of the manifold data.
-  MatrixXd X_ls_cj(k, M.E_actual() + 1);
-  X_ls_cj << Eigen::VectorXd::Ones(k), M.map()(kNNInds, Eigen::all);
+  products.resize(kNNInds.size(), numProducts);
 
-  // Calculate the weight for each neighbour
-  Eigen::Map<const Eigen::VectorXd> distsMap(&(dists[0]), dists.size());
-  Eigen::VectorXd w = Eigen::exp(-opts.thetas[t] * (distsMap.array() / distsMap.mean()));
+  for (int i = 0; i < (int)kNNInds.size(); i++) {
+    auto x = [&M, ind = kNNInds[i]](int a) { return (a == 0) ? 1.0 : M(ind, a - 1); };
 
-  // For the sake of debugging, count how many neighbours we end up with.
-  if (opts.saveKUsed) {
-    int numNonZeroWeights = 0;
-    for (double& w_i : w) {
-      if (w_i > 0) {
-        numNonZeroWeights += 1;
+    double* row = products.row(i).data();
+    for (int a = 0; a < n; a++) {
+      for (int b = 0; b <= a; b++) {
+        *(row++) = x(a) * x(b);
       }
     }
-    *kUsed = numNonZeroWeights;
+    double y = M.y(kNNInds[i]);
+    for (int a = 0; a < n; a++) {
+      *(row++) = y * x(a);
+    }
   }
+}
+
+// Solve the N x N normal equations (N = E_actual + 1) packed as in 'smap_neighbour_products'. The system is fixed
+// size for the common values of E, so it can live on the stack, and it's solved with an LDLT decomposition unless
+// it is rank deficient.
+template<int N>
+void smap_solve(const double* packed, int n, Eigen::VectorXd& ics)
+{
+  Eigen::Matrix<double, N, N> XTX(n, n);
+  Eigen::Matrix<double, N, 1> XTy(n);
 
-  // Scale everything by our weights vector
-  X_ls_cj.array().colwise() *= w.array();
-  Eigen::VectorXd y_ls = M.yMap()(kNNInds).array() * w.array();
+  for (int a = 0; a < n; a++) {
+    for (int b = 0; b <= a; b++) {
+      XTX(a, b) = *(packed++);
+    }
+  }
+  for (int a = 0; a < n; a++) {
+    XTy(a) = *(packed++);
+  }
 
-  // The old way to solve this system:
-  // Eigen::BDCSVD<MatrixXd> svd(X_ls_cj, Eigen::ComputeThinU | Eigen::ComputeThinV);
-  //  Eigen::VectorXd ics = svd.solve(y_ls);
+  Eigen::LDLT<Eigen::Matrix<double, N, N>, Eigen::Lower> ldlt(XTX);
+  if (ldlt.info() == Eigen::Success) {
+    auto D = ldlt.vectorD();
+    if (D.minCoeff() > SMAP_LDLT_TOLERANCE * D.cwiseAbs().maxCoeff()) {
+      ics = ldlt.solve(XTy);
+      return;
+    }
+  }
 
+  // The system is (close to) rank deficient, so find the minimum-norm solution using the SVD.
   // The pseudo-inverse of X can be calculated as (X^T * X)^(-1) * X^T
   // see https://scicomp.stackexchange.com/a/33375
+  XTX.template triangularView<Eigen::StrictlyUpper>() = XTX.transpose();
   const int svdOpts = Eigen::ComputeThinU | Eigen::ComputeThinV; // 'ComputeFull*' would probably work identically here.
-  Eigen::BDCSVD<MatrixXd> svd(X_ls_cj.transpose() * X_ls_cj, svdOpts);
-  Eigen::VectorXd ics = svd.solve(X_ls_cj.transpose() * y_ls);
+  Eigen::BDCSVD<MatrixXd> svd(XTX, svdOpts);
+  ics = svd.solve(Eigen::VectorXd(XTy));
+}
 
-  double r = ics(0);
-  for (int j = 0; j < M.E_actual(); j++) {
-    if (Mp(Mp_i, j) != MISSING_SENTINEL) {
-      r += Mp(Mp_i, j) * ics(j + 1);
-    }
+// Call 'smap_solve' with the fixed system size N = n, if it's small enough.
+template<int N>
+void smap_solve_dispatch(const double* packed, int n, Eigen::VectorXd& ics)
+{
+  if (n == N) {
+    smap_solve<N>(packed, n, ics);
+  } else {
+    smap_solve_dispatch<N + 1>(packed, n, ics);
   }
+}
 
-  // If the 'savesmap' option is given, save the 'ics' coefficients
-  // for the largest value of theta.
-  if (opts.saveSMAPCoeffs && t == opts.thetas.size() - 1) {
-    for (int j = 0; j < M.E_actual() + 1; j++) {
-      if (ics(j) == 0.) {
-        coeffs(Mp_i, j) = MISSING_SENTINEL;
-      } else {
-        coeffs(Mp_i, j) = ics(j);
+template<>
+void smap_solve_dispatch<SMAP_MAX_FIXED_SIZE + 1>(const double* packed, int n, Eigen::VectorXd& ics)
+{
+  smap_solve<Eigen::Dynamic>(packed, n, ics);
+}
+
+Eigen::VectorXd smap_coefficients(const Manifold& M, const std::vector<int>& kNNInds, const Eigen::VectorXd& w)
+{
+  MatrixXd products;
+  smap_neighbour_products(M, kNNInds, products);
+  Eigen::RowVectorXd normalEquations = w.array().square().matrix().transpose() * products;
+
+  Eigen::VectorXd ics;
+  smap_solve_dispatch<2>(normalEquations.data(), M.E_actual() + 1, ics);
+  return ics;
+}
+
+// Make the S-map predictions for every theta at once. The neighbours are gathered just once, the weights for all
+// thetas are calculated together, and then the normal equations for every theta come out of one matrix product.
+void smap_predictions(int Mp_i, const Options& opts, const Manifold& M, const Manifold& Mp,
+                      const std::vector<double>& dists, const std::vector<int>& kNNInds, Eigen::Map<MatrixXd> ystar,
+                      Eigen::Map<MatrixXd> coeffs, Eigen::Map<MatrixXi> rc, int* kUsed)
+{
+  int k = kNNInds.size();
+  int n = M.E_actual() + 1;
+  int numThetas = opts.thetas.size();
+
+  PredictionWorkspace& workspace = prediction_workspace();
+
+  // Calculate the (squared) weight for each neighbour for each theta
+  Eigen::Map<const Eigen::RowVectorXd> distsMap(&(dists[0]), k);
+  Eigen::RowVectorXd& scaledDists = workspace.scaledDists;
+  scaledDists = distsMap.array() / distsMap.mean();
+  Eigen::VectorXd& negThetas = workspace.negThetas;
+  negThetas = -Eigen::Map<const Eigen::VectorXd>(&(opts.thetas[0]), numThetas);
+  MatrixXd& w2 = workspace.w2;
+  // (The exponents are calculated in column-major order, just as a temporary for '-thetas * scaledDists' would be,
+  // so the exponentials are calculated in the same way and come out identical.)
+  Eigen::MatrixXd& exponents = workspace.exponents;
+  exponents.noalias() = negThetas * scaledDists;
+  w2 = exponents.array().exp().square();
+
+  // For the sake of debugging, count how many neighbours we end up with (for the last theta). This is counted from
+  // the weights themselves, as a tiny weight can underflow to zero once it's squared.
+  if (opts.saveKUsed) {
+    *kUsed = (exponents.row(numThetas - 1).array().exp() > 0).count();
+  }
+
+  smap_neighbour_products(M, kNNInds, workspace.products);
+  MatrixXd& normalEquations = workspace.normalEquations;
+  normalEquations.noalias() = w2 * workspace.products;
+
+  Eigen::VectorXd& ics = workspace.ics;
+  for (int t = 0; t < numThetas; t++) {
+    smap_solve_dispatch<2>(normalEquations.row(t).data(), n, ics);
+
+    double r = ics(0);
+    for (int j = 0; j < M.E_actual(); j++) {
+      if (Mp(Mp_i, j) != MISSING_SENTINEL) {
+        r += Mp(Mp_i, j) * ics(j + 1);
       }
     }
-  }
 
-  ystar(t, Mp_i) = r;
-  rc(t, Mp_i) = SUCCESS;
+    // If the 'savesmap' option is given, save the 'ics' coefficients
+    // for the largest value of theta.
+    if (opts.saveSMAPCoeffs && t == numThetas - 1) {
+      for (int j = 0; j < n; j++) {
+        if (ics(j) == 0.) {
+          coeffs(Mp_i, j) = MISSING_SENTINEL;
+        } else {
+          coeffs(Mp_i, j) = ics(j);
+        }
+      }
+    }
+
+    ystar(t, Mp_i) = r;
+    rc(t, Mp_i) = SUCCESS;
+  }
 }
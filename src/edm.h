@@ -1,6 +1,19 @@
 #pragma once
 
 #include "common.h"
+#include "distances.h" // for 'NearestNeighbourHeap'
+
+#include <functional>
+#include <mutex>
+
+class NeighbourIndex;
+class BatchEuclideanNeighbours;
+class LaggedDistanceSums;
+class NestedLibraryNeighbours;
+class UnivariateWasserstein;
+class WassersteinCosts;
+class WassersteinDistanceCache;
+class WassersteinDistanceTable;
 
 std::vector<std::future<Prediction>> launch_task_group(const ManifoldGenerator& generator, Options opts,
                                                        const std::vector<int>& Es, const std::vector<int>& libraries,
@@ -8,31 +21,119 @@ std::vector<std::future<Prediction>> launch_task_group(const ManifoldGenerator&
                                                        bool saveFinalPredictions, bool saveFinalCoPredictions,
                                                        bool saveSMAPCoeffs, bool copredictMode,
                                                        const std::vector<bool>& usable, const std::string& rngState,
-                                                       IO* io, bool keep_going(), void all_tasks_finished());
+                                                       IO* io, bool keep_going(), void all_tasks_finished(),
+                                                       bool nestedLibraries = false);
 
 // Below are the 'private' members of edm.cpp; they are added here just so they can be accessed for testing.
 
 using MatrixXd = Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>;
 using MatrixXi = Eigen::Matrix<int, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>;
 
-std::future<Prediction> launch_edm_task(const ManifoldGenerator& generator, Options opts, int E,
+// The buffers used while making a prediction. Each thread has its own, and they keep their capacity from one
+// prediction to the next, so once they've grown to fit (and while k & E stay the same) making a prediction with
+// the L^1 / L^2 distances doesn't allocate any memory.
+struct PredictionWorkspace
+{
+  std::vector<int> tryInds, idx;
+  DistanceIndexPairs potentialNN, kNNs;
+  NearestNeighbourHeap heap;
+
+  // Which columns use the 'CheckSame' metric, for the vectorised L^1 / L^2 distances
+  std::vector<char> checkSame;
+
+  // For the simplex & S-map weights
+  std::vector<double> w;
+  Eigen::VectorXd negThetas, ics;
+  Eigen::RowVectorXd scaledDists;
+  Eigen::MatrixXd exponents;
+  MatrixXd w2, products, normalEquations;
+};
+
+// This thread's workspace.
+PredictionWorkspace& prediction_workspace();
+
+// Something shared by a group of tasks (like the distance sums for an E-sweep), which is built by whichever of the
+// tasks needs it first. That way the workers build these in parallel, rather than the launching thread building them
+// one after another, and their memory isn't taken until the tasks which use them are running.
+template<typename T>
+class Deferred
+{
+public:
+  explicit Deferred(std::function<std::shared_ptr<T>()> make)
+    : _make(std::move(make))
+  {}
+
+  // The shared value (which may be nullptr), built on the first call.
+  T* get()
+  {
+    std::call_once(_built, [this] {
+      _value = _make();
+      _make = nullptr;
+    });
+    return _value.get();
+  }
+
+private:
+  std::once_flag _built;
+  std::function<std::shared_ptr<T>()> _make;
+  std::shared_ptr<T> _value;
+};
+
+std::shared_ptr<LaggedDistanceSums> make_lagged_distance_sums(const ManifoldGenerator& generator, const Options& opts,
+                                                              int maxE, const std::vector<bool>& trainingRows,
+                                                              const std::vector<bool>& predictionRows, bool copredict);
+
+std::shared_ptr<NestedLibraryNeighbours> make_nested_library_neighbours(const ManifoldGenerator& generator,
+                                                                        const Options& opts, int E,
+                                                                        const std::vector<bool>& trainingRows,
+                                                                        const std::vector<bool>& predictionRows,
+                                                                        bool copredict);
+
+std::future<Prediction> launch_edm_task(std::shared_ptr<ManifoldCache> cache, Options opts, int E,
                                         const std::vector<bool>& trainingRows, const std::vector<bool>& predictionRows,
-                                        IO* io, bool keep_going(), void all_tasks_finished());
+                                        IO* io, bool keep_going(), void all_tasks_finished(),
+                                        std::shared_ptr<Deferred<LaggedDistanceSums>> sums = nullptr,
+                                        std::shared_ptr<Deferred<NestedLibraryNeighbours>> nested = nullptr,
+                                        std::shared_ptr<WassersteinDistanceCache> distanceCache = nullptr);
 
-Prediction edm_task(const Options opts, const Manifold M, const Manifold Mp, const std::vector<bool> predictionRows,
-                    IO* io, bool keep_going(), void all_tasks_finished());
+Prediction edm_task(const Options opts, const Manifold& M, const Manifold& Mp, const std::vector<bool> predictionRows,
+                    IO* io, bool keep_going(), void all_tasks_finished(), LaggedDistanceSums* sums = nullptr,
+                    const NestedLibraryNeighbours* nested = nullptr, WassersteinDistanceCache* distanceCache = nullptr);
 
 void make_prediction(int Mp_i, const Options& opts, const Manifold& M, const Manifold& Mp, Eigen::Map<MatrixXd> ystar,
-                     Eigen::Map<MatrixXi> rc, Eigen::Map<MatrixXd> coeffs, int* kUsed, bool keep_going());
+                     Eigen::Map<MatrixXi> rc, Eigen::Map<MatrixXd> coeffs, int* kUsed, bool keep_going(),
+                     const NeighbourIndex* index = nullptr, LaggedDistanceSums* sums = nullptr,
+                     const NestedLibraryNeighbours* nested = nullptr, const UnivariateWasserstein* univariate = nullptr,
+                     const WassersteinCosts* costs = nullptr, WassersteinDistanceTable* distanceTable = nullptr);
+
+void make_predictions(int start, int end, const Options& opts, const Manifold& M, const Manifold& Mp,
+                      Eigen::Map<MatrixXd> ystar, Eigen::Map<MatrixXi> rc, Eigen::Map<MatrixXd> coeffs, int* kUsed,
+                      bool keep_going(), const NeighbourIndex* index, const BatchEuclideanNeighbours* batch,
+                      LaggedDistanceSums* sums = nullptr, const NestedLibraryNeighbours* nested = nullptr,
+                      const UnivariateWasserstein* univariate = nullptr, const WassersteinCosts* costs = nullptr,
+                      WassersteinDistanceTable* distanceTable = nullptr);
+
+void predict_using_neighbours(int Mp_i, const Options& opts, const Manifold& M, const Manifold& Mp,
+                              const DistanceIndexPairs& kNNs, int numValidDistances, Eigen::Map<MatrixXd> ystar,
+                              Eigen::Map<MatrixXi> rc, Eigen::Map<MatrixXd> coeffs, int* kUsed, bool keep_going());
 
 std::vector<int> potential_neighbour_indices(int Mp_i, const Options& opts, const Manifold& M, const Manifold& Mp);
+void potential_neighbour_indices(int Mp_i, const Options& opts, const Manifold& M, const Manifold& Mp,
+                                 std::vector<int>& inds);
 
 DistanceIndexPairs kNearestNeighbours(const DistanceIndexPairs& potentialNeighbours, int k);
 
+// The same, but stored in 'kNNs' (using 'idx' as scratch space), so their capacity is reused between predictions.
+void kNearestNeighbours(const DistanceIndexPairs& potentialNeighbours, int k, DistanceIndexPairs& kNNs,
+                        std::vector<int>& idx);
+
 void simplex_prediction(int Mp_i, int t, const Options& opts, const Manifold& M, const std::vector<double>& dists,
                         const std::vector<int>& kNNInds, Eigen::Map<MatrixXd> ystar, Eigen::Map<MatrixXi> rc,
                         int* kUsed);
 
-void smap_prediction(int Mp_i, int t, const Options& opts, const Manifold& M, const Manifold& Mp,
-                     const std::vector<double>& dists, const std::vector<int>& kNNInds, Eigen::Map<MatrixXd> ystar,
-                     Eigen::Map<MatrixXd> coeffs, Eigen::Map<MatrixXi> rc, int* kUsed);
+// Solve for the S-map coefficients (the constant first) from the nearest neighbours 'kNNInds' with weights 'w'.
+Eigen::VectorXd smap_coefficients(const Manifold& M, const std::vector<int>& kNNInds, const Eigen::VectorXd& w);
+
+void smap_predictions(int Mp_i, const Options& opts, const Manifold& M, const Manifold& Mp,
+                      const std::vector<double>& dists, const std::vector<int>& kNNInds, Eigen::Map<MatrixXd> ystar,
+                      Eigen::Map<MatrixXd> coeffs, Eigen::Map<MatrixXi> rc, int* kUsed);
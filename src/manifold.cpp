@@ -1,6 +1,13 @@
 #pragma warning(disable : 4018)
 
 #include "manifold.h"
+#include "thread_pool.h"
+
+#include <cstdint>
+
+// Manifolds with at least this many points are filled in by several threads (this many points at a time).
+const int PARALLEL_MANIFOLD_MIN_POINTS = 4096;
+const int PARALLEL_MANIFOLD_GRAIN = 512;
 
 // Recursive function to return gcd of a and b
 // Lifted from https://www.geeksforgeeks.org/program-find-gcd-floating-point-numbers/
@@ -75,6 +82,71 @@ void ManifoldGenerator::setup_observation_numbers()
       }
     }
   }
+
+  setup_observation_lookup();
+}
+
+void ManifoldGenerator::setup_observation_lookup()
+{
+  _observation_runs.clear();
+  _observation_run.resize(_observation_number.size());
+  _observation_rows.clear();
+
+  int n = (int)_observation_number.size();
+  for (int start = 0; start < n;) {
+    int end = start + 1;
+    while (end < n && (!_panel_mode || _panel_ids[end] == _panel_ids[start])) {
+      end += 1;
+    }
+
+    ObservationRun run = { start, end, -1, -1, -1 };
+    bool increasing = true;
+    int numObs = 0;
+    for (int i = start; i < end; i++) {
+      _observation_run[i] = (int)_observation_runs.size();
+      int obs = _observation_number[i];
+      if (obs < 0) {
+        continue;
+      }
+      if (numObs > 0 && obs <= run.maxObs) {
+        increasing = false;
+      }
+      run.minObs = (numObs == 0) ? obs : run.minObs;
+      run.maxObs = obs;
+      numObs += 1;
+    }
+
+    // Only keep a table if it'll be reasonably full (else we just walk through the rows as usual).
+    if (increasing && numObs > 0 && ((int64_t)run.maxObs - run.minObs) < 4 * (int64_t)numObs + 64) {
+      run.tableStart = (int)_observation_rows.size();
+      _observation_rows.resize(_observation_rows.size() + (run.maxObs - run.minObs + 1), -1);
+      for (int i = start; i < end; i++) {
+        if (_observation_number[i] >= 0) {
+          _observation_rows[run.tableStart + _observation_number[i] - run.minObs] = i;
+        }
+      }
+    }
+
+    _observation_runs.push_back(run);
+    start = end;
+  }
+}
+
+// Find the row in the (tabulated) 'run' with the observation number 'target', looking from row 'k' onwards in
+// the given direction. This gives the same answer as 'find_observation_num', as the run's observation numbers
+// are increasing. Returns -1 if there's no such row.
+int ManifoldGenerator::lookup_observation_num(const ObservationRun& run, int target, int k, int direction) const
+{
+  if (target < run.minObs || target > run.maxObs) {
+    return -1;
+  }
+
+  int row = _observation_rows[run.tableStart + target - run.minObs];
+  if (row < 0 || (direction > 0 && row < k) || (direction < 0 && row > k)) {
+    return -1;
+  }
+
+  return row;
 }
 
 bool ManifoldGenerator::find_observation_num(int target, int& k, int direction, int panel) const
@@ -123,6 +195,14 @@ std::vector<int> ManifoldGenerator::get_lagged_indices(int startIndex, int E, in
   laggedIndices[0] = startIndex;
   int pointStartObsNum = _observation_number[startIndex];
 
+  const ObservationRun& run = _observation_runs[_observation_run[startIndex]];
+  if (run.tableStart >= 0) {
+    for (int j = 1; j < E; j++) {
+      laggedIndices[j] = lookup_observation_num(run, pointStartObsNum - j * _tau, startIndex - 1, -1);
+    }
+    return laggedIndices;
+  }
+
   // Start by going back one index
   int k = startIndex - 1;
 
@@ -139,7 +219,7 @@ std::vector<int> ManifoldGenerator::get_lagged_indices(int startIndex, int E, in
 }
 
 Manifold ManifoldGenerator::create_manifold(int E, const std::vector<bool>& filter, bool copredict, bool prediction,
-                                            double dtWeight, bool skipMissing) const
+                                            double dtWeight, bool skipMissing, ThreadPool* pool) const
 {
   bool takeEveryPoint = filter.size() == 0;
 
@@ -152,45 +232,60 @@ Manifold ManifoldGenerator::create_manifold(int E, const std::vector<bool>& filt
     }
   }
 
-  auto flat = std::make_unique<double[]>(nobs * E_actual(E));
-
-  std::vector<double> y;
-  std::vector<int> panelIDs;
+  int E_act = E_actual(E);
+  auto flat = std::make_unique<double[]>(nobs * E_act);
+  std::vector<double> y(nobs);
+  std::vector<char> keep(nobs, true);
 
   // Fill in the manifold row-by-row (point-by-point)
-  int M_i = 0;
-  double target;
+  auto fill_in_row = [&](int i) {
+    double* point = &(flat[i * E_act]);
+    fill_in_point(pointNumToStartIndex[i], E, copredict, prediction, dtWeight, point, y[i]);
 
-  for (int i = 0; i < nobs; i++) {
-    double* point = &(flat[M_i * E_actual(E)]);
-    fill_in_point(pointNumToStartIndex[i], E, copredict, prediction, dtWeight, point, target);
-
-    // Erase this point if we don't want missing values in the resulting manifold
+    // Mark this point to be erased if we don't want missing values in the resulting manifold
     if (skipMissing) {
-      bool foundMissing = false;
-      for (int j = 0; j < E_actual(E); j++) {
+      for (int j = 0; j < E_act; j++) {
         if (point[j] == MISSING_SENTINEL) {
-          foundMissing = true;
+          keep[i] = false;
           break;
         }
       }
+    }
+  };
 
-      if (foundMissing) {
-        continue;
-      }
+  if (pool != nullptr && nobs >= PARALLEL_MANIFOLD_MIN_POINTS) {
+    pool->parallel_for(0, nobs, PARALLEL_MANIFOLD_GRAIN, fill_in_row);
+  } else {
+    for (int i = 0; i < nobs; i++) {
+      fill_in_row(i);
+    }
+  }
+
+  // Shuffle the points we're keeping up to the front of the manifold
+  std::vector<int> panelIDs, pointNums;
+  int M_i = 0;
+
+  for (int i = 0; i < nobs; i++) {
+    if (!keep[i]) {
+      continue;
     }
 
-    y.push_back(target);
+    if (M_i != i) {
+      std::copy_n(&(flat[i * E_act]), E_act, &(flat[M_i * E_act]));
+      y[M_i] = y[i];
+    }
     if (_panel_mode) {
       panelIDs.push_back(_panel_ids[pointNumToStartIndex[i]]);
     }
+    pointNums.push_back(pointNumToStartIndex[i]);
 
     M_i += 1;
   }
 
   nobs = M_i;
+  y.resize(nobs);
 
-  return { flat, y, panelIDs, nobs, E, E_dt(E), E_extras(E), E * numExtrasLagged(), E_actual(E) };
+  return { flat, y, panelIDs, pointNums, nobs, E, E_dt(E), E_extras(E), E * numExtrasLagged(), E_actual(E) };
 }
 
 void ManifoldGenerator::fill_in_point(int i, int E, bool copredict, bool prediction, double dtWeight, double* point,
@@ -216,7 +311,10 @@ void ManifoldGenerator::fill_in_point(int i, int E, bool copredict, bool predict
     // At what time does the prediction occur?
     int targetObsNum = _observation_number[targetIndex] + _p;
     int direction = _p > 0 ? 1 : -1;
-    if (!find_observation_num(targetObsNum, targetIndex, direction, panel)) {
+    const ObservationRun& run = _observation_runs[_observation_run[i]];
+    if (run.tableStart >= 0) {
+      targetIndex = lookup_observation_num(run, targetObsNum, i, direction);
+    } else if (!find_observation_num(targetObsNum, targetIndex, direction, panel)) {
       targetIndex = -1;
     }
   }
@@ -361,4 +459,53 @@ void from_json(const json& j, ManifoldGenerator& g)
   j.at("_observation_number").get_to(g._observation_number);
   j.at("_extras").get_to(g._extras);
   j.at("_panel_ids").get_to(g._panel_ids);
+  g.setup_observation_lookup();
+}
+
+size_t ManifoldCache::KeyHash::operator()(const Key& key) const
+{
+  size_t h = std::hash<std::vector<bool>>()(key.filter);
+  for (size_t part : { std::hash<int>()(key.E), std::hash<bool>()(key.coX), std::hash<double>()(key.dtWeight),
+                       std::hash<bool>()(key.skipMissing) }) {
+    h ^= part + 0x9e3779b9 + (h << 6) + (h >> 2);
+  }
+  return h;
+}
+
+std::shared_ptr<const Manifold> ManifoldCache::create_manifold(int E, const std::vector<bool>& filter, bool copredict,
+                                                               bool prediction, double dtWeight, bool skipMissing)
+{
+  Key key = { E, copredict && prediction, dtWeight, skipMissing, filter };
+
+  std::shared_ptr<Slot> slot;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    std::shared_ptr<Slot>& found = _slots[key];
+    if (found == nullptr) {
+      found = std::make_shared<Slot>();
+    }
+    slot = found;
+
+    // Every so often, throw away the slots for manifolds which have already been freed
+    // (so long as nobody else is in the middle of building them).
+    if (_slots.size() >= _purgeSize) {
+      for (auto it = _slots.begin(); it != _slots.end();) {
+        bool unused = (it->second.use_count() == 1) && it->second->manifold.expired();
+        it = unused ? _slots.erase(it) : std::next(it);
+      }
+      _purgeSize = 2 * std::max(_slots.size(), (size_t)8);
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(slot->mutex);
+
+  std::shared_ptr<const Manifold> M = slot->manifold.lock();
+  if (M == nullptr) {
+    M = std::make_shared<const Manifold>(
+      _generator->create_manifold(E, filter, copredict, prediction, dtWeight, skipMissing, _pool));
+    slot->manifold = M;
+  }
+
+  return M;
 }
@@ -4,7 +4,11 @@
 
 const double MISSING_SENTINEL = 1.0e+100;
 
+#include <bitset>
+#include <cstdint>
 #include <memory>
+#include <mutex>
+#include <unordered_map>
 #include <vector>
 
 #define EIGEN_NO_DEBUG
@@ -14,26 +18,45 @@ const double MISSING_SENTINEL = 1.0e+100;
 #include <nlohmann/json.hpp>
 using json = nlohmann::json;
 
+class ThreadPool;
+
 class Manifold
 {
   std::shared_ptr<double[]> _flat = nullptr;
   std::vector<double> _y;
   std::vector<int> _panel_ids;
+  std::vector<int> _point_nums; // The generator's point number for each row
   int _nobs, _E_x, _E_dt, _E_extras, _E_lagged_extras, _E_actual;
 
+  // A bitmask for each row of which of its values are missing, in '_mask_words' 64-bit words per row
+  int _mask_words;
+  std::vector<uint64_t> _missing_mask;
+
 public:
-  Manifold(std::unique_ptr<double[]>& flat, std::vector<double> y, std::vector<int> panelIDs, int nobs, int E_x,
-           int E_dt, int E_extras, int E_lagged_extras, int E_actual)
+  Manifold(std::unique_ptr<double[]>& flat, std::vector<double> y, std::vector<int> panelIDs,
+           std::vector<int> pointNums, int nobs, int E_x, int E_dt, int E_extras, int E_lagged_extras, int E_actual)
     : _flat(std::move(flat))
     , _y(y)
     , _panel_ids(panelIDs)
+    , _point_nums(pointNums)
     , _nobs(nobs)
     , _E_x(E_x)
     , _E_dt(E_dt)
     , _E_extras(E_extras)
     , _E_lagged_extras(E_lagged_extras)
     , _E_actual(E_actual)
-  {}
+    , _mask_words((E_actual + 63) / 64)
+    , _missing_mask((size_t)nobs * _mask_words, 0)
+  {
+    for (int i = 0; i < _nobs; i++) {
+      uint64_t* mask = &(_missing_mask[(size_t)i * _mask_words]);
+      for (int j = 0; j < _E_actual; j++) {
+        if (operator()(i, j) == MISSING_SENTINEL) {
+          mask[j / 64] |= (uint64_t)1 << (j % 64);
+        }
+      }
+    }
+  }
 
   double operator()(int i, int j) const { return _flat[i * _E_actual + j]; }
 
@@ -55,6 +78,7 @@ public:
   double dt(int i, int j) const { return _flat[i * _E_actual + _E_x + j]; }
   double extras(int i, int j) const { return _flat[i * _E_actual + _E_x + _E_dt + j]; }
   int panel(int i) const { return _panel_ids[i]; }
+  int point_num(int i) const { return _point_nums[i]; }
 
   double unlagged_extras(int obsNum, int varNum) const
   {
@@ -84,31 +108,23 @@ public:
 
   bool any_missing(int obsNum) const
   {
-    for (int j = 0; j < _E_actual; j++) {
-      if (operator()(obsNum, j) == MISSING_SENTINEL) {
+    const uint64_t* mask = &(_missing_mask[(size_t)obsNum * _mask_words]);
+    for (int w = 0; w < _mask_words; w++) {
+      if (mask[w] != 0) {
         return true;
       }
     }
     return false;
   }
 
-  bool any_not_missing(int obsNum) const
-  {
-    for (int j = 0; j < _E_actual; j++) {
-      if (operator()(obsNum, j) != MISSING_SENTINEL) {
-        return true;
-      }
-    }
-    return false;
-  }
+  bool any_not_missing(int obsNum) const { return num_not_missing(obsNum) > 0; }
 
   int num_not_missing(int obsNum) const
   {
-    int count = 0;
-    for (int j = 0; j < _E_actual; j++) {
-      if (operator()(obsNum, j) != MISSING_SENTINEL) {
-        count += 1;
-      }
+    const uint64_t* mask = &(_missing_mask[(size_t)obsNum * _mask_words]);
+    int count = _E_actual;
+    for (int w = 0; w < _mask_words; w++) {
+      count -= (int)std::bitset<64>(mask[w]).count();
     }
     return count;
   }
@@ -143,11 +159,26 @@ private:
 
   std::vector<int> _observation_number;
 
+  // The rows are split into runs of consecutive rows from the same panel. When the observation numbers in a run
+  // are strictly increasing (ignoring rows without a time) and not too spread out, we keep a table from each
+  // observation number to its row, so lags & targets are found directly rather than by walking through the rows.
+  struct ObservationRun
+  {
+    int start, end;
+    int minObs, maxObs;
+    int tableStart; // Where this run's part of '_observation_rows' starts, or -1 if it has no table
+  };
+  std::vector<ObservationRun> _observation_runs;
+  std::vector<int> _observation_run; // The run containing each row
+  std::vector<int> _observation_rows;
+
   void setup_observation_numbers();
+  void setup_observation_lookup();
   void fill_in_point(int i, int E, bool copredict, bool prediction, double dtWeight, double* point,
                      double& target) const;
 
   bool find_observation_num(int target, int& k, int direction, int panel) const;
+  int lookup_observation_num(const ObservationRun& run, int target, int k, int direction) const;
   std::vector<int> get_lagged_indices(int startIndex, int E, int panel) const;
 
 public:
@@ -184,8 +215,9 @@ public:
     setup_observation_numbers();
   }
 
+  // If a 'pool' is given, large manifolds are filled in by several threads at once.
   Manifold create_manifold(int E, const std::vector<bool>& filter, bool copredict, bool prediction,
-                           double dtWeight = 0.0, bool skipMissing = false) const;
+                           double dtWeight = 0.0, bool skipMissing = false, ThreadPool* pool = nullptr) const;
 
   std::vector<bool> generate_usable(int maxE, bool coprediction = false) const;
 
@@ -196,3 +228,56 @@ public:
   int numExtrasLagged() const { return _num_extras_lagged; }
   int numExtras() const { return _num_extras; }
 };
+
+// Hands out the manifolds built by a generator, so that the tasks in a task group which ask for the same manifold
+// (e.g. the training manifold in explore mode with 'full', or the prediction manifold shared by many libraries)
+// share one copy. Only weak references are kept, so each manifold is freed once the last task using it is done.
+// The tasks build their manifolds through the cache concurrently, so it shares ownership of the generator (the one
+// copy that all the tasks use), and different manifolds can be built at the same time (while a second request for
+// the same one waits for it).
+class ManifoldCache
+{
+public:
+  ManifoldCache(std::shared_ptr<const ManifoldGenerator> generator, ThreadPool* pool = nullptr)
+    : _generator(std::move(generator))
+    , _pool(pool)
+  {}
+
+  std::shared_ptr<const Manifold> create_manifold(int E, const std::vector<bool>& filter, bool copredict,
+                                                  bool prediction, double dtWeight = 0.0, bool skipMissing = false);
+
+  const ManifoldGenerator& generator() const { return *_generator; }
+
+private:
+  struct Key
+  {
+    int E;
+    bool coX; // Only the prediction manifolds in copredict mode use the co_x variable
+    double dtWeight;
+    bool skipMissing;
+    std::vector<bool> filter;
+
+    bool operator==(const Key& other) const
+    {
+      return E == other.E && coX == other.coX && dtWeight == other.dtWeight && skipMissing == other.skipMissing &&
+             filter == other.filter;
+    }
+  };
+
+  struct KeyHash
+  {
+    size_t operator()(const Key& key) const;
+  };
+
+  struct Slot
+  {
+    std::mutex mutex;
+    std::weak_ptr<const Manifold> manifold;
+  };
+
+  std::shared_ptr<const ManifoldGenerator> _generator;
+  ThreadPool* _pool;
+  std::mutex _mutex;
+  std::unordered_map<Key, std::shared_ptr<Slot>, KeyHash> _slots;
+  size_t _purgeSize = 16;
+};
@@ -0,0 +1,532 @@
+#pragma warning(disable : 4018)
+
+#include "neighbour_index.h"
+#include "distances.h"
+#include "edm.h" // for 'potential_neighbour_indices'
+
+#include <algorithm> // std::nth_element, std::push_heap, std::pop_heap
+#include <cmath>
+#include <limits>
+#include <numeric> // std::iota
+
+// Beyond this many dimensions neither tree is worth building.
+const int BALL_TREE_MAX_DIMS = 32;
+
+// Stop splitting the tree when a node has this many points (or fewer)
+const int LEAF_SIZE = 16;
+
+// The ball tree relies upon the triangle inequality, which only holds approximately once rounding
+// errors creep in, so we loosen its lower bounds by this (relative) amount to stay on the safe side.
+const double BALL_TREE_SLACK = 1e-10;
+
+struct NeighbourIndex::Query
+{
+  int Mp_i;
+  const Manifold& Mp;
+  int k;
+  int numZeros;
+
+  // A max-heap of the best (distance, index) pairs found so far
+  std::vector<std::pair<double, int>> heap;
+
+  double worst() const { return (int)heap.size() < k ? std::numeric_limits<double>::infinity() : heap.front().first; }
+};
+
+bool NeighbourIndex::is_applicable(const Options& opts, const Manifold& M)
+{
+  if (is_transport_distance(opts.distance) || opts.k <= 0 || M.E_actual() > BALL_TREE_MAX_DIMS) {
+    return false;
+  }
+
+  // When we want most of the training set, a brute-force search is just as fast.
+  if (M.nobs() < 4 * LEAF_SIZE || opts.k > M.nobs() / 4) {
+    return false;
+  }
+
+  for (int i = 0; i < M.nobs(); i++) {
+    if (M.any_missing(i)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+NeighbourIndex::NeighbourIndex(const Options& opts, const Manifold& M)
+  : _opts(opts)
+  , _M(M)
+  , _E(M.E_actual())
+  , _root(-1)
+{
+  _ballTree = (_E > KD_TREE_MAX_DIMS);
+
+  _points.resize(M.nobs());
+  std::iota(_points.begin(), _points.end(), 0);
+
+  bool skipOtherPanels = opts.panelMode && (opts.idw < 0);
+
+  if (skipOtherPanels) {
+    // Group the points by panel and build a separate tree over each group.
+    std::stable_sort(_points.begin(), _points.end(), [&M](int i1, int i2) { return M.panel(i1) < M.panel(i2); });
+
+    int start = 0;
+    while (start < (int)_points.size()) {
+      int end = start;
+      while (end < (int)_points.size() && M.panel(_points[end]) == M.panel(_points[start])) {
+        end += 1;
+      }
+      _panelRoots[M.panel(_points[start])] = build(start, end);
+      start = end;
+    }
+  } else {
+    _root = build(0, (int)_points.size());
+  }
+}
+
+int NeighbourIndex::build(int start, int end)
+{
+  int nodeNum = (int)_nodes.size();
+  _nodes.push_back({ start, end, -1, -1, -1, 0.0 });
+
+  Node node = _nodes[nodeNum];
+  int mid = -1;
+  if (_ballTree) {
+    split_ball(node, mid);
+  } else {
+    split_kd(node, mid);
+  }
+  _nodes[nodeNum] = node;
+
+  // Leaves, or nodes whose points are all identical, aren't split any further.
+  if (mid < 0) {
+    return nodeNum;
+  }
+
+  int left = build(start, mid);
+  int right = build(mid, end);
+  _nodes[nodeNum].left = left;
+  _nodes[nodeNum].right = right;
+
+  return nodeNum;
+}
+
+void NeighbourIndex::split_kd(Node& node, int& mid)
+{
+  // Store the bounding box of the points in this node
+  std::vector<double> lo(_E, std::numeric_limits<double>::max());
+  std::vector<double> hi(_E, std::numeric_limits<double>::lowest());
+
+  for (int p = node.start; p < node.end; p++) {
+    for (int j = 0; j < _E; j++) {
+      double value = _M(_points[p], j);
+      lo[j] = std::min(lo[j], value);
+      hi[j] = std::max(hi[j], value);
+    }
+  }
+
+  _lo.insert(_lo.end(), lo.begin(), lo.end());
+  _hi.insert(_hi.end(), hi.begin(), hi.end());
+
+  if (node.end - node.start <= LEAF_SIZE) {
+    return;
+  }
+
+  // Split the points at the median of the dimension with the largest spread
+  int splitDim = 0;
+  for (int j = 1; j < _E; j++) {
+    if (hi[j] - lo[j] > hi[splitDim] - lo[splitDim]) {
+      splitDim = j;
+    }
+  }
+
+  if (hi[splitDim] == lo[splitDim]) {
+    return;
+  }
+
+  mid = (node.start + node.end) / 2;
+  std::nth_element(_points.begin() + node.start, _points.begin() + mid, _points.begin() + node.end,
+                   [this, splitDim](int i1, int i2) { return _M(i1, splitDim) < _M(i2, splitDim); });
+}
+
+void NeighbourIndex::split_ball(Node& node, int& mid)
+{
+  // Take the centre of the ball to be the point closest to the (coordinate-wise) mean
+  std::vector<double> mean(_E, 0.0);
+  for (int p = node.start; p < node.end; p++) {
+    for (int j = 0; j < _E; j++) {
+      mean[j] += _M(_points[p], j) / (node.end - node.start);
+    }
+  }
+
+  double bestDist = std::numeric_limits<double>::max();
+  for (int p = node.start; p < node.end; p++) {
+    double dist = 0.0;
+    for (int j = 0; j < _E; j++) {
+      dist += (_M(_points[p], j) - mean[j]) * (_M(_points[p], j) - mean[j]);
+    }
+    if (dist < bestDist) {
+      bestDist = dist;
+      node.centre = _points[p];
+    }
+  }
+
+  // The radius is measured with the same distance function used for the queries.
+  int furthest = node.centre;
+  for (int p = node.start; p < node.end; p++) {
+    double dist = lp_distance(_points[p], node.centre, _opts, _M, _M);
+    if (dist > node.radius) {
+      node.radius = dist;
+      furthest = _points[p];
+    }
+  }
+
+  if (node.end - node.start <= LEAF_SIZE || node.radius == 0) {
+    return;
+  }
+
+  // Find two points which are far apart, and split the points by which one they are closer to.
+  int a = furthest, b = a;
+  double maxDist = -1;
+  for (int p = node.start; p < node.end; p++) {
+    double dist = lp_distance(_points[p], a, _opts, _M, _M);
+    if (dist > maxDist) {
+      maxDist = dist;
+      b = _points[p];
+    }
+  }
+
+  std::vector<std::pair<double, int>> keys;
+  for (int p = node.start; p < node.end; p++) {
+    int i = _points[p];
+    keys.push_back({ lp_distance(i, a, _opts, _M, _M) - lp_distance(i, b, _opts, _M, _M), i });
+  }
+
+  int half = (node.end - node.start) / 2;
+  std::nth_element(keys.begin(), keys.begin() + half, keys.end());
+  for (int p = node.start; p < node.end; p++) {
+    _points[p] = keys[p - node.start].second;
+  }
+
+  mid = node.start + half;
+}
+
+double NeighbourIndex::kd_lower_bound(int node, int Mp_i, const Manifold& Mp) const
+{
+  // This mirrors 'lp_distance', except each coordinate of M[i] is replaced by the nearest point
+  // in the node's bounding box. Rounding is monotone, so this is a true lower bound even in floating-point
+  // (the panel 'idw' penalty is simply left out as it can only add to the distance).
+  const double* lo = &(_lo[node * _E]);
+  const double* hi = &(_hi[node * _E]);
+
+  double bound = 0.0;
+  for (int j = 0; j < _E; j++) {
+    double x = Mp(Mp_i, j);
+    double gap;
+    if (_opts.metrics[j] == Metric::Diff) {
+      gap = (x < lo[j]) ? (lo[j] - x) : ((x > hi[j]) ? (x - hi[j]) : 0.0);
+    } else { // Metric::CheckSame
+      gap = (x < lo[j] || x > hi[j]);
+    }
+
+    if (_opts.distance == Distance::MeanAbsoluteError) {
+      bound += std::abs(gap) / _E;
+    } else { // Distance::Euclidean
+      bound += gap * gap;
+    }
+  }
+
+  if (_opts.distance == Distance::MeanAbsoluteError) {
+    return bound;
+  } else { // Distance::Euclidean
+    return sqrt(bound);
+  }
+}
+
+void NeighbourIndex::search(int nodeNum, double nodeBound, Query& q) const
+{
+  // Skip this whole node if it can't contain a closer point than the current k-th best.
+  // Points with the same distance as the k-th best may still win the tie-break on index, so this is a strict check.
+  if (nodeBound > q.worst()) {
+    return;
+  }
+
+  const Node& node = _nodes[nodeNum];
+
+  if (node.left < 0) {
+    for (int p = node.start; p < node.end; p++) {
+      int i = _points[p];
+      double dist = lp_distance(i, q.Mp_i, _opts, _M, q.Mp);
+
+      if (dist == 0) {
+        q.numZeros += 1;
+        continue;
+      }
+
+      std::pair<double, int> candidate = { dist, i };
+      if ((int)q.heap.size() < q.k) {
+        q.heap.push_back(candidate);
+        std::push_heap(q.heap.begin(), q.heap.end());
+      } else if (candidate < q.heap.front()) {
+        std::pop_heap(q.heap.begin(), q.heap.end());
+        q.heap.back() = candidate;
+        std::push_heap(q.heap.begin(), q.heap.end());
+      }
+    }
+    return;
+  }
+
+  double leftBound, rightBound;
+  if (_ballTree) {
+    const Node& left = _nodes[node.left];
+    const Node& right = _nodes[node.right];
+    double leftDist = lp_distance(left.centre, q.Mp_i, _opts, _M, q.Mp);
+    double rightDist = lp_distance(right.centre, q.Mp_i, _opts, _M, q.Mp);
+    leftBound = (leftDist - left.radius) - BALL_TREE_SLACK * (leftDist + left.radius);
+    rightBound = (rightDist - right.radius) - BALL_TREE_SLACK * (rightDist + right.radius);
+  } else {
+    leftBound = kd_lower_bound(node.left, q.Mp_i, q.Mp);
+    rightBound = kd_lower_bound(node.right, q.Mp_i, q.Mp);
+  }
+
+  // Visit the closest child first, as it is more likely to tighten the k-th best distance.
+  if (leftBound <= rightBound) {
+    search(node.left, leftBound, q);
+    search(node.right, rightBound, q);
+  } else {
+    search(node.right, rightBound, q);
+    search(node.left, leftBound, q);
+  }
+}
+
+bool NeighbourIndex::k_nearest_neighbours(int Mp_i, const Manifold& Mp, int k, DistanceIndexPairs& kNNs,
+                                          int& numValidDistances) const
+{
+  if (k <= 0 || Mp.any_missing(Mp_i)) {
+    return false;
+  }
+
+  int root = _root;
+  if (!_panelRoots.empty() || _root < 0) {
+    auto it = _panelRoots.find(Mp.panel(Mp_i));
+    if (it == _panelRoots.end()) {
+      // No training points are in the same panel as this prediction point
+      kNNs.inds.clear();
+      kNNs.dists.clear();
+      numValidDistances = 0;
+      return true;
+    }
+    root = it->second;
+  }
+
+  Query q = { Mp_i, Mp, k, 0, {} };
+  q.heap.reserve(k);
+  search(root, 0.0, q);
+
+  const Node& rootNode = _nodes[root];
+  numValidDistances = (rootNode.end - rootNode.start) - q.numZeros;
+
+  if (numValidDistances <= k) {
+    // Every valid point is a neighbour, and these are returned in the same order as 'lp_distances' would.
+    std::sort(q.heap.begin(), q.heap.end(),
+              [](const std::pair<double, int>& a, const std::pair<double, int>& b) { return a.second < b.second; });
+  } else {
+    std::sort_heap(q.heap.begin(), q.heap.end());
+  }
+
+  kNNs.inds.resize(q.heap.size());
+  kNNs.dists.resize(q.heap.size());
+  for (int i = 0; i < (int)q.heap.size(); i++) {
+    kNNs.dists[i] = q.heap[i].first;
+    kNNs.inds[i] = q.heap[i].second;
+  }
+
+  return true;
+}
+
+// Don't keep more than this many bytes of sorted neighbour lists for a single library sweep.
+const size_t NESTED_LIBRARY_MEMORY_BUDGET = (size_t)1 << 28;
+
+bool NestedLibraryNeighbours::is_applicable(int numTrainingPoints, int numPredictionPoints)
+{
+  return (size_t)numTrainingPoints * numPredictionPoints * (sizeof(double) + sizeof(int)) <=
+         NESTED_LIBRARY_MEMORY_BUDGET;
+}
+
+NestedLibraryNeighbours::NestedLibraryNeighbours(const Manifold& M, const Manifold& Mp,
+                                                 const std::vector<bool>& trainingRows, bool skipMissing,
+                                                 bool skipOtherPanels)
+  : _shared(std::make_shared<Shared>(M, Mp))
+{
+  _shared->skipOtherPanels = skipOtherPanels;
+
+  for (int i = 0; i < (int)trainingRows.size(); i++) {
+    if (trainingRows[i]) {
+      _shared->rows.push_back(i);
+    }
+  }
+
+  _shared->skipped.resize(M.nobs());
+  for (int i = 0; i < M.nobs(); i++) {
+    _shared->skipped[i] = skipMissing && M.any_missing(i);
+  }
+
+  *this = restrict_to(trainingRows);
+}
+
+NestedLibraryNeighbours NestedLibraryNeighbours::restrict_to(const std::vector<bool>& trainingRows) const
+{
+  const Manifold& M = _shared->M;
+
+  NestedLibraryNeighbours library;
+  library._shared = _shared;
+  library._libraryIndex.resize(M.nobs());
+  library._librarySize = 0;
+
+  int numSkipped = 0;
+  for (int i = 0; i < M.nobs(); i++) {
+    if (_shared->skipped[i]) {
+      library._libraryIndex[i] = -1;
+      numSkipped += 1;
+    } else if (trainingRows[_shared->rows[i]]) {
+      library._libraryIndex[i] = library._librarySize;
+      library._librarySize += 1;
+      library._members.push_back(i);
+      if (_shared->skipOtherPanels) {
+        library._panelSizes[M.panel(i)] += 1;
+      }
+    } else {
+      library._libraryIndex[i] = -1;
+    }
+  }
+
+  library._largest = (library._librarySize + numSkipped == M.nobs());
+  return library;
+}
+
+std::shared_ptr<const NestedLibraryNeighbours::List> NestedLibraryNeighbours::neighbour_list(int Mp_i,
+                                                                                           const Options& opts) const
+{
+  Row& row = _shared->lists[Mp_i];
+  std::lock_guard<std::mutex> lock(row.mutex);
+
+  if (row.released) {
+    return nullptr;
+  }
+
+  if (row.list == nullptr) {
+    const Manifold& M = _shared->M;
+    const Manifold& Mp = _shared->Mp;
+
+    std::vector<int> tryInds;
+    for (int i : potential_neighbour_indices(Mp_i, opts, M, Mp)) {
+      if (!_shared->skipped[i]) {
+        tryInds.push_back(i);
+      }
+    }
+
+    DistanceIndexPairs potentialNN;
+    if (is_transport_distance(opts.distance)) {
+      std::call_once(_shared->univariateOnce, [&] {
+        if (UnivariateWasserstein::is_applicable(opts, M)) {
+          _shared->univariate = std::make_shared<UnivariateWasserstein>(M, Mp);
+        } else {
+          _shared->costs = std::make_shared<WassersteinCosts>(opts, M, Mp);
+        }
+      });
+    }
+
+    if (_shared->univariate != nullptr) {
+      potentialNN = _shared->univariate->distances(Mp_i, opts, tryInds);
+    } else if (opts.distance == Distance::Wasserstein) {
+      potentialNN = wasserstein_distances(Mp_i, opts, M, Mp, tryInds, _shared->costs.get(), opts.warmStartEMD);
+    } else if (opts.distance == Distance::Sinkhorn) {
+      potentialNN = sinkhorn_distances(Mp_i, opts, M, Mp, tryInds, _shared->costs.get());
+    } else {
+      potentialNN = lp_distances(Mp_i, opts, M, Mp, tryInds);
+    }
+
+    auto list = std::make_shared<List>();
+    list->dists.assign(M.nobs(), MISSING_SENTINEL);
+    for (int j = 0; j < (int)potentialNN.inds.size(); j++) {
+      list->dists[potentialNN.inds[j]] = potentialNN.dists[j];
+    }
+    for (int i : tryInds) {
+      if (list->dists[i] == MISSING_SENTINEL) {
+        list->invalid.push_back(i);
+      }
+    }
+
+    // Sort by distance, splitting ties by index (the index order is the same in every library).
+    list->sorted = std::move(potentialNN.inds);
+    std::stable_sort(list->sorted.begin(), list->sorted.end(),
+                     [&list](int a, int b) { return list->dists[a] < list->dists[b]; });
+
+    row.list = list;
+  }
+
+  std::shared_ptr<const List> list = row.list;
+
+  // Nothing after the largest library will need this list again.
+  if (_largest) {
+    row.list = nullptr;
+    row.released = true;
+  }
+
+  return list;
+}
+
+bool NestedLibraryNeighbours::k_nearest_neighbours(int Mp_i, const Options& opts, const Manifold& M,
+                                                   const Manifold& Mp, int k, DistanceIndexPairs& kNNs,
+                                                   int& numValidDistances) const
+{
+  if (M.nobs() != _librarySize || M.E_actual() != _shared->M.E_actual() || Mp.nobs() != _shared->Mp.nobs()) {
+    return false;
+  }
+
+  std::shared_ptr<const List> list = neighbour_list(Mp_i, opts);
+  if (list == nullptr) {
+    return false;
+  }
+
+  // Count the valid neighbours without looking through the whole list: it is every point of this library
+  // which was compared to the prediction point, less those which didn't give a valid distance.
+  if (_shared->skipOtherPanels) {
+    auto panelSize = _panelSizes.find(Mp.panel(Mp_i));
+    numValidDistances = (panelSize == _panelSizes.end()) ? 0 : panelSize->second;
+  } else {
+    numValidDistances = _librarySize;
+  }
+  for (int i : list->invalid) {
+    if (_libraryIndex[i] >= 0) {
+      numValidDistances -= 1;
+    }
+  }
+
+  kNNs.inds.clear();
+  kNNs.dists.clear();
+
+  // If every valid point is a neighbour, return them in index order (as 'lp_distances' would).
+  if (k < 0 || k >= numValidDistances) {
+    kNNs.inds.reserve(numValidDistances);
+    kNNs.dists.reserve(numValidDistances);
+    for (int i : _members) {
+      if (list->dists[i] != MISSING_SENTINEL) {
+        kNNs.inds.push_back(_libraryIndex[i]);
+        kNNs.dists.push_back(list->dists[i]);
+      }
+    }
+    return true;
+  }
+
+  kNNs.inds.reserve(k);
+  kNNs.dists.reserve(k);
+  for (int j = 0; j < (int)list->sorted.size() && (int)kNNs.inds.size() < k; j++) {
+    int i = list->sorted[j];
+    if (_libraryIndex[i] >= 0) {
+      kNNs.inds.push_back(_libraryIndex[i]);
+      kNNs.dists.push_back(list->dists[i]);
+    }
+  }
+
+  return true;
+}
@@ -0,0 +1,147 @@
+#pragma once
+
+#include "common.h"
+
+#include <mutex>
+#include <unordered_map>
+
+class UnivariateWasserstein;
+class WassersteinCosts;
+
+// Beyond this many dimensions the KD-tree's bounding boxes rarely let us skip any points,
+// so we use a ball tree instead.
+const int KD_TREE_MAX_DIMS = 8;
+
+// A spatial index over the points of a training manifold, used to find the k nearest neighbours
+// of a prediction point without computing the distance to every single training point.
+//
+// For small embeddings this is a KD-tree (each node stores the bounding box of its points), and
+// for larger embeddings it is a ball tree (each node stores a centre point and a radius), as the
+// bounding boxes become useless once the number of dimensions gets large.
+//
+// The neighbours returned are exactly those which the brute-force 'lp_distances' and
+// 'kNearestNeighbours' combination would find: the distances are computed by the same 'lp_distance'
+// function, points with a distance of 0 are thrown away, and ties are split by preferring the
+// smallest index.
+class NeighbourIndex
+{
+public:
+  // Can we build an index for this training manifold? We only handle the L^1 / L^2 distances
+  // when there are no missing values, and only bother when there are few neighbours to find.
+  static bool is_applicable(const Options& opts, const Manifold& M);
+
+  NeighbourIndex(const Options& opts, const Manifold& M);
+
+  // Find the k nearest neighbours of Mp(Mp_i, .), and count how many training points have a valid
+  // (non-zero) distance to it. The neighbours are sorted by distance, unless every valid point was
+  // returned, in which case they are sorted by index (like the output of 'lp_distances').
+  // Returns false if the index can't be used for this prediction point (e.g. it has missing values),
+  // in which case the caller should fall back to the brute-force search.
+  bool k_nearest_neighbours(int Mp_i, const Manifold& Mp, int k, DistanceIndexPairs& kNNs,
+                            int& numValidDistances) const;
+
+private:
+  struct Node
+  {
+    int start, end;  // The points in this node are _points[start:end]
+    int left, right; // Child nodes (-1 for a leaf)
+    int centre;      // Ball tree only: the training point at the centre of the ball
+    double radius;   // Ball tree only: the distance from the centre to the furthest point
+  };
+
+  struct Query;
+
+  const Options& _opts;
+  const Manifold& _M;
+  bool _ballTree;
+  int _E;
+
+  std::vector<int> _points;
+  std::vector<Node> _nodes;
+  std::vector<double> _lo, _hi; // KD-tree only: the bounding box of each node
+
+  // If we skip neighbours in other panels, then we keep a separate tree for each panel.
+  std::unordered_map<int, int> _panelRoots;
+  int _root;
+
+  int build(int start, int end);
+  void split_kd(Node& node, int& mid);
+  void split_ball(Node& node, int& mid);
+
+  double kd_lower_bound(int node, int Mp_i, const Manifold& Mp) const;
+  void search(int node, double nodeBound, Query& q) const;
+};
+
+// In a convergent cross mapping library sweep with nested libraries, the training manifold for each library size is
+// a subset of the training manifold for the largest library (and they all share the same prediction manifold).
+// For each prediction point, this keeps the list of every valid neighbour in the largest library sorted by distance,
+// so the k nearest neighbours in a smaller library are found by filtering this list rather than recalculating
+// all the distances. The neighbours found are exactly those which the brute-force search would find.
+class NestedLibraryNeighbours
+{
+public:
+  // Is there room to store the sorted neighbour lists for this many training & prediction points?
+  static bool is_applicable(int numTrainingPoints, int numPredictionPoints);
+
+  // 'M' and 'Mp' are the training & prediction manifolds for the largest library, where 'M' was created from the
+  // 'trainingRows' filter (keeping the points with missing values, which are thrown out here if 'skipMissing').
+  // Set 'skipOtherPanels' if the neighbours must come from the same panel as the prediction point.
+  NestedLibraryNeighbours(const Manifold& M, const Manifold& Mp, const std::vector<bool>& trainingRows,
+                          bool skipMissing, bool skipOtherPanels);
+
+  // A copy which finds the neighbours within the library given by 'trainingRows' (a subset of the largest library).
+  NestedLibraryNeighbours restrict_to(const std::vector<bool>& trainingRows) const;
+
+  // Find the k nearest neighbours of Mp(Mp_i, .) in this library's training manifold 'M', following the same
+  // conventions as 'NeighbourIndex::k_nearest_neighbours'. Returns false if the sorted list for this prediction
+  // point has already been thrown away (or 'M' / 'Mp' don't match this library), so the caller should fall back
+  // to the brute-force search.
+  bool k_nearest_neighbours(int Mp_i, const Options& opts, const Manifold& M, const Manifold& Mp, int k,
+                            DistanceIndexPairs& kNNs, int& numValidDistances) const;
+
+private:
+  // The neighbours of one prediction point in the largest library.
+  struct List
+  {
+    std::vector<int> sorted;    // The valid neighbours sorted by distance (splitting ties by index)
+    std::vector<double> dists;  // The distance to each point in M (MISSING_SENTINEL if it isn't a valid neighbour)
+    std::vector<int> invalid;   // Points which were compared but didn't give a valid distance (e.g. a distance of 0)
+  };
+
+  struct Row
+  {
+    std::mutex mutex;
+    bool released = false;
+    std::shared_ptr<const List> list;
+  };
+
+  struct Shared
+  {
+    Manifold M, Mp;
+    std::vector<int> rows;     // The index (into 'trainingRows') of each point in M
+    std::vector<bool> skipped; // Points in M which have missing values (when 'skipMissing' is set)
+    bool skipOtherPanels;
+    std::vector<Row> lists;
+    std::once_flag univariateOnce;
+    std::shared_ptr<UnivariateWasserstein> univariate; // Set up by the first Wasserstein search (if applicable)
+    std::shared_ptr<WassersteinCosts> costs;           // Or else this is set up by the first Wasserstein search
+
+    Shared(const Manifold& M, const Manifold& Mp)
+      : M(M)
+      , Mp(Mp)
+      , lists(Mp.nobs())
+    {}
+  };
+
+  std::shared_ptr<Shared> _shared;
+
+  // For each point of the largest library, its index in this library's training manifold (or -1 if it isn't included)
+  std::vector<int> _libraryIndex;
+  std::vector<int> _members; // The points of the largest library which are included in this library
+  std::unordered_map<int, int> _panelSizes; // The number of points in each panel (when 'skipOtherPanels' is set)
+  int _librarySize;
+  bool _largest;
+
+  NestedLibraryNeighbours() = default;
+  std::shared_ptr<const List> neighbour_list(int Mp_i, const Options& opts) const;
+};
@@ -230,10 +230,10 @@ public:
     : _graph(graph)
     , //_arc_id(graph),
     _arc_mixing(arc_mixing)
-    , _init_nb_nodes(nbnodes)
-    , _init_nb_arcs(nb_arcs)
     , MAX(std::numeric_limits<Value>::max())
     , INF(std::numeric_limits<Value>::has_infinity ? std::numeric_limits<Value>::infinity() : MAX)
+    , _init_nb_nodes(nbnodes)
+    , _init_nb_arcs(nb_arcs)
   {
     // Reset data structures
     reset();
@@ -345,10 +345,18 @@ private:
   IntVector _succ_num;
   IntVector _last_succ;
   IntVector _dirty_revs;
+  // Kept between runs so the initial pivots don't allocate memory
+  std::vector<Node> _supply_nodes, _demand_nodes, _stack;
+  IntVector _arc_vector;
+  BoolVector _reached;
   BoolVector _forward;
   StateVector _state;
   int _root;
 
+  // Whether the spanning tree left by the last run is an optimal basis which a warm start can begin from
+  bool _warm_startable = false;
+  int _num_iterations = 0;
+
   // Temporary data used in the current pivot iteration
   int in_arc, join, u_in, v_in, u_out, v_out;
   int first, second, right, last;
@@ -460,6 +468,13 @@ private:
 
       _block_size = std::max(int(BLOCK_SIZE_FACTOR * std::sqrt(double(_search_arc_num))), MIN_BLOCK_SIZE);
     }
+    // Whether an arc with reduced cost 'min' should enter the basis, 'a' being the scale of the terms summed to get it.
+    // Reduced costs are exact with integer costs, otherwise tiny negative ones are just rounding error.
+    static bool improves(Cost min, double a)
+    {
+      return std::numeric_limits<Cost>::is_exact ? min < 0 : min < -EPSILON * a;
+    }
+
     // Find next entering arc
     bool findEnteringArc()
     {
@@ -477,7 +492,7 @@ private:
           a = fabs(_pi[_source[_in_arc]]) > fabs(_pi[_target[_in_arc]]) ? fabs(_pi[_source[_in_arc]])
                                                                         : fabs(_pi[_target[_in_arc]]);
           a = a > fabs(_cost[_in_arc]) ? a : fabs(_cost[_in_arc]);
-          if (min < -EPSILON * a)
+          if (improves(min, a))
             goto search_end;
           cnt = _block_size;
         }
@@ -492,7 +507,7 @@ private:
           a = fabs(_pi[_source[_in_arc]]) > fabs(_pi[_target[_in_arc]]) ? fabs(_pi[_source[_in_arc]])
                                                                         : fabs(_pi[_target[_in_arc]]);
           a = a > fabs(_cost[_in_arc]) ? a : fabs(_cost[_in_arc]);
-          if (min < -EPSILON * a)
+          if (improves(min, a))
             goto search_end;
           cnt = _block_size;
         }
@@ -500,7 +515,7 @@ private:
       a = fabs(_pi[_source[_in_arc]]) > fabs(_pi[_target[_in_arc]]) ? fabs(_pi[_source[_in_arc]])
                                                                     : fabs(_pi[_target[_in_arc]]);
       a = a > fabs(_cost[_in_arc]) ? a : fabs(_cost[_in_arc]);
-      if (min >= -EPSILON * a)
+      if (!improves(min, a))
         return false;
 
     search_end:
@@ -695,6 +710,7 @@ public:
               << "\nMAX_ITER_REACHED" << MAX_ITER_REACHED << "\n";
 #endif
 
+    _warm_startable = false;
     if (!init())
       return INFEASIBLE;
 #if DEBUG_LVL > 0
@@ -703,6 +719,31 @@ public:
     return start();
   }
 
+  /// \brief Run the algorithm again from the previous optimal basis.
+  ///
+  /// This function is like \ref run(), but it starts from the spanning
+  /// tree of the previous optimal solution rather than from scratch.
+  /// Only the arc costs may have changed since then (the digraph and
+  /// the supplies must be the same), so the previous flow is still
+  /// feasible and only the node potentials are recalculated. When the
+  /// new costs are close to the old ones, far fewer pivots are needed.
+  /// If the previous run didn't end with an optimal solution, this is
+  /// the same as \ref run().
+  ///
+  /// \see run()
+  ProblemType rerun()
+  {
+    if (!_warm_startable) {
+      return run();
+    }
+    _warm_startable = false;
+    warmStart();
+    return start();
+  }
+
+  /// \brief Return the number of pivots made by the last run.
+  int iterations() const { return _num_iterations; }
+
   /// \brief Reset all the parameters that have been given before.
   ///
   /// This function resets all the paramaters that have been given
@@ -834,6 +875,29 @@ public:
     return *this;
   }
 
+  /// \brief Reset the internal data structures for a new digraph size.
+  ///
+  /// This function is like \ref reset(), but for reusing one object to
+  /// solve a sequence of problems where the underlying digraph (which
+  /// must be the same object as before) has been given \c nbnodes nodes
+  /// and \c nb_arcs arcs. The vectors are only resized, so once they have
+  /// grown to fit the largest problem no more memory is allocated.
+  /// The flows left over from the previous solution are cleared.
+  ///
+  /// \return <tt>(*this)</tt>
+  ///
+  /// \see reset(), run()
+  NetworkSimplexSimple& reset(int nbnodes, long long nb_arcs)
+  {
+    _init_nb_nodes = nbnodes;
+    _init_nb_arcs = nb_arcs;
+    reset();
+    std::fill_n(_flow.begin(), _arc_num, 0);
+    in_arc = 0;
+    _warm_startable = false;
+    return *this;
+  }
+
   /// @}
 
   /// \name Query Functions
@@ -961,17 +1025,13 @@ private:
     _sum_supply = 0;
 
     // Initialize artifical cost
-    Cost ART_COST;
-    if (std::numeric_limits<Cost>::is_exact) {
-      ART_COST = std::numeric_limits<Cost>::max() / 2 + 1;
-    } else {
-      ART_COST = 0;
-      for (int i = 0; i != _arc_num; ++i) {
-        if (_cost[i] > ART_COST)
-          ART_COST = _cost[i];
-      }
-      ART_COST = (ART_COST + 1) * _node_num;
+    // (Integer costs use the same bound rather than half the largest Cost, so the potentials can't overflow)
+    Cost ART_COST = 0;
+    for (int i = 0; i != _arc_num; ++i) {
+      if (_cost[i] > ART_COST)
+        ART_COST = _cost[i];
     }
+    ART_COST = (ART_COST + 1) * _node_num;
 
     // Initialize arc maps
     for (int i = 0; i != _arc_num; ++i) {
@@ -1098,6 +1158,30 @@ private:
     return true;
   }
 
+  // Prepare to restart from the previous spanning tree: the artificial arcs
+  // get the costs init() would give them, and the node potentials are set
+  // so every tree arc has zero reduced cost under the new costs (visiting
+  // the nodes in thread order, so each parent is done before its children).
+  void warmStart()
+  {
+    Cost ART_COST = 0;
+    for (int i = 0; i != _arc_num; ++i) {
+      if (_cost[i] > ART_COST)
+        ART_COST = _cost[i];
+    }
+    ART_COST = (ART_COST + 1) * _node_num;
+
+    for (int e = _arc_num; e != _all_arc_num; ++e) {
+      _cost[e] = ((int)_source[e] == _root) ? ART_COST : 0;
+    }
+
+    _pi[_root] = 0;
+    for (int u = _thread[_root]; u != _root; u = _thread[u]) {
+      int p = _parent[u];
+      _pi[u] = _forward[u] ? _pi[p] - _cost[_pred[u]] : _pi[p] + _cost[_pred[u]];
+    }
+  }
+
   // Find the join node
   void findJoinNode()
   {
@@ -1318,7 +1402,10 @@ private:
   bool initialPivots()
   {
     Value curr, total = 0;
-    std::vector<Node> supply_nodes, demand_nodes;
+    std::vector<Node>& supply_nodes = _supply_nodes;
+    std::vector<Node>& demand_nodes = _demand_nodes;
+    supply_nodes.clear();
+    demand_nodes.clear();
     Node u;
     _graph.first(u);
     for (; u != INVALIDNODE; _graph.next(u)) {
@@ -1335,14 +1422,17 @@ private:
     if (total <= 0)
       return true;
 
-    IntVector arc_vector;
+    IntVector& arc_vector = _arc_vector;
+    arc_vector.clear();
     if (_sum_supply >= 0) {
       if (supply_nodes.size() == 1 && demand_nodes.size() == 1) {
         // Perform a reverse graph search from the sink to the source
         // typename GR::template NodeMap<bool> reached(_graph, false);
-        BoolVector reached(_node_num, false);
+        BoolVector& reached = _reached;
+        reached.assign(_node_num, false);
         Node s = supply_nodes[0], t = demand_nodes[0];
-        std::vector<Node> stack;
+        std::vector<Node>& stack = _stack;
+        stack.clear();
         reached[t] = true;
         stack.push_back(t);
         while (!stack.empty()) {
@@ -1440,7 +1530,7 @@ private:
     // pivot.setDantzig(true);
     // Execute the Network Simplex algorithm
     while (pivot.findEnteringArc()) {
-      if (max_iter > 0 && ++iter_number >= max_iter && max_iter > 0) {
+      if (++iter_number >= max_iter && max_iter > 0) {
 #if DEBUG_LVL > 0
         char errMess[1000];
         sprintf(errMess,
@@ -1530,6 +1620,8 @@ private:
     }
     std::cout << "Sum of the flow " << sumFlow << "\n" << niter << " iterations, current cost=" << totalCost() << "\n";
 #endif
+    _num_iterations = iter_number;
+
     // Check feasibility
     if (retVal == OPTIMAL) {
       for (int e = _search_arc_num; e != _all_arc_num; ++e) {
@@ -1540,6 +1632,10 @@ private:
             _flow[e] = 0;
         }
       }
+
+      // The tree can only be reused with the EQ supply constraints, where
+      // the artificial arcs' costs are determined by their direction.
+      _warm_startable = (_sum_supply == 0);
     }
 
     // Shift potentials to meet the requirements of the GEQ/LEQ type
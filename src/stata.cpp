@@ -35,6 +35,12 @@ char* SAVE_COPREDICTION = (char*)"_copredict";
 char* SAVE_SMAP = (char*)"_savesmap";
 char* SAVE_INPUTS = (char*)"_saveinputs";
 char* NUM_REPS = (char*)"_round";
+char* NESTED_LIBRARIES = (char*)"_nested";
+char* SINKHORN_EPSILON = (char*)"_sinkhorneps";
+char* SINKHORN_TOLERANCE = (char*)"_sinkhorntol";
+char* DISTANCE_CACHE = (char*)"_distcache";
+char* PIN_THREADS = (char*)"_pinthreads";
+char* WARM_START = (char*)"_warmstart";
 
 class StataIO : public IO
 {
@@ -51,7 +57,8 @@ std::atomic<bool> allTasksFinished = false;
 
 bool keep_going()
 {
-  return !breakButtonPressed;
+  // Polled by every worker for every prediction, so this is only a relaxed load of a flag which is written once
+  return !breakButtonPressed.load(std::memory_order_relaxed);
 }
 
 void all_tasks_finished()
@@ -363,6 +370,8 @@ ST_retcode launch_edm_tasks(int argc, char* argv[])
     opts.distance = Distance::Euclidean;
   } else if (distance == "wasserstein" || distance == "Wasserstein") {
     opts.distance = Distance::Wasserstein;
+  } else if (distance == "sinkhorn" || distance == "Sinkhorn") {
+    opts.distance = Distance::Sinkhorn;
   } else {
     return INVALID_DISTANCE;
   }
@@ -383,6 +392,12 @@ ST_retcode launch_edm_tasks(int argc, char* argv[])
   // Read in some macros from Stata
   char buffer[200];
 
+  // Should the worker threads be pinned to their own CPUs?
+  if (SF_macro_use(PIN_THREADS, buffer, 200)) {
+    io.print("Got an error rc from macro_use!\n");
+  }
+  opts.pinThreads = !(std::string(buffer).empty());
+
   // What is k?
   if (SF_macro_use(NUM_NEIGHBOURS, buffer, 200)) {
     io.print("Got an error rc from macro_use!\n");
@@ -424,6 +439,46 @@ ST_retcode launch_edm_tasks(int argc, char* argv[])
     saveSMAPCoeffs = !(std::string(buffer).empty());
   }
 
+  // Are the libraries nested (only in xmap mode)?
+  bool nestedLibraries;
+  if (explore) {
+    nestedLibraries = false;
+
+    // How much memory (in MB) can be used to share the Wasserstein distances between tasks?
+    if (SF_macro_use(DISTANCE_CACHE, buffer, 200)) {
+      io.print("Got an error rc from macro_use!\n");
+    }
+    opts.distanceCacheMB = std::max(atoi(buffer), 0);
+  } else {
+    if (SF_macro_use(NESTED_LIBRARIES, buffer, 200)) {
+      io.print("Got an error rc from macro_use!\n");
+    }
+    nestedLibraries = !(std::string(buffer).empty());
+  }
+
+  // Should each Wasserstein transport problem start from the optimal basis of the one before it?
+  if (SF_macro_use(WARM_START, buffer, 200)) {
+    io.print("Got an error rc from macro_use!\n");
+  }
+  opts.warmStartEMD = !(std::string(buffer).empty());
+
+  // The regularisation strength and stopping tolerance for the Sinkhorn distance
+  if (opts.distance == Distance::Sinkhorn) {
+    if (SF_macro_use(SINKHORN_EPSILON, buffer, 200)) {
+      io.print("Got an error rc from macro_use!\n");
+    }
+    opts.sinkhornEpsilon = std::string(buffer).empty() ? DEFAULT_SINKHORN_EPSILON : atof(buffer);
+
+    if (SF_macro_use(SINKHORN_TOLERANCE, buffer, 200)) {
+      io.print("Got an error rc from macro_use!\n");
+    }
+    opts.sinkhornTolerance = std::string(buffer).empty() ? DEFAULT_SINKHORN_TOLERANCE : atof(buffer);
+
+    if (opts.sinkhornEpsilon <= 0 || opts.sinkhornTolerance <= 0) {
+      return INVALID_DISTANCE;
+    }
+  }
+
   // Are we saving the inputs to a JSON file?
   if (SF_macro_use(SAVE_INPUTS, buffer, 200)) {
     io.print("Got an error rc from macro_use!\n");
@@ -490,7 +545,7 @@ ST_retcode launch_edm_tasks(int argc, char* argv[])
     panelIDs = stata_columns<int>(3 + numExtras + 1 + copredictMode + 1);
   }
 
-  if (dtMode || (opts.distance == Distance::Wasserstein && wassDT)) {
+  if (dtMode || (is_transport_distance(opts.distance) && wassDT)) {
     if (wassDT && !dtMode) {
       opts.dtWeight = 1.0;
       dt0 = true;
@@ -630,6 +685,7 @@ ST_retcode launch_edm_tasks(int argc, char* argv[])
     taskGroup["copredictMode"] = copredictMode;
     taskGroup["usable"] = bool_to_int(usable);
     taskGroup["rngState"] = rngState;
+    taskGroup["nestedLibraries"] = nestedLibraries;
 
     append_to_dumpfile(saveInputsFilename + ".json", taskGroup);
 
@@ -641,7 +697,7 @@ ST_retcode launch_edm_tasks(int argc, char* argv[])
 
   futures = launch_task_group(generator, opts, Es, libraries, k, numReps, crossfold, explore, full,
                               saveFinalPredictions, saveFinalCoPredictions, saveSMAPCoeffs, copredictMode, usable,
-                              rngState, &io, keep_going, all_tasks_finished);
+                              rngState, &io, keep_going, all_tasks_finished, nestedLibraries);
 
   return SUCCESS;
 }
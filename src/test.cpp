@@ -6,8 +6,15 @@
 #endif
 #include <fmt/format.h>
 
+#include "EMD_wrapper.h"
+#include "cpu.h"
+#include "distances.h"
 #include "edm.h"
 #include "manifold.h"
+#include "neighbour_index.h"
+#include "thread_pool.h"
+
+#include <numeric> // std::iota
 
 const double NA = MISSING_SENTINEL;
 
@@ -16,6 +23,7 @@ const double NA = MISSING_SENTINEL;
 
 std::unique_ptr<double[]> wasserstein_cost_matrix(const Manifold& M, const Manifold& Mp, int i, int j,
                                                   const Options& opts, int& len_i, int& len_j);
+double wasserstein(double* C, int len_i, int len_j);
 
 void print_raw_matrix(const double* M, int rows, int cols)
 {
@@ -440,4 +448,1636 @@ TEST_CASE("Coprediction and usable/training set/prediction sets", "[copredSets]"
     std::vector<double> yp_co_true = { 13 };
     require_manifolds_match(Mp_co, Mp_co_true, yp_co_true);
   }
-}
\ No newline at end of file
+}
+
+TEST_CASE("Neighbour index matches brute-force search", "[neighbourIndex]")
+{
+  int tau = 1;
+  int p = 1;
+  int n = 300;
+
+  // Use a handful of integer values so there are many ties & repeated points.
+  std::vector<double> t, x, category;
+  std::vector<int> panelIDs;
+  for (int i = 0; i < n; i++) {
+    t.push_back(i);
+    x.push_back((i * 7919) % 5);
+    category.push_back((i * 104729) % 3);
+    panelIDs.push_back(i < n / 2 ? 0 : 1);
+  }
+
+  auto check_index = [&](int E, Distance distance, double idw) {
+    CAPTURE(E);
+    CAPTURE(idw);
+
+    ManifoldGenerator generator(t, x, tau, p, {}, {}, panelIDs, { category }, 1);
+    std::vector<bool> usable = generator.generate_usable(E);
+    Manifold M = generator.create_manifold(E, usable, false, false);
+    Manifold Mp = generator.create_manifold(E, usable, false, true);
+
+    Options opts;
+    opts.distance = distance;
+    opts.missingdistance = 0;
+    opts.panelMode = true;
+    opts.idw = idw;
+    opts.metrics = {};
+    for (int j = 0; j < M.E_actual(); j++) {
+      opts.metrics.push_back(j < E ? Metric::Diff : Metric::CheckSame);
+    }
+
+    for (int k : { 1, 4, 10 }) {
+      opts.k = k;
+      REQUIRE(NeighbourIndex::is_applicable(opts, M));
+      NeighbourIndex index(opts, M);
+
+      for (int Mp_i = 0; Mp_i < Mp.nobs(); Mp_i++) {
+        CAPTURE(Mp_i);
+        DistanceIndexPairs potentialNN =
+          lp_distances(Mp_i, opts, M, Mp, potential_neighbour_indices(Mp_i, opts, M, Mp));
+
+        DistanceIndexPairs kNNs;
+        int numValidDistances;
+        REQUIRE(index.k_nearest_neighbours(Mp_i, Mp, k, kNNs, numValidDistances));
+        REQUIRE(numValidDistances == potentialNN.inds.size());
+
+        DistanceIndexPairs kNNsTrue =
+          (k >= potentialNN.inds.size()) ? potentialNN : kNearestNeighbours(potentialNN, k);
+        require_vectors_match<int>(kNNs.inds, kNNsTrue.inds);
+        require_vectors_match<double>(kNNs.dists, kNNsTrue.dists);
+      }
+    }
+  };
+
+  SECTION("KD-tree")
+  {
+    for (double idw : { -1.0, 0.0, 0.5 }) {
+      check_index(3, Distance::Euclidean, idw);
+      check_index(3, Distance::MeanAbsoluteError, idw);
+    }
+  }
+
+  SECTION("Ball tree")
+  {
+    for (double idw : { -1.0, 0.0, 0.5 }) {
+      check_index(6, Distance::Euclidean, idw);
+      check_index(6, Distance::MeanAbsoluteError, idw);
+    }
+  }
+}
+
+TEST_CASE("Batched Euclidean neighbours match brute-force search", "[batchNeighbours]")
+{
+  int tau = 1;
+  int p = 1;
+  int n = 300;
+
+  // Many ties & repeated points, and a large offset so the matrix product estimates lose some precision.
+  std::vector<double> t, x;
+  std::vector<int> panelIDs;
+  for (int i = 0; i < n; i++) {
+    t.push_back(i);
+    x.push_back((i % 17 == 0) ? MISSING_SENTINEL : 1000.0 + (i * 7919) % 5 + 0.25 * ((i * 31) % 3));
+    panelIDs.push_back(i < n / 2 ? 0 : 1);
+  }
+
+  ManifoldGenerator generator(t, x, tau, p, {}, {}, panelIDs, {}, 0, false, false, false, true);
+
+  for (int E : { 1, 3, 7 }) {
+    for (double idw : { -1.0, 0.0, 0.5 }) {
+      for (double missingdistance : { 0.0, 2.0 }) {
+        CAPTURE(E);
+        CAPTURE(idw);
+        CAPTURE(missingdistance);
+
+        std::vector<bool> usable = generator.generate_usable(E);
+        Manifold M = generator.create_manifold(E, usable, false, false);
+        Manifold Mp = generator.create_manifold(E, usable, false, true);
+
+        Options opts;
+        opts.distance = Distance::Euclidean;
+        opts.missingdistance = missingdistance;
+        opts.panelMode = true;
+        opts.idw = idw;
+        opts.metrics = std::vector<Metric>(M.E_actual(), Metric::Diff);
+
+        for (int k : { 1, 4, 10, 1000 }) {
+          CAPTURE(k);
+          opts.k = k;
+          REQUIRE(BatchEuclideanNeighbours::is_applicable(opts, M));
+          BatchEuclideanNeighbours batch(opts, M);
+
+          std::vector<DistanceIndexPairs> kNNs;
+          std::vector<int> numValidDistances;
+          batch.k_nearest_neighbours(0, Mp.nobs(), Mp, k, kNNs, numValidDistances);
+          REQUIRE(kNNs.size() == Mp.nobs());
+
+          for (int Mp_i = 0; Mp_i < Mp.nobs(); Mp_i++) {
+            CAPTURE(Mp_i);
+            if (Mp.any_missing(Mp_i)) {
+              REQUIRE(numValidDistances[Mp_i] == -1);
+              continue;
+            }
+
+            DistanceIndexPairs potentialNN =
+              lp_distances(Mp_i, opts, M, Mp, potential_neighbour_indices(Mp_i, opts, M, Mp));
+            REQUIRE(numValidDistances[Mp_i] == potentialNN.inds.size());
+
+            DistanceIndexPairs kNNsTrue =
+              (k >= potentialNN.inds.size()) ? potentialNN : kNearestNeighbours(potentialNN, k);
+            require_vectors_match<int>(kNNs[Mp_i].inds, kNNsTrue.inds);
+            require_vectors_match<double>(kNNs[Mp_i].dists, kNNsTrue.dists);
+          }
+        }
+      }
+    }
+  }
+}
+
+TEST_CASE("Distances extended from a smaller E match those calculated from scratch", "[laggedDistanceSums]")
+{
+  int tau = 1;
+  int p = 1;
+  int n = 120;
+  int maxE = 6;
+
+  std::vector<double> t, x, extra, lagged;
+  std::vector<int> panelIDs;
+  for (int i = 0; i < n; i++) {
+    t.push_back(i + (i % 7 == 0));
+    x.push_back((i % 23 == 0) ? MISSING_SENTINEL : sin(0.3 * i) + (i % 4));
+    lagged.push_back((i * 7919) % 5);
+    extra.push_back((i * 104729) % 3);
+    panelIDs.push_back(i < n / 2 ? 0 : 1);
+  }
+
+  ManifoldGenerator generator(t, x, tau, p, {}, {}, panelIDs, { lagged, extra }, 1, true, false, false, true);
+
+  std::vector<bool> trainingRows(n), predictionRows(n);
+  for (int i = 0; i < n; i++) {
+    trainingRows[i] = (i % 3 != 0);
+    predictionRows[i] = (i % 3 == 0);
+  }
+
+  for (double idw : { -1.0, 0.0, 0.5 }) {
+    for (double missingdistance : { 0.0, 2.0 }) {
+      CAPTURE(idw);
+      CAPTURE(missingdistance);
+
+      Options opts;
+      opts.distance = Distance::Euclidean;
+      opts.missingdistance = missingdistance;
+      opts.panelMode = true;
+      opts.idw = idw;
+
+      LaggedDistanceSums sums(generator.create_manifold(maxE, trainingRows, false, false),
+                              generator.create_manifold(maxE, predictionRows, false, true));
+
+      for (int E = 1; E <= maxE; E++) {
+        CAPTURE(E);
+        Manifold M = generator.create_manifold(E, trainingRows, false, false);
+        Manifold Mp = generator.create_manifold(E, predictionRows, false, true);
+
+        Manifold Msmall = generator.create_manifold(std::max(E - 1, 1), trainingRows, false, false);
+        Manifold Mpsmall = generator.create_manifold(std::max(E - 1, 1), predictionRows, false, true);
+
+        opts.metrics = std::vector<Metric>(M.E_actual(), Metric::Diff);
+        opts.metrics.back() = Metric::CheckSame;
+
+        for (int Mp_i = 0; Mp_i < Mp.nobs(); Mp_i++) {
+          CAPTURE(Mp_i);
+          std::vector<int> inds = potential_neighbour_indices(Mp_i, opts, M, Mp);
+          DistanceIndexPairs expected = lp_distances(Mp_i, opts, M, Mp, inds);
+
+          DistanceIndexPairs result;
+          REQUIRE(sums.lp_distances(Mp_i, opts, M, Mp, inds, result));
+          require_vectors_match<int>(result.inds, expected.inds);
+          require_vectors_match<double>(result.dists, expected.dists);
+
+          // Once a point's sums have moved on to this E, they can't be used for a smaller E.
+          if (E > 1) {
+            REQUIRE(!sums.lp_distances(Mp_i, opts, Msmall, Mpsmall, inds, result));
+          }
+        }
+      }
+    }
+  }
+}
+
+TEST_CASE("The E-sweeps in progress share one memory budget for their distance sums", "[laggedDistanceSums]")
+{
+  // Each sweep compares 4100 x 4100 points, so its sums take just over half of the budget.
+  int n = 8200;
+  std::vector<double> t, x;
+  for (int i = 0; i < n; i++) {
+    t.push_back(i);
+    x.push_back(sin(0.1 * i));
+  }
+
+  ManifoldGenerator generator(t, x, 1, 1);
+
+  std::vector<bool> trainingRows(n), predictionRows(n);
+  for (int i = 0; i < n; i++) {
+    trainingRows[i] = (i < n / 2);
+    predictionRows[i] = (i >= n / 2);
+  }
+
+  Options opts;
+  opts.distance = Distance::Euclidean;
+
+  auto first = make_lagged_distance_sums(generator, opts, 3, trainingRows, predictionRows, false);
+  REQUIRE(first != nullptr);
+
+  // A second sweep doesn't fit in what is left, until the first one has finished with its sums.
+  REQUIRE(make_lagged_distance_sums(generator, opts, 3, trainingRows, predictionRows, false) == nullptr);
+  first = nullptr;
+  REQUIRE(make_lagged_distance_sums(generator, opts, 3, trainingRows, predictionRows, false) != nullptr);
+}
+
+TEST_CASE("Nested library neighbours match brute-force search", "[nestedLibraries]")
+{
+  int tau = 1;
+  int p = 1;
+  int n = 200;
+  int E = 3;
+
+  // Many ties & repeated points, and some missing values.
+  std::vector<double> t, x;
+  std::vector<int> panelIDs;
+  for (int i = 0; i < n; i++) {
+    t.push_back(i);
+    x.push_back((i % 19 == 0) ? MISSING_SENTINEL : (i * 7919) % 5 + 0.5 * ((i * 31) % 3));
+    panelIDs.push_back(i < n / 2 ? 0 : 1);
+  }
+
+  ManifoldGenerator generator(t, x, tau, p, {}, {}, panelIDs, {}, 0, false, false, false, true);
+
+  // Each library is a subset of the next (as a uniform cutoff gives), and the largest takes up half the points.
+  std::vector<double> u;
+  for (int i = 0; i < n; i++) {
+    u.push_back(((i * 104729) % 1009) / 1009.0);
+  }
+  std::vector<double> cutoffs = { 0.05, 0.2, 0.35, 0.5 };
+
+  std::vector<bool> predictionRows(n);
+  for (int i = 0; i < n; i++) {
+    predictionRows[i] = (u[i] >= 0.5);
+  }
+
+  for (bool skipMissing : { false, true }) {
+    for (double idw : { -1.0, 0.0 }) {
+      CAPTURE(skipMissing);
+      CAPTURE(idw);
+
+      Options opts;
+      opts.distance = Distance::Euclidean;
+      opts.missingdistance = 0;
+      opts.panelMode = true;
+      opts.idw = idw;
+
+      std::vector<bool> largestRows(n);
+      for (int i = 0; i < n; i++) {
+        largestRows[i] = (u[i] < cutoffs.back());
+      }
+      Manifold Mlargest = generator.create_manifold(E, largestRows, false, false);
+      Manifold Mp = generator.create_manifold(E, predictionRows, false, true);
+      opts.metrics = std::vector<Metric>(Mp.E_actual(), Metric::Diff);
+
+      for (int k : { 1, 4, 1000 }) {
+        CAPTURE(k);
+        opts.k = k;
+
+        // The sorted lists are thrown away once the largest library has used them, so start afresh for each k.
+        NestedLibraryNeighbours nested(Mlargest, Mp, largestRows, skipMissing, opts.panelMode && (idw < 0));
+
+        for (double cutoff : cutoffs) {
+          CAPTURE(cutoff);
+          std::vector<bool> trainingRows(n);
+          for (int i = 0; i < n; i++) {
+            trainingRows[i] = (u[i] < cutoff);
+          }
+          Manifold M = generator.create_manifold(E, trainingRows, false, false, 0.0, skipMissing);
+          NestedLibraryNeighbours library = nested.restrict_to(trainingRows);
+
+          for (int Mp_i = 0; Mp_i < Mp.nobs(); Mp_i++) {
+            CAPTURE(Mp_i);
+            DistanceIndexPairs potentialNN =
+              lp_distances(Mp_i, opts, M, Mp, potential_neighbour_indices(Mp_i, opts, M, Mp));
+
+            DistanceIndexPairs kNNs;
+            int numValidDistances;
+            REQUIRE(library.k_nearest_neighbours(Mp_i, opts, M, Mp, k, kNNs, numValidDistances));
+            REQUIRE(numValidDistances == potentialNN.inds.size());
+
+            DistanceIndexPairs kNNsTrue =
+              (k >= potentialNN.inds.size()) ? potentialNN : kNearestNeighbours(potentialNN, k);
+            require_vectors_match<int>(kNNs.inds, kNNsTrue.inds);
+            require_vectors_match<double>(kNNs.dists, kNNsTrue.dists);
+          }
+        }
+      }
+    }
+  }
+}
+
+TEST_CASE("Parallel for loop runs every iteration exactly once", "[parallelFor]")
+{
+  for (int numWorkers : { 1, 2, 4 }) {
+    ThreadPool pool(numWorkers);
+
+    for (int n : { 0, 1, 7, 1000 }) {
+      for (int grain : { 1, 3, 64, 5000 }) {
+        CAPTURE(numWorkers);
+        CAPTURE(n);
+        CAPTURE(grain);
+
+        std::vector<std::atomic<int>> counts(n);
+        for (auto& count : counts) {
+          count = 0;
+        }
+
+        // Make the iterations uneven in cost so that some of the work gets stolen.
+        std::atomic<int> maxDone = 0;
+        pool.parallel_for(
+          10, 10 + n, grain,
+          [&counts](int i) {
+            volatile double x = 0;
+            for (int j = 0; j < (i % 13) * 100; j++) {
+              x = x + j;
+            }
+            counts[i - 10] += 1;
+          },
+          [&maxDone](int numDone) {
+            int prev = maxDone;
+            while (prev < numDone && !maxDone.compare_exchange_weak(prev, numDone)) {
+            }
+          });
+
+        for (int i = 0; i < n; i++) {
+          CAPTURE(i);
+          REQUIRE(counts[i] == 1);
+        }
+        REQUIRE(maxDone == n);
+      }
+    }
+  }
+}
+
+TEST_CASE("Parallel for loop passes an exception back to the caller", "[parallelFor]")
+{
+  for (int numWorkers : { 1, 2, 4 }) {
+    CAPTURE(numWorkers);
+    ThreadPool pool(numWorkers);
+
+    // Whichever thread runs the bad iteration, the caller sees the exception rather than waiting forever.
+    for (int bad : { 0, 499, 999 }) {
+      CAPTURE(bad);
+      REQUIRE_THROWS_WITH(pool.parallel_for(0, 1000, 7,
+                                            [bad](int i) {
+                                              if (i == bad) {
+                                                throw std::runtime_error("bad iteration");
+                                              }
+                                            }),
+                          "bad iteration");
+    }
+
+    // The pool is still usable afterwards.
+    std::atomic<int> count = 0;
+    pool.parallel_for(0, 100, 1, [&count](int) { count += 1; });
+    REQUIRE(count == 100);
+  }
+}
+
+TEST_CASE("S-map coefficients match the least squares solution", "[smapCoefficients]")
+{
+  int tau = 1;
+  int p = 1;
+  int n = 80;
+
+  std::vector<double> t, x, extra;
+  for (int i = 0; i < n; i++) {
+    t.push_back(i);
+    x.push_back(sin(0.7 * i) + 0.1 * ((i * 7919) % 5));
+    extra.push_back(cos(0.3 * i));
+  }
+
+  auto check_coefficients = [&](const ManifoldGenerator& generator, int E) {
+    CAPTURE(E);
+    std::vector<bool> usable = generator.generate_usable(E);
+    Manifold M = generator.create_manifold(E, usable, false, false);
+
+    std::vector<int> kNNInds;
+    for (int i = 0; i < M.nobs(); i += 2) {
+      kNNInds.push_back(i);
+    }
+    int k = kNNInds.size();
+
+    Eigen::VectorXd w(k);
+    for (int i = 0; i < k; i++) {
+      w(i) = exp(-0.05 * (i % 11));
+    }
+
+    MatrixXd X(k, M.E_actual() + 1);
+    Eigen::VectorXd y(k);
+    for (int i = 0; i < k; i++) {
+      X(i, 0) = w(i);
+      for (int j = 0; j < M.E_actual(); j++) {
+        X(i, j + 1) = w(i) * M(kNNInds[i], j);
+      }
+      y(i) = w(i) * M.y(kNNInds[i]);
+    }
+
+    // The minimum-norm least squares solution (also when X doesn't have full rank).
+    Eigen::CompleteOrthogonalDecomposition<MatrixXd> cod(X);
+    cod.setThreshold(1e-10);
+    Eigen::VectorXd expected = cod.solve(y);
+
+    Eigen::VectorXd ics = smap_coefficients(M, kNNInds, w);
+    REQUIRE(ics.size() == expected.size());
+    for (int j = 0; j < ics.size(); j++) {
+      CAPTURE(j);
+      REQUIRE(std::abs(ics(j) - expected(j)) < 1e-6);
+    }
+  };
+
+  SECTION("Full rank")
+  {
+    ManifoldGenerator generator(t, x, tau, p, {}, {}, {}, { extra }, 0);
+    for (int E : { 1, 2, 5, 16, 20 }) {
+      check_coefficients(generator, E);
+    }
+  }
+
+  SECTION("Rank deficient")
+  {
+    // The extra variable is just a copy of x, so two columns of the manifold are identical.
+    ManifoldGenerator generator(t, x, tau, p, {}, {}, {}, { x }, 0);
+    for (int E : { 1, 3, 20 }) {
+      check_coefficients(generator, E);
+    }
+  }
+}
+
+TEST_CASE("Multi-theta S-map predictions match each theta solved separately", "[smapThetas]")
+{
+  int tau = 1;
+  int p = 1;
+  int n = 60;
+  int E = 4;
+
+  std::vector<double> t, x;
+  for (int i = 0; i < n; i++) {
+    t.push_back(i);
+    x.push_back(sin(0.5 * i) + 0.2 * ((i * 7919) % 3));
+  }
+
+  ManifoldGenerator generator(t, x, tau, p);
+  std::vector<bool> usable = generator.generate_usable(E);
+  Manifold M = generator.create_manifold(E, usable, false, false);
+  Manifold Mp = generator.create_manifold(E, usable, false, true);
+
+  Options opts;
+  opts.thetas = { 0.0, 0.01, 0.5, 1.0, 4.0, 8.0 };
+  opts.saveKUsed = true;
+  opts.saveSMAPCoeffs = true;
+  int numThetas = opts.thetas.size();
+
+  int Mp_i = 7;
+  std::vector<int> kNNInds;
+  std::vector<double> dists;
+  for (int i = 0; i < 20; i++) {
+    kNNInds.push_back(3 * i + 1 < M.nobs() ? 3 * i + 1 : i);
+    dists.push_back(0.1 + 0.05 * i);
+  }
+
+  std::vector<double> ystar(numThetas * Mp.nobs(), MISSING_SENTINEL), coeffs(Mp.nobs() * (E + 1), MISSING_SENTINEL);
+  std::vector<int> rc(numThetas * Mp.nobs(), UNKNOWN_ERROR);
+  int kUsed = -1;
+
+  smap_predictions(Mp_i, opts, M, Mp, dists, kNNInds, Eigen::Map<MatrixXd>(ystar.data(), numThetas, Mp.nobs()),
+                   Eigen::Map<MatrixXd>(coeffs.data(), Mp.nobs(), E + 1),
+                   Eigen::Map<MatrixXi>(rc.data(), numThetas, Mp.nobs()), &kUsed);
+  REQUIRE(kUsed == kNNInds.size());
+
+  double meanDist = std::accumulate(dists.begin(), dists.end(), 0.0) / dists.size();
+
+  for (int th = 0; th < numThetas; th++) {
+    CAPTURE(th);
+    Eigen::VectorXd w(kNNInds.size());
+    for (int i = 0; i < kNNInds.size(); i++) {
+      w(i) = exp(-opts.thetas[th] * (dists[i] / meanDist));
+    }
+    Eigen::VectorXd ics = smap_coefficients(M, kNNInds, w);
+
+    double r = ics(0);
+    for (int j = 0; j < E; j++) {
+      r += Mp(Mp_i, j) * ics(j + 1);
+    }
+
+    REQUIRE(rc[th * Mp.nobs() + Mp_i] == SUCCESS);
+    REQUIRE(std::abs(ystar[th * Mp.nobs() + Mp_i] - r) < 1e-9);
+    if (th == numThetas - 1) {
+      for (int j = 0; j < E + 1; j++) {
+        REQUIRE(std::abs(coeffs[Mp_i * (E + 1) + j] - ics(j)) < 1e-9);
+      }
+    }
+  }
+
+  // With a large theta, the furthest neighbours' weights are tiny (~1e-199) but still count, though their squares
+  // underflow to zero.
+  Options largeTheta = opts;
+  largeTheta.thetas = { 250.0 };
+  kUsed = -1;
+  smap_predictions(Mp_i, largeTheta, M, Mp, dists, kNNInds, Eigen::Map<MatrixXd>(ystar.data(), 1, Mp.nobs()),
+                   Eigen::Map<MatrixXd>(coeffs.data(), Mp.nobs(), E + 1), Eigen::Map<MatrixXi>(rc.data(), 1, Mp.nobs()),
+                   &kUsed);
+  REQUIRE(kUsed == kNNInds.size());
+}
+
+TEST_CASE("Manifold cache shares identical manifolds", "[manifoldCache]")
+{
+  std::vector<double> t = { 1, 2, 3, 4, 5, 6, 7, 8 };
+  std::vector<double> x = { 11, 12, NA, 14, 15, 16, 17, 18 };
+  std::vector<double> co_x = { 21, 22, 23, 24, 25, 26, 27, 28 };
+  int E = 2;
+
+  ManifoldGenerator generator(t, x, 1, 1, {}, co_x);
+  ManifoldCache cache(std::make_shared<const ManifoldGenerator>(generator));
+
+  std::vector<bool> rows = { true, true, true, true, true, false, true, false };
+  std::vector<bool> otherRows = { true, true, true, true, false, true, true, false };
+
+  auto M = cache.create_manifold(E, rows, false, false);
+
+  // The same manifold is shared, whether it's called a training or a prediction manifold.
+  REQUIRE(cache.create_manifold(E, rows, false, false) == M);
+  REQUIRE(cache.create_manifold(E, rows, false, true) == M);
+  REQUIRE(cache.create_manifold(E, rows, true, false) == M);
+
+  // Though not when anything else changes.
+  REQUIRE(cache.create_manifold(E, rows, true, true) != M);
+  REQUIRE(cache.create_manifold(E, otherRows, false, false) != M);
+  REQUIRE(cache.create_manifold(E + 1, rows, false, false) != M);
+  REQUIRE(cache.create_manifold(E, rows, false, false, 1.0) != M);
+  REQUIRE(cache.create_manifold(E, rows, false, false, 0.0, true) != M);
+
+  Manifold M_true = generator.create_manifold(E, rows, false, false);
+  REQUIRE(M->nobs() == M_true.nobs());
+  for (int i = 0; i < M->nobs(); i++) {
+    CAPTURE(i);
+    for (int j = 0; j < M->E_actual(); j++) {
+      REQUIRE((*M)(i, j) == M_true(i, j));
+    }
+    REQUIRE(M->y(i) == M_true.y(i));
+  }
+
+  auto Mp_co = cache.create_manifold(E, rows, true, true);
+  Manifold Mp_co_true = generator.create_manifold(E, rows, true, true);
+  for (int i = 0; i < Mp_co->nobs(); i++) {
+    CAPTURE(i);
+    for (int j = 0; j < Mp_co->E_actual(); j++) {
+      REQUIRE((*Mp_co)(i, j) == Mp_co_true(i, j));
+    }
+  }
+
+  // Once nobody is using a manifold, it is freed (and will be rebuilt if it's needed again).
+  std::weak_ptr<const Manifold> weakM = M;
+  M = nullptr;
+  REQUIRE(weakM.expired());
+  REQUIRE(cache.create_manifold(E, rows, false, false) != nullptr);
+}
+
+TEST_CASE("Manifolds built by several threads match those built serially", "[parallelManifold]")
+{
+  int n = 10000;
+
+  std::vector<double> t, x, extra;
+  std::vector<int> panelIDs;
+  for (int i = 0; i < n; i++) {
+    t.push_back(i + (i % 11 == 0));
+    x.push_back((i % 37 == 0) ? MISSING_SENTINEL : sin(0.1 * i));
+    extra.push_back(i % 5);
+    panelIDs.push_back(i / 3000);
+  }
+
+  ManifoldGenerator generator(t, x, 2, 1, {}, {}, panelIDs, { extra }, 1, true, false, false, true);
+  ThreadPool pool(3);
+
+  std::vector<bool> filter(n);
+  for (int i = 0; i < n; i++) {
+    filter[i] = (i % 7 != 0);
+  }
+
+  for (bool skipMissing : { false, true }) {
+    CAPTURE(skipMissing);
+    Manifold M = generator.create_manifold(4, filter, false, false, 1.0, skipMissing);
+    Manifold M_par = generator.create_manifold(4, filter, false, false, 1.0, skipMissing, &pool);
+
+    REQUIRE(M_par.nobs() == M.nobs());
+    REQUIRE(M_par.ySize() == M.ySize());
+    REQUIRE(M_par.E_actual() == M.E_actual());
+    for (int i = 0; i < M.nobs(); i++) {
+      CAPTURE(i);
+      for (int j = 0; j < M.E_actual(); j++) {
+        REQUIRE(M_par(i, j) == M(i, j));
+      }
+      REQUIRE(M_par.y(i) == M.y(i));
+      REQUIRE(M_par.panel(i) == M.panel(i));
+    }
+  }
+}
+
+TEST_CASE("Looking up lags directly matches walking through the rows", "[observationLookup]")
+{
+  // Panels which aren't contiguous, rows without a time, a panel whose times go backwards,
+  // and a panel whose times are too spread out to be worth tabulating.
+  std::vector<double> t, x;
+  std::vector<int> panelIDs;
+  for (int i = 0; i < 400; i++) {
+    int panel = (i / 50) % 4;
+    panelIDs.push_back(panel);
+    if (i % 23 == 5) {
+      t.push_back(MISSING_SENTINEL);
+    } else if (panel == 2 && i >= 300) {
+      t.push_back((i * 37) % 50);
+    } else if (panel == 3) {
+      t.push_back(1000.0 * (i % 50) + (i % 3));
+    } else {
+      t.push_back(i % 50 + 2 * (i % 7 == 0));
+    }
+    x.push_back(i);
+  }
+
+  // The way the lags were found before: walking from one row to the next.
+  auto walk = [&](const ManifoldGenerator& generator, int target, int& k, int direction, int panel) {
+    while (k >= 0 && k < (int)t.size()) {
+      if (panelIDs[k] != panel) {
+        return false;
+      }
+      int obs = generator.get_observation_num(k);
+      if (obs < 0) {
+        k += direction;
+        continue;
+      }
+      if (obs == target) {
+        return true;
+      }
+      if ((direction > 0 && obs > target) || (direction < 0 && obs < target)) {
+        return false;
+      }
+      k += direction;
+    }
+    return false;
+  };
+
+  for (int tau : { 1, 2 }) {
+    for (int p : { 1, -2 }) {
+      CAPTURE(tau);
+      CAPTURE(p);
+      int E = 4;
+      ManifoldGenerator generator(t, x, tau, p, {}, {}, panelIDs);
+      Manifold M = generator.create_manifold(E, {}, false, false);
+      REQUIRE(M.nobs() == t.size());
+
+      for (int i = 0; i < (int)t.size(); i++) {
+        CAPTURE(i);
+        int startObs = generator.get_observation_num(i);
+
+        int k = i - 1;
+        for (int j = 1; j < E; j++) {
+          CAPTURE(j);
+          bool found = walk(generator, startObs - j * tau, k, -1, panelIDs[i]);
+          REQUIRE(M(i, j) == (found ? x[k] : MISSING_SENTINEL));
+        }
+
+        int targetIndex = i;
+        bool found = walk(generator, startObs + p, targetIndex, p > 0 ? 1 : -1, panelIDs[i]);
+        REQUIRE(M.y(i) == (found ? x[targetIndex] : MISSING_SENTINEL));
+      }
+    }
+  }
+}
+
+TEST_CASE("Univariate Wasserstein distances match the network simplex solutions", "[univariateWasserstein]")
+{
+  int E = 6;
+  int tau = 1;
+  int p = 1;
+
+  std::vector<double> t, x, z;
+  std::vector<int> panelIDs;
+  for (int i = 0; i < 120; i++) {
+    t.push_back(i % 60);
+    panelIDs.push_back(i / 60);
+    // Round some values so there are plenty of ties
+    double value = 2 * sin(0.7 * i) + 0.1 * ((i * 7919) % 5);
+    x.push_back((i % 11 == 3) ? NA : ((i % 3 == 0) ? std::round(value) : value));
+    z.push_back((i % 17 == 5) ? NA : cos(0.3 * i));
+  }
+
+  bool dt = false, dt0 = false, reldt = false, allowMissing = true;
+  ManifoldGenerator generator(t, x, tau, p, {}, {}, panelIDs, { z }, 0, dt, dt0, reldt, allowMissing);
+
+  std::vector<bool> usable = generator.generate_usable(E);
+  Manifold M = generator.create_manifold(E, usable, false, false);
+  Manifold Mp = generator.create_manifold(E, usable, false, true);
+  REQUIRE(M.E_actual() == E + 1);
+
+  Options opts;
+  opts.distance = Distance::Wasserstein;
+  opts.aspectRatio = 1.0;
+  opts.metrics = { Metric::Diff, Metric::Diff };
+  opts.panelMode = true;
+  opts.idw = 0.5;
+
+  REQUIRE(UnivariateWasserstein::is_applicable(opts, M));
+  UnivariateWasserstein univariate(M, Mp);
+
+  std::vector<int> inds(M.nobs());
+  std::iota(inds.begin(), inds.end(), 0);
+
+  for (double missingDistance : { 0.0, 1.5 }) {
+    CAPTURE(missingDistance);
+    opts.missingdistance = missingDistance;
+
+    for (int Mp_i = 0; Mp_i < Mp.nobs(); Mp_i++) {
+      CAPTURE(Mp_i);
+      DistanceIndexPairs expected = wasserstein_distances(Mp_i, opts, M, Mp, inds);
+      DistanceIndexPairs found = univariate.distances(Mp_i, opts, inds);
+
+      require_vectors_match<int>(found.inds, expected.inds);
+      for (int j = 0; j < (int)expected.dists.size(); j++) {
+        REQUIRE(found.dists[j] == Approx(expected.dists[j]).margin(1e-12));
+      }
+    }
+  }
+
+  opts.metrics = { Metric::CheckSame, Metric::Diff };
+  REQUIRE(!UnivariateWasserstein::is_applicable(opts, M));
+}
+
+TEST_CASE("A reused EMD workspace gives the same transport costs as a fresh solver", "[emdWorkspace]")
+{
+  EMDWorkspace workspace(10000);
+
+  // Go back and forth between bigger & smaller problems so the workspace is both grown and shrunk.
+  int problem = 0;
+  for (int n1 : { 5, 1, 8, 3, 8 }) {
+    for (int n2 : { 4, 8, 1, 6 }) {
+      CAPTURE(n1);
+      CAPTURE(n2);
+      problem += 1;
+
+      std::vector<double> X(n1, 1.0 / n1), Y(n2, 1.0 / n2), D;
+      for (int i = 0; i < n1 * n2; i++) {
+        D.push_back(std::abs(sin(0.37 * i + problem)) + 0.1 * ((i * 7919) % 3));
+      }
+
+      double expected, found;
+      int expectedRC = EMD_wrap(n1, n2, X.data(), Y.data(), D.data(), &expected, 10000);
+      int foundRC = workspace.solve(n1, n2, X.data(), Y.data(), D.data(), &found);
+
+      REQUIRE(foundRC == expectedRC);
+      REQUIRE(found == expected);
+    }
+  }
+}
+
+TEST_CASE("Equal-length Wasserstein distances solved as assignments match the network simplex", "[assignment]")
+{
+  // Cover the fixed-size solvers and the dynamically-sized one, with integer costs to give lots of ties.
+  for (int n = 1; n <= 14; n++) {
+    for (int problem = 0; problem < 20; problem++) {
+      CAPTURE(n);
+      CAPTURE(problem);
+
+      std::vector<double> w(n, 1.0 / n), C;
+      for (int i = 0; i < n * n; i++) {
+        double cost = std::abs(sin(0.37 * i + 1.3 * problem)) + 0.1 * ((i * 7919) % 3);
+        C.push_back((problem % 2 == 0) ? std::round(4 * cost) : cost);
+      }
+
+      double expected;
+      EMD_wrap(n, n, w.data(), w.data(), C.data(), &expected, 10000);
+
+      REQUIRE(wasserstein(C.data(), n, n) == Approx(expected).margin(1e-12));
+    }
+  }
+
+  // A Wasserstein distance from a real manifold (with 'dt', so it isn't univariate).
+  std::vector<double> t, x;
+  for (int i = 0; i < 40; i++) {
+    t.push_back(i + 0.5 * (i % 3));
+    x.push_back(sin(0.5 * i) + 0.2 * ((i * 7919) % 3));
+  }
+  ManifoldGenerator generator(t, x, 1, 1, {}, {}, {}, {}, 0, true, true, true, false);
+  int E = 10;
+  std::vector<bool> usable = generator.generate_usable(E);
+  Manifold M = generator.create_manifold(E, usable, false, false);
+
+  Options opts;
+  opts.missingdistance = 0;
+  opts.aspectRatio = 1.0;
+  opts.panelMode = false;
+  opts.metrics = { Metric::Diff, Metric::Diff };
+
+  for (int i = 0; i < M.nobs(); i += 5) {
+    for (int j = 0; j < M.nobs(); j += 3) {
+      int len_i, len_j;
+      auto C = wasserstein_cost_matrix(M, M, i, j, opts, len_i, len_j);
+      REQUIRE(len_i == len_j);
+
+      std::vector<double> w(len_i, 1.0 / len_i);
+      double expected;
+      EMD_wrap(len_i, len_j, w.data(), w.data(), C.get(), &expected, 10000);
+
+      REQUIRE(wasserstein(C.get(), len_i, len_j) == Approx(expected).margin(1e-12));
+    }
+  }
+}
+
+TEST_CASE("Pruned Wasserstein nearest neighbours match the brute-force search", "[wassersteinPruning]")
+{
+  std::vector<double> t, x, z;
+  std::vector<int> panelIDs;
+  for (int i = 0; i < 150; i++) {
+    t.push_back(i % 75 + 0.5 * (i % 4 == 0));
+    panelIDs.push_back(i / 75);
+    // Round the values so that there are plenty of tied distances
+    x.push_back((i % 13 == 4) ? NA : std::round(3 * sin(0.4 * i) + ((i * 7919) % 3)));
+    z.push_back((i % 19 == 2) ? NA : cos(0.3 * i));
+  }
+
+  bool dt = true, dt0 = true, reldt = true, allowMissing = true;
+  ManifoldGenerator generator(t, x, 1, 1, {}, {}, panelIDs, { z }, 0, dt, dt0, reldt, allowMissing);
+
+  int E = 4;
+  std::vector<bool> usable = generator.generate_usable(E);
+  Manifold M = generator.create_manifold(E, usable, false, false);
+  Manifold Mp = generator.create_manifold(E, usable, false, true);
+
+  Options opts;
+  opts.distance = Distance::Wasserstein;
+  opts.aspectRatio = 1.0;
+  opts.metrics = { Metric::Diff, Metric::Diff, Metric::Diff };
+  opts.panelMode = true;
+  opts.idw = 2.0;
+
+  std::vector<int> inds(M.nobs());
+  std::iota(inds.begin(), inds.end(), 0);
+
+  for (double missingDistance : { 0.0, 1.0 }) {
+    for (int k : { 1, 4, 20, 1000 }) {
+      CAPTURE(missingDistance);
+      CAPTURE(k);
+      opts.missingdistance = missingDistance;
+      WassersteinCosts costs(opts, M, Mp);
+
+      for (int Mp_i = 0; Mp_i < Mp.nobs(); Mp_i += 3) {
+        CAPTURE(Mp_i);
+        DistanceIndexPairs potentialNN = wasserstein_distances(Mp_i, opts, M, Mp, inds, nullptr, false);
+        int expectedNumValid = potentialNN.inds.size();
+        DistanceIndexPairs expected = (k >= expectedNumValid) ? potentialNN : kNearestNeighbours(potentialNN, k);
+
+        DistanceIndexPairs kNNs;
+        int numValidDistances;
+        wasserstein_k_nearest_neighbours(Mp_i, opts, M, Mp, inds, k, kNNs, numValidDistances);
+
+        REQUIRE(numValidDistances == expectedNumValid);
+        require_vectors_match<int>(kNNs.inds, expected.inds);
+        require_vectors_match<double>(kNNs.dists, expected.dists);
+
+        // The lower bounds worked out from the preprocessed rows prune the search just as well.
+        wasserstein_k_nearest_neighbours(Mp_i, opts, M, Mp, inds, k, kNNs, numValidDistances, &costs);
+
+        REQUIRE(numValidDistances == expectedNumValid);
+        require_vectors_match<int>(kNNs.inds, expected.inds);
+        require_vectors_match<double>(kNNs.dists, expected.dists);
+
+        for (int i = 0; i < M.nobs(); i++) {
+          bool valid;
+          double bound = costs.lower_bound(i, Mp_i, opts, valid);
+          auto found = std::find(potentialNN.inds.begin(), potentialNN.inds.end(), i);
+          if (found != potentialNN.inds.end()) {
+            REQUIRE(valid);
+            REQUIRE(bound <= potentialNN.dists[found - potentialNN.inds.begin()] * (1 + 1e-10));
+          }
+        }
+      }
+    }
+  }
+}
+
+TEST_CASE("Sinkhorn distances approximate the Wasserstein distances", "[sinkhorn]")
+{
+  std::vector<double> t, x, z;
+  for (int i = 0; i < 80; i++) {
+    t.push_back(i);
+    x.push_back((i % 11 == 3) ? NA : 2 * sin(0.35 * i));
+    z.push_back((i % 17 == 5) ? NA : cos(0.2 * i));
+  }
+
+  bool allowMissing = true;
+  ManifoldGenerator generator(t, x, 1, 1, {}, {}, {}, { z }, 0, false, false, false, allowMissing);
+
+  int E = 4;
+  std::vector<bool> usable = generator.generate_usable(E);
+  Manifold M = generator.create_manifold(E, usable, false, false);
+  Manifold Mp = generator.create_manifold(E, usable, false, true);
+
+  Options opts;
+  opts.aspectRatio = 1.0;
+  opts.metrics = { Metric::Diff, Metric::Diff };
+  opts.panelMode = false;
+  opts.missingdistance = 0;
+  opts.sinkhornEpsilon = 0.05;
+  opts.sinkhornTolerance = 1e-10;
+
+  std::vector<int> inds(M.nobs());
+  std::iota(inds.begin(), inds.end(), 0);
+  std::vector<int> reversed(inds.rbegin(), inds.rend());
+
+  for (int Mp_i = 0; Mp_i < Mp.nobs(); Mp_i += 4) {
+    CAPTURE(Mp_i);
+    opts.distance = Distance::Wasserstein;
+    DistanceIndexPairs exact = wasserstein_distances(Mp_i, opts, M, Mp, inds);
+    opts.distance = Distance::Sinkhorn;
+    DistanceIndexPairs approx = sinkhorn_distances(Mp_i, opts, M, Mp, inds);
+
+    require_vectors_match<int>(approx.inds, exact.inds);
+
+    // The entropy-regularised plan can't beat the optimal plan, and is only worse by O(epsilon)
+    for (int pos = 0; pos < (int)exact.inds.size(); pos++) {
+      REQUIRE(std::isfinite(approx.dists[pos]));
+      REQUIRE(approx.dists[pos] >= exact.dists[pos] - 1e-6);
+      REQUIRE(approx.dists[pos] <= exact.dists[pos] + 2 * opts.sinkhornEpsilon * std::log(E * E));
+    }
+
+    // Each distance doesn't depend on which other training points share its block
+    DistanceIndexPairs reverse = sinkhorn_distances(Mp_i, opts, M, Mp, reversed);
+    REQUIRE(reverse.inds.size() == approx.inds.size());
+    for (int pos = 0; pos < (int)approx.inds.size(); pos++) {
+      int rpos = approx.inds.size() - 1 - pos;
+      REQUIRE(reverse.inds[rpos] == approx.inds[pos]);
+      REQUIRE(reverse.dists[rpos] == approx.dists[pos]);
+    }
+
+    for (int pos = 0; pos < (int)approx.inds.size(); pos += 7) {
+      DistanceIndexPairs single = sinkhorn_distances(Mp_i, opts, M, Mp, { approx.inds[pos] });
+      REQUIRE(single.dists.size() == 1);
+      REQUIRE(single.dists[0] == approx.dists[pos]);
+    }
+  }
+}
+
+TEST_CASE("Wasserstein cost matrices built from preprocessed rows match the direct calculation", "[wassersteinCosts]")
+{
+  std::vector<double> t, x, z, w;
+  std::vector<int> panelIDs;
+  for (int i = 0; i < 90; i++) {
+    t.push_back(i % 45 + 0.5 * (i % 5 == 0));
+    panelIDs.push_back(i / 45);
+    x.push_back((i % 13 == 4) ? NA : 3 * sin(0.4 * i));
+    z.push_back((i % 11 == 7) ? NA : std::round(2 * cos(0.3 * i)));
+    w.push_back((i % 17 == 2) ? NA : cos(0.1 * i));
+  }
+
+  bool dt = true, dt0 = true, reldt = true, allowMissing = true;
+  ManifoldGenerator generator(t, x, 1, 1, {}, {}, panelIDs, { z, w }, 1, dt, dt0, reldt, allowMissing);
+
+  int E = 5;
+  std::vector<bool> usable = generator.generate_usable(E);
+  Manifold M = generator.create_manifold(E, usable, false, false);
+  Manifold Mp = generator.create_manifold(E, usable, false, true);
+
+  Options opts;
+  opts.distance = Distance::Wasserstein;
+  opts.aspectRatio = 0.7;
+  opts.metrics = { Metric::Diff, Metric::Diff, Metric::CheckSame, Metric::Diff };
+  opts.panelMode = true;
+  opts.idw = 1.5;
+
+  for (double missingDistance : { 0.0, 2.0 }) {
+    CAPTURE(missingDistance);
+    opts.missingdistance = missingDistance;
+
+    WassersteinCosts costs(opts, M, Mp);
+
+    for (int i = 0; i < M.nobs(); i += 2) {
+      for (int j = 0; j < Mp.nobs(); j += 3) {
+        CAPTURE(i);
+        CAPTURE(j);
+        int len_i, len_j, rows, cols;
+        auto expected = wasserstein_cost_matrix(M, Mp, i, j, opts, len_i, len_j);
+
+        std::vector<double> C;
+        bool integerCosts;
+        costs.cost_matrix(i, j, opts, rows, cols, C, &integerCosts);
+
+        REQUIRE(rows == len_i);
+        REQUIRE(cols == len_j);
+        for (int n = 0; n < len_i * len_j; n++) {
+          REQUIRE(C[n] == expected[n]);
+        }
+        if (integerCosts) {
+          REQUIRE(whole_numbers(C.data(), (long long)len_i * len_j));
+        }
+      }
+    }
+
+    std::vector<int> inds(M.nobs());
+    std::iota(inds.begin(), inds.end(), 0);
+    for (int Mp_i = 0; Mp_i < Mp.nobs(); Mp_i += 5) {
+      DistanceIndexPairs expected = wasserstein_distances(Mp_i, opts, M, Mp, inds);
+      DistanceIndexPairs found = wasserstein_distances(Mp_i, opts, M, Mp, inds, &costs);
+      require_vectors_match<int>(found.inds, expected.inds);
+      require_vectors_match<double>(found.dists, expected.dists);
+    }
+  }
+}
+
+TEST_CASE("Wasserstein costs between integer-coded observations are known to be whole numbers", "[wassersteinCosts]")
+{
+  std::vector<double> t, x, z;
+  for (int i = 0; i < 60; i++) {
+    t.push_back(i);
+    x.push_back((i % 13 == 4) ? NA : (i * 7) % 11 - 5);
+    z.push_back(i % 3);
+  }
+
+  ManifoldGenerator generator(t, x, 1, 1, {}, {}, {}, { z }, 1, false, false, false, true);
+
+  int E = 4;
+  std::vector<bool> usable = generator.generate_usable(E);
+  Manifold M = generator.create_manifold(E, usable, false, false);
+  Manifold Mp = generator.create_manifold(E, usable, false, true);
+
+  Options opts;
+  opts.distance = Distance::Wasserstein;
+  opts.metrics = { Metric::Diff, Metric::CheckSame };
+  opts.panelMode = false;
+
+  // A fractional 'missingdistance' only spoils the costs of the pairs with missing values.
+  for (double missingDistance : { 0.0, 2.0, 0.25 }) {
+    CAPTURE(missingDistance);
+    opts.missingdistance = missingDistance;
+
+    WassersteinCosts costs(opts, M, Mp);
+
+    int numInteger = 0;
+    for (int i = 0; i < M.nobs(); i++) {
+      for (int j = 0; j < Mp.nobs(); j += 3) {
+        CAPTURE(i);
+        CAPTURE(j);
+        int len_i, len_j;
+        std::vector<double> C;
+        bool integerCosts;
+        costs.cost_matrix(i, j, opts, len_i, len_j, C, &integerCosts);
+        REQUIRE(integerCosts == whole_numbers(C.data(), (long long)len_i * len_j));
+        numInteger += integerCosts;
+      }
+    }
+    REQUIRE(numInteger > 0);
+  }
+}
+
+TEST_CASE("Warm-started network simplex solves match the cold starts", "[warmStart]")
+{
+  std::vector<double> t, x;
+  for (int i = 0; i < 120; i++) {
+    t.push_back(i + 0.3 * (i % 3 == 0));
+    x.push_back((i % 9 == 4) ? NA : sin(0.37 * i) + 0.3 * cos(1.7 * i));
+  }
+
+  ManifoldGenerator generator(t, x, 1, 1, {}, {}, {}, {}, 0, true, true, true, true);
+  int E = 8;
+  std::vector<bool> usable = generator.generate_usable(E);
+  Manifold M = generator.create_manifold(E, usable, false, false);
+  Manifold Mp = generator.create_manifold(E, usable, false, true);
+
+  Options opts;
+  opts.missingdistance = 0;
+  opts.aspectRatio = 1.0;
+  opts.panelMode = false;
+  opts.metrics = { Metric::Diff, Metric::Diff };
+
+  EMDWorkspace cold(10000), warm(10000);
+  long long coldPivots = 0, warmPivots = 0;
+
+  for (int j = 0; j < Mp.nobs(); j += 11) {
+    warm.forget_basis();
+    for (int i = 0; i < M.nobs(); i++) {
+      int len_i, len_j;
+      auto C = wasserstein_cost_matrix(M, Mp, i, j, opts, len_i, len_j);
+      if (len_i == 0 || len_j == 0) {
+        continue;
+      }
+
+      std::vector<double> w_1(len_i, len_j), w_2(len_j, len_i);
+      double coldCost, warmCost;
+      REQUIRE(cold.solve(len_i, len_j, w_1.data(), w_2.data(), C.get(), &coldCost) == OPTIMAL);
+      REQUIRE(warm.solve(len_i, len_j, w_1.data(), w_2.data(), C.get(), &warmCost, true) == OPTIMAL);
+      REQUIRE(warmCost == Approx(coldCost).epsilon(1e-12));
+
+      coldPivots += cold.iterations();
+      warmPivots += warm.iterations();
+    }
+  }
+
+  REQUIRE(warmPivots < coldPivots);
+
+  // The same goes for the distances 'make_prediction' uses when the 'warmStartEMD' option is set.
+  std::vector<int> inds(M.nobs());
+  std::iota(inds.begin(), inds.end(), 0);
+  for (int j = 0; j < Mp.nobs(); j += 11) {
+    DistanceIndexPairs coldDists = wasserstein_distances(j, opts, M, Mp, inds);
+    DistanceIndexPairs warmDists = wasserstein_distances(j, opts, M, Mp, inds, nullptr, true);
+    REQUIRE(warmDists.inds == coldDists.inds);
+    for (int i = 0; i < (int)coldDists.dists.size(); i++) {
+      REQUIRE(warmDists.dists[i] == Approx(coldDists.dists[i]).epsilon(1e-12));
+    }
+  }
+}
+
+TEST_CASE("Wasserstein problems with whole number costs are solved exactly", "[integerCosts]")
+{
+  std::vector<double> t, x;
+  for (int i = 0; i < 120; i++) {
+    t.push_back(i);
+    x.push_back((i % 13 == 5) ? NA : (i * i + 3 * i) % 5);
+  }
+
+  ManifoldGenerator generator(t, x, 1, 1, {}, {}, {}, {}, 0, false, false, false, true);
+  int E = 6;
+  std::vector<bool> usable = generator.generate_usable(E);
+  Manifold M = generator.create_manifold(E, usable, false, false);
+  Manifold Mp = generator.create_manifold(E, usable, false, true);
+
+  Options opts;
+  opts.missingdistance = 2;
+  opts.aspectRatio = 1.0;
+  opts.panelMode = false;
+
+  // Categorical data (0/1 costs) and integer-coded data (small integer costs)
+  for (Metric metric : { Metric::CheckSame, Metric::Diff }) {
+    opts.metrics = { metric };
+
+    EMDWorkspace exact(10000), reference(10000);
+
+    for (int j = 0; j < Mp.nobs(); j += 7) {
+      for (int i = 0; i < M.nobs(); i += 3) {
+        int len_i, len_j;
+        auto C = wasserstein_cost_matrix(M, Mp, i, j, opts, len_i, len_j);
+        if (len_i == 0 || len_j == 0) {
+          continue;
+        }
+
+        // Halving the costs keeps them exact but makes them fractional, so they go through the floating point solver
+        std::vector<double> halfC(C.get(), C.get() + len_i * len_j);
+        for (double& c : halfC) {
+          c /= 2;
+        }
+
+        std::vector<double> w_1(len_i, len_j), w_2(len_j, len_i);
+        double exactCost, referenceCost;
+        REQUIRE(exact.solve(len_i, len_j, w_1.data(), w_2.data(), C.get(), &exactCost, true) == OPTIMAL);
+        REQUIRE(reference.solve(len_i, len_j, w_1.data(), w_2.data(), halfC.data(), &referenceCost) == OPTIMAL);
+        REQUIRE(exactCost == std::floor(exactCost));
+        REQUIRE(exactCost == Approx(2 * referenceCost).epsilon(1e-12));
+      }
+    }
+  }
+}
+
+TEST_CASE("Wasserstein distances shared between tasks match the uncached distances", "[wassersteinCache]")
+{
+  std::vector<double> t, x, z;
+  for (int i = 0; i < 90; i++) {
+    t.push_back(i + 0.5 * (i % 4 == 0));
+    x.push_back((i % 13 == 4) ? NA : std::round(3 * sin(0.4 * i) + ((i * 7919) % 3)));
+    z.push_back((i % 19 == 2) ? NA : cos(0.3 * i));
+  }
+
+  Options opts;
+  opts.distance = Distance::Wasserstein;
+  opts.aspectRatio = 1.0;
+  opts.panelMode = false;
+
+  for (bool dt : { false, true }) {
+    CAPTURE(dt);
+    ManifoldGenerator generator(t, x, 1, 1, {}, {}, {}, { z }, 1, dt, false, false, true);
+    opts.metrics = dt ? std::vector<Metric>{ Metric::Diff, Metric::Diff, Metric::Diff }
+                      : std::vector<Metric>{ Metric::Diff, Metric::Diff };
+
+    // Two folds, each predicting the other
+    int E = 4;
+    std::vector<bool> usable = generator.generate_usable(E);
+    std::vector<bool> evens(usable.size()), odds(usable.size());
+    for (int i = 0; i < (int)usable.size(); i++) {
+      evens[i] = usable[i] && (i % 2 == 0);
+      odds[i] = usable[i] && (i % 2 == 1);
+    }
+    Manifold M1 = generator.create_manifold(E, evens, false, false);
+    Manifold Mp1 = generator.create_manifold(E, odds, false, true);
+    Manifold M2 = generator.create_manifold(E, odds, false, false);
+    Manifold Mp2 = generator.create_manifold(E, evens, false, true);
+
+    for (double missingDistance : { 0.0, 1.0 }) {
+      CAPTURE(missingDistance);
+      opts.missingdistance = missingDistance;
+
+      bool symmetric = (M1.E_dt() == 0);
+      int numUsable = (int)std::count(usable.begin(), usable.end(), true);
+      WassersteinDistanceCache cache(usable, WassersteinDistanceTable::memory_needed(numUsable, symmetric));
+      WassersteinDistanceTable* table = cache.table(E, symmetric);
+      REQUIRE(table != nullptr);
+      REQUIRE(cache.table(E, symmetric) == table);
+
+      // The table for another E doesn't fit in the rest of the budget
+      REQUIRE(cache.table(E + 1, symmetric) == nullptr);
+
+      std::vector<int> inds1(M1.nobs()), inds2(M2.nobs());
+      std::iota(inds1.begin(), inds1.end(), 0);
+      std::iota(inds2.begin(), inds2.end(), 0);
+
+      for (int rep = 0; rep < 2; rep++) {
+        for (int Mp_i = 0; Mp_i < Mp1.nobs(); Mp_i++) {
+          DistanceIndexPairs expected = wasserstein_distances(Mp_i, opts, M1, Mp1, inds1, nullptr, false);
+          DistanceIndexPairs cached = wasserstein_distances(Mp_i, opts, M1, Mp1, inds1, nullptr, true, table);
+          require_vectors_match<int>(cached.inds, expected.inds);
+          for (int n = 0; n < (int)expected.dists.size(); n++) {
+            REQUIRE(cached.dists[n] == Approx(expected.dists[n]).epsilon(1e-12));
+          }
+
+          DistanceIndexPairs kNNs, expectedKNNs;
+          int numValid, expectedNumValid;
+          wasserstein_k_nearest_neighbours(Mp_i, opts, M1, Mp1, inds1, 3, kNNs, numValid, nullptr, table);
+          wasserstein_k_nearest_neighbours(Mp_i, opts, M1, Mp1, inds1, 3, expectedKNNs, expectedNumValid);
+          REQUIRE(numValid == expectedNumValid);
+          for (int n = 0; n < (int)expectedKNNs.dists.size(); n++) {
+            REQUIRE(kNNs.dists[n] == Approx(expectedKNNs.dists[n]).epsilon(1e-12));
+          }
+        }
+      }
+
+      // Without 'dt', the other fold finds the same distances the other way round (to the last bit).
+      for (int Mp_i = 0; Mp_i < Mp2.nobs(); Mp_i++) {
+        DistanceIndexPairs cached = wasserstein_distances(Mp_i, opts, M2, Mp2, inds2, nullptr, true, table);
+        for (int n = 0; n < (int)cached.inds.size(); n++) {
+          int p = M2.point_num(cached.inds[n]), q = Mp2.point_num(Mp_i);
+          REQUIRE(table->lookup(p, q) == cached.dists[n]);
+          if (!dt) {
+            REQUIRE(table->lookup(q, p) == cached.dists[n]);
+          }
+        }
+      }
+    }
+  }
+}
+
+TEST_CASE("Vectorised L1/L2 distances match the one-at-a-time distances", "[lpLanes]")
+{
+  std::vector<double> t, x, z;
+  std::vector<int> panelIDs;
+  for (int i = 0; i < 140; i++) {
+    t.push_back(i % 70);
+    panelIDs.push_back(i / 70);
+    x.push_back((i % 17 == 3) ? NA : sin(0.37 * i) + 0.2 * cos(2.1 * i));
+    z.push_back((i % 23 == 5) ? NA : (double)((i * 7) % 3));
+  }
+
+  ManifoldGenerator generator(t, x, 1, 1, {}, {}, panelIDs, { z }, 1, true, false, false, true);
+
+  int E = 5;
+  std::vector<bool> usable = generator.generate_usable(E);
+  Manifold M = generator.create_manifold(E, usable, false, false);
+  Manifold Mp = generator.create_manifold(E, usable, false, true);
+
+  for (int i = 0; i < M.nobs(); i++) {
+    int numMissing = 0;
+    for (int j = 0; j < M.E_actual(); j++) {
+      numMissing += (M(i, j) == MISSING_SENTINEL);
+    }
+    REQUIRE(M.any_missing(i) == (numMissing > 0));
+    REQUIRE(M.num_not_missing(i) == M.E_actual() - numMissing);
+  }
+
+  Options opts;
+  opts.panelMode = true;
+  opts.metrics = std::vector<Metric>(M.E_actual(), Metric::Diff);
+  for (int j = M.E_actual() - E; j < M.E_actual(); j++) {
+    opts.metrics[j] = Metric::CheckSame;
+  }
+
+  std::vector<int> inds(M.nobs());
+  std::iota(inds.begin(), inds.end(), 0);
+
+  for (Distance distance : { Distance::Euclidean, Distance::MeanAbsoluteError }) {
+    for (double missingDistance : { 0.0, 0.5 }) {
+      for (double idw : { 0.0, 3.0 }) {
+        opts.distance = distance;
+        opts.missingdistance = missingDistance;
+        opts.idw = idw;
+
+        for (int Mp_i = 0; Mp_i < Mp.nobs(); Mp_i += 5) {
+          DistanceIndexPairs result = lp_distances(Mp_i, opts, M, Mp, inds);
+
+          std::vector<int> expectedInds;
+          std::vector<double> expectedDists;
+          for (int i : inds) {
+            double dist = lp_distance(i, Mp_i, opts, M, Mp);
+            if (dist != 0 && dist != MISSING_SENTINEL) {
+              expectedInds.push_back(i);
+              expectedDists.push_back(dist);
+            }
+          }
+
+          require_vectors_match<int>(result.inds, expectedInds);
+          require_vectors_match<double>(result.dists, expectedDists);
+        }
+      }
+    }
+  }
+}
+
+TEST_CASE("Tasks and their parallel loops share the pool's worker limit", "[poolLimit]")
+{
+  ThreadPool pool(4);
+
+  for (int limit : { 2, 1, 3 }) {
+    CAPTURE(limit);
+    pool.set_num_workers(limit);
+    REQUIRE(pool.num_workers() == limit);
+
+    std::atomic<int> active = 0, maxActive = 0, total = 0;
+
+    auto work = [&](int i) {
+      int now = ++active;
+      int prev = maxActive;
+      while (prev < now && !maxActive.compare_exchange_weak(prev, now)) {
+      }
+      volatile double x = 0;
+      for (int j = 0; j < 2000 + (i % 7) * 500; j++) {
+        x = x + j;
+      }
+      total += 1;
+      --active;
+    };
+
+    // Each task splits its own loop over the same pool, as 'edm_task' does.
+    std::vector<std::future<void>> futures;
+    for (int t = 0; t < 12; t++) {
+      futures.push_back(pool.enqueue([&pool, &work] { pool.parallel_for(0, 50, 2, work); }));
+    }
+    for (auto& future : futures) {
+      future.get();
+    }
+
+    REQUIRE(total == 12 * 50);
+    REQUIRE(maxActive <= limit);
+  }
+}
+
+TEST_CASE("Pinning the pool's workers leaves their results unchanged", "[pinThreads]")
+{
+  size_t physical = num_physical_cores();
+  REQUIRE(physical >= 1);
+  REQUIRE(physical <= num_logical_cores());
+
+  ThreadPool pool(0);
+
+  // More workers than cores means some of them share a CPU once pinned.
+  int numWorkers = (int)num_logical_cores() + 1;
+  for (bool pin : { true, false, true }) {
+    CAPTURE(pin);
+    pool.set_num_workers(numWorkers, pin);
+
+    std::vector<int> counts(1000, 0);
+    std::vector<std::future<void>> futures;
+    for (int t = 0; t < 4; t++) {
+      futures.push_back(pool.enqueue([&pool, &counts, t] {
+        pool.parallel_for(t * 250, (t + 1) * 250, 10, [&counts](int i) { counts[i] += 1; });
+      }));
+    }
+    for (auto& future : futures) {
+      future.get();
+    }
+
+    REQUIRE(std::all_of(counts.begin(), counts.end(), [](int c) { return c == 1; }));
+  }
+}
+
+TEST_CASE("Progress reported concurrently by the workers is written out as one progress bar", "[progressBar]")
+{
+  // The progress bar is read back from the async buffer, so nothing needs to be printed.
+  class SilentIO : public IO
+  {
+  public:
+    virtual void out(const char*) const {}
+    virtual void error(const char*) const {}
+    virtual void flush() const {}
+  };
+
+  const std::string fullBar = "Percent complete: 0...10...20...30...40...50...60...70...80...90...\n";
+
+  SECTION("Updates collected part way through")
+  {
+    SilentIO io;
+    io.progress_bar(0.0);
+    io.progress_bar(0.3);
+    io.progress_bar(0.1); // Stale updates don't move the bar backwards
+    std::string first = io.get_and_clear_async_buffer();
+    REQUIRE(first == "Percent complete: 0...10...20...30");
+    io.progress_bar(1.0);
+    REQUIRE(first + io.get_and_clear_async_buffer() == fullBar);
+    REQUIRE(io.get_and_clear_async_buffer().empty());
+  }
+
+  SECTION("Many threads updating at once")
+  {
+    SilentIO io;
+    ThreadPool pool(4);
+    io.progress_bar(0.0);
+
+    const int numBlocks = 1000;
+    std::string collected;
+    std::atomic<int> numDone = 0;
+    auto future = pool.enqueue([&] {
+      pool.parallel_for(0, numBlocks, 3, [](int) {}, [&](int done) { io.progress_bar(done / ((double)numBlocks)); });
+      numDone = 1;
+    });
+    while (numDone == 0) {
+      collected += io.get_and_clear_async_buffer();
+    }
+    future.get();
+    collected += io.get_and_clear_async_buffer();
+
+    REQUIRE(collected == fullBar);
+  }
+}
+
+TEST_CASE("Predictions reusing the per-thread buffers match fresh predictions", "[predictionWorkspace]")
+{
+  // Ties in the distances are split by the index, as a stable sort would.
+  DistanceIndexPairs potentialNN = { { 4, 7, 9, 12, 15, 20 }, { 2.0, 1.0, 2.0, 1.0, 3.0, 2.0 } };
+  DistanceIndexPairs kNNs;
+  std::vector<int> idx;
+  for (int k : { 4, 1, 5 }) {
+    kNearestNeighbours(potentialNN, k, kNNs, idx);
+    std::vector<int> expectedInds = { 7, 12, 4, 9, 20 };
+    expectedInds.resize(k);
+    require_vectors_match<int>(kNNs.inds, expectedInds);
+    require_vectors_match<int>(kNearestNeighbours(potentialNN, k).inds, expectedInds);
+  }
+
+  std::vector<double> t, x;
+  for (int i = 0; i < 80; i++) {
+    t.push_back(i);
+    x.push_back(sin(0.37 * i) + 0.2 * cos(2.1 * i));
+  }
+
+  ManifoldGenerator generator(t, x, 1, 1);
+
+  int E = 3;
+  std::vector<bool> usable = generator.generate_usable(E);
+  Manifold M = generator.create_manifold(E, usable, false, false);
+  Manifold Mp = generator.create_manifold(E, usable, false, true);
+
+  Options opts;
+  opts.copredict = false;
+  opts.forceCompute = true;
+  opts.saveKUsed = true;
+  opts.saveSMAPCoeffs = true;
+  opts.missingdistance = 0.0;
+  opts.panelMode = false;
+  opts.idw = 0.0;
+  opts.thetas = { 0.5, 1.0, 3.0 };
+  opts.distance = Distance::Euclidean;
+  opts.metrics = std::vector<Metric>(M.E_actual(), Metric::Diff);
+
+  int numThetas = opts.thetas.size();
+  int numCoeffCols = M.E_actual() + 1;
+
+  struct Result
+  {
+    std::vector<double> ystar, coeffs;
+    std::vector<int> rc;
+    int kUsed;
+  };
+
+  auto predict = [&](int Mp_i) {
+    Result result = { std::vector<double>(numThetas * Mp.nobs(), MISSING_SENTINEL),
+                      std::vector<double>(Mp.nobs() * numCoeffCols, MISSING_SENTINEL),
+                      std::vector<int>(numThetas * Mp.nobs(), UNKNOWN_ERROR), -1 };
+    make_prediction(Mp_i, opts, M, Mp, Eigen::Map<MatrixXd>(result.ystar.data(), numThetas, Mp.nobs()),
+                    Eigen::Map<MatrixXi>(result.rc.data(), numThetas, Mp.nobs()),
+                    Eigen::Map<MatrixXd>(result.coeffs.data(), Mp.nobs(), numCoeffCols), &result.kUsed, nullptr);
+    return result;
+  };
+
+  // Alternate between sizes of k, so the buffers are reused for both larger and smaller predictions.
+  for (Algorithm algorithm : { Algorithm::Simplex, Algorithm::SMap }) {
+    for (int k : { 10, 3, 20, -1, 4 }) {
+      opts.algorithm = algorithm;
+      opts.k = k;
+
+      for (int Mp_i = 0; Mp_i < Mp.nobs(); Mp_i += 7) {
+        CAPTURE(k, Mp_i);
+        Result result = predict(Mp_i);
+
+        // A new thread starts with empty buffers.
+        Result expected = std::async(std::launch::async, predict, Mp_i).get();
+
+        require_vectors_match<double>(result.ystar, expected.ystar);
+        require_vectors_match<double>(result.coeffs, expected.coeffs);
+        require_vectors_match<int>(result.rc, expected.rc);
+        REQUIRE(result.kUsed == expected.kUsed);
+      }
+    }
+  }
+}
+
+TEST_CASE("Streaming the distances through a heap finds the same nearest neighbours", "[nearestNeighbourHeap]")
+{
+  const double NA = MISSING_SENTINEL;
+
+  // Rounding the time series gives plenty of ties in the distances.
+  std::vector<double> t, x;
+  for (int i = 0; i < 120; i++) {
+    t.push_back(i);
+    x.push_back((i % 19 == 4) ? NA : std::round(4 * sin(0.37 * i) + 2 * cos(2.1 * i)));
+  }
+
+  ManifoldGenerator generator(t, x, 1, 1, {}, {}, {}, {}, 0, false, false, false, true);
+
+  int maxE = 4;
+  std::vector<bool> usable = generator.generate_usable(maxE);
+  Manifold Mbig = generator.create_manifold(maxE, usable, false, false);
+  Manifold Mpbig = generator.create_manifold(maxE, usable, false, true);
+  LaggedDistanceSums sums(Mbig, Mpbig);
+
+  Options opts;
+  opts.panelMode = false;
+  opts.idw = 0.0;
+
+  for (int E = 1; E <= maxE; E++) {
+    Manifold M = generator.create_manifold(E, usable, false, false);
+    Manifold Mp = generator.create_manifold(E, usable, false, true);
+    opts.metrics = std::vector<Metric>(M.E_actual(), Metric::Diff);
+
+    std::vector<int> inds(M.nobs());
+    std::iota(inds.begin(), inds.end(), 0);
+
+    for (Distance distance : { Distance::Euclidean, Distance::MeanAbsoluteError }) {
+      opts.distance = distance;
+      for (double missingDistance : { 0.0, 1.5 }) {
+        opts.missingdistance = missingDistance;
+
+        for (int Mp_i = 0; Mp_i < Mp.nobs(); Mp_i += 3) {
+          DistanceIndexPairs potentialNN = lp_distances(Mp_i, opts, M, Mp, inds);
+          int expectedNumValid = potentialNN.inds.size();
+
+          for (int k : { 1, 5, 20, expectedNumValid, expectedNumValid + 3 }) {
+            CAPTURE(E, Mp_i, k);
+            if (k <= 0) {
+              continue;
+            }
+            DistanceIndexPairs expected = (k >= expectedNumValid) ? potentialNN : kNearestNeighbours(potentialNN, k);
+
+            NearestNeighbourHeap heap;
+            DistanceIndexPairs kNNs;
+            int numValidDistances;
+            heap.reset(k);
+            lp_distances(Mp_i, opts, M, Mp, inds, heap);
+            heap.finish(inds, kNNs, numValidDistances);
+
+            REQUIRE(numValidDistances == expectedNumValid);
+            require_vectors_match<int>(kNNs.inds, expected.inds);
+            require_vectors_match<double>(kNNs.dists, expected.dists);
+          }
+        }
+      }
+    }
+
+    // The running sums of an E-sweep can be streamed through the heap in the same way.
+    opts.distance = Distance::Euclidean;
+    opts.missingdistance = 0.0;
+    for (int Mp_i = 0; Mp_i < Mp.nobs(); Mp_i++) {
+      CAPTURE(E, Mp_i);
+      DistanceIndexPairs potentialNN = lp_distances(Mp_i, opts, M, Mp, inds);
+      int k = 7;
+      DistanceIndexPairs expected =
+        (k >= (int)potentialNN.inds.size()) ? potentialNN : kNearestNeighbours(potentialNN, k);
+
+      NearestNeighbourHeap heap;
+      DistanceIndexPairs kNNs;
+      int numValidDistances;
+      heap.reset(k);
+      REQUIRE(sums.lp_distances(Mp_i, opts, M, Mp, inds, heap));
+      heap.finish(inds, kNNs, numValidDistances);
+
+      REQUIRE(numValidDistances == (int)potentialNN.inds.size());
+      require_vectors_match<int>(kNNs.inds, expected.inds);
+      require_vectors_match<double>(kNNs.dists, expected.dists);
+    }
+  }
+}
@@ -1,9 +1,9 @@
 // Adapted from https://github.com/jhasse/ThreadPool/blob/master/ThreadPool.hpp
 #pragma once
 
+#include <deque>
 #include <functional>
 #include <future>
-#include <queue>
 #include <vector>
 
 #ifndef _MSC_VER
@@ -19,24 +19,49 @@
 #ifndef THREAD_POOL_HPP
 #define THREAD_POOL_HPP
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
 #include <functional>
 #include <future>
-#include <queue>
+#include <memory>
+#include <mutex>
 
+#include "cpu.h"
+
+// A pool whose workers run the queued tasks. Any task may itself split up a loop with 'parallel_for' over the
+// same pool: the calling task works on the loop too, and the extra helpers it asks for jump the queue ahead of the
+// tasks still waiting to start, so the pool's threads finish the tasks already started before beginning new ones.
+// At most 'num_workers()' threads are ever working on the pool's tasks (plus any outside threads calling
+// 'parallel_for' themselves).
 class ThreadPool
 {
 public:
   ThreadPool(int);
   template<class F, class... Args>
   auto enqueue(F&& f, Args&&... args) -> std::future<typename std::result_of<F(Args...)>::type>;
+  void parallel_for(int begin, int end, int grain, const std::function<void(int)>& f,
+                    const std::function<void(int)>& chunk_done = nullptr);
   ~ThreadPool();
-  void set_num_workers(int threads);
+  // Grow or shrink the pool (threads aren't destroyed, the spare ones just stop taking tasks until they're needed).
+  // With 'pin' set, each worker is pinned to its own CPU (see 'distribute_threads'), so it stays near the memory
+  // it has touched rather than being migrated across cores or sockets.
+  void set_num_workers(int threads, bool pin = false);
+  int num_workers() const { return limit; }
 
 private:
   // need to keep track of threads so we can join them
   std::vector<std::thread> workers;
+  // Only the first 'limit' workers take tasks
+  std::atomic<int> limit{ 0 };
+  std::atomic<int> numThreads{ 0 };
+  bool pinned = false;
   // the task queue
-  std::queue<std::function<void()>> tasks;
+  std::deque<std::function<void()>> tasks;
+
+  void notify_new_task();
 
   // synchronization
   std::mutex queue_mutex;
@@ -52,27 +77,47 @@ inline ThreadPool::ThreadPool(int threads)
   set_num_workers(threads);
 }
 
-inline void ThreadPool::set_num_workers(int threads)
+inline void ThreadPool::set_num_workers(int threads, bool pin)
 {
-  int numNewThreads = threads - workers.size();
+  {
+    std::unique_lock<std::mutex> lock(queue_mutex);
+    limit = threads;
+  }
+  condition.notify_all();
 
-  for (size_t i = 0; i < numNewThreads; ++i)
-    workers.emplace_back([this] {
+  for (int id = (int)workers.size(); id < threads; ++id, ++numThreads)
+    workers.emplace_back([this, id] {
       for (;;) {
         std::function<void()> task;
 
         {
           std::unique_lock<std::mutex> lock(this->queue_mutex);
-          this->condition.wait(lock, [this] { return this->stop || !this->tasks.empty(); });
+          this->condition.wait(lock, [this, id] { return this->stop || (id < this->limit && !this->tasks.empty()); });
           if (this->stop && this->tasks.empty())
             return;
           task = std::move(this->tasks.front());
-          this->tasks.pop();
+          this->tasks.pop_front();
         }
 
         task();
       }
     });
+
+  // Pin the workers (or release them if an earlier call had pinned them)
+  if (pin || pinned) {
+    distribute_threads(workers, pin);
+    pinned = pin;
+  }
+}
+
+// Wake up a worker to take a new task (if some workers are spare, all are woken as the spare ones won't take it).
+inline void ThreadPool::notify_new_task()
+{
+  if (numThreads > limit) {
+    condition.notify_all();
+  } else {
+    condition.notify_one();
+  }
 }
 
 // add new work item to the pool
@@ -92,10 +137,162 @@ auto ThreadPool::enqueue(F&& f, Args&&... args) -> std::future<typename std::res
     if (stop)
       throw std::runtime_error("enqueue on stopped ThreadPool");
 
-    tasks.emplace([task]() { (*task)(); });
+    tasks.emplace_back([task]() { (*task)(); });
   }
-  condition.notify_one();
+  notify_new_task();
   return res;
 }
 
-#endif
\ No newline at end of file
+// Run f(i) for every i in [begin, end) on the calling thread plus (at most) 'num_workers() - 1' of this pool's
+// workers, so the loop never has more than 'num_workers()' threads working on it. Rather than enqueueing each
+// iteration separately, each participant is given its own share of the range, which it works through from the
+// front 'grain' iterations at a time. A participant which runs out of work steals the back half of another
+// participant's share, so uneven iteration costs are spread out. The optional 'chunk_done' callback is given the
+// total number of iterations finished so far, and may be called from any of the participating threads.
+// If 'f' (or 'chunk_done') throws, the other participants stop at the end of their current chunk, and the first
+// exception is rethrown on the calling thread once they have all stopped.
+inline void ThreadPool::parallel_for(int begin, int end, int grain, const std::function<void(int)>& f,
+                                     const std::function<void(int)>& chunk_done)
+{
+  int n = end - begin;
+  if (n <= 0) {
+    return;
+  }
+  grain = std::max(grain, 1);
+
+  int numChunks = (n + grain - 1) / grain;
+  int numHelpers = std::max(0, std::min(num_workers() - 1, numChunks - 1));
+  int numShares = numHelpers + 1;
+
+  // Each share packs its remaining [lo, hi) range into one atomic so that the owner & thieves can claim
+  // iterations with a single compare-and-swap. The padding keeps each share on its own cache line.
+  struct alignas(64) Share
+  {
+    std::atomic<uint64_t> range;
+  };
+
+  struct State
+  {
+    std::unique_ptr<Share[]> shares;
+    int numShares;
+    std::atomic<int> nextShare{ 0 };
+    std::atomic<int> numDone{ 0 };
+    std::atomic<bool> failed{ false };
+
+    std::mutex mutex;
+    std::condition_variable finished;
+    int numActive = 0;
+    bool closed = false;
+    std::exception_ptr error;
+  };
+
+  auto pack = [](uint32_t lo, uint32_t hi) { return ((uint64_t)hi << 32) | lo; };
+  auto lo_of = [](uint64_t range) { return (uint32_t)(range & 0xFFFFFFFF); };
+  auto hi_of = [](uint64_t range) { return (uint32_t)(range >> 32); };
+
+  auto state = std::make_shared<State>();
+  state->numShares = numShares;
+  state->shares.reset(new Share[numShares]);
+  for (int s = 0; s < numShares; s++) {
+    uint32_t lo = (uint32_t)(((int64_t)n * s) / numShares);
+    uint32_t hi = (uint32_t)(((int64_t)n * (s + 1)) / numShares);
+    state->shares[s].range.store(pack(lo, hi));
+  }
+
+  // The work done by each participant; 'state' is kept alive by the helpers, but 'f' & 'chunk_done'
+  // are only touched while the calling thread is still waiting in this function.
+  auto participate = [state, begin, grain, n, &f, &chunk_done, pack, lo_of, hi_of](int me) {
+    std::atomic<uint64_t>& mine = state->shares[me].range;
+
+    while (!state->failed) {
+      // Take the next chunk from the front of our own share.
+      uint64_t range = mine.load();
+      uint32_t lo = lo_of(range), hi = hi_of(range);
+      if (lo < hi) {
+        uint32_t stop = std::min(hi, lo + (uint32_t)grain);
+        if (!mine.compare_exchange_weak(range, pack(stop, hi))) {
+          continue;
+        }
+        for (uint32_t i = lo; i < stop; i++) {
+          f(begin + (int)i);
+        }
+        int numDone = (state->numDone += (int)(stop - lo));
+        if (chunk_done != nullptr) {
+          chunk_done(numDone);
+        }
+        continue;
+      }
+
+      // Our share is empty, so try to steal the back half of someone else's.
+      bool stole = false;
+      for (int j = 1; j < state->numShares && !stole; j++) {
+        std::atomic<uint64_t>& theirs = state->shares[(me + j) % state->numShares].range;
+        uint64_t victim = theirs.load();
+        while (lo_of(victim) < hi_of(victim)) {
+          uint32_t vlo = lo_of(victim), vhi = hi_of(victim);
+          uint32_t mid = vlo + (vhi - vlo) / 2;
+          if (theirs.compare_exchange_weak(victim, pack(vlo, mid))) {
+            mine.store(pack(mid, vhi));
+            stole = true;
+            break;
+          }
+        }
+      }
+
+      if (!stole) {
+        return;
+      }
+    }
+  };
+
+  // Record the first exception thrown by any participant (so the rest give up) rather than letting it escape.
+  auto participate_safely = [state, participate](int me) {
+    try {
+      participate(me);
+    } catch (...) {
+      std::unique_lock<std::mutex> lock(state->mutex);
+      if (state->error == nullptr) {
+        state->error = std::current_exception();
+      }
+      state->failed = true;
+    }
+  };
+
+  for (int h = 0; h < numHelpers; h++) {
+    std::unique_lock<std::mutex> lock(queue_mutex);
+    if (stop)
+      throw std::runtime_error("enqueue on stopped ThreadPool");
+
+    tasks.emplace_front([state, participate_safely]() {
+      {
+        std::unique_lock<std::mutex> lock(state->mutex);
+        if (state->closed) {
+          return;
+        }
+        state->numActive += 1;
+      }
+
+      participate_safely(state->nextShare++);
+
+      std::unique_lock<std::mutex> lock(state->mutex);
+      state->numActive -= 1;
+      state->finished.notify_all();
+    });
+    lock.unlock();
+    notify_new_task();
+  }
+
+  // The calling thread takes part too, and then waits for any helpers still finishing their last chunk.
+  // Helpers which haven't started by the time every iteration is done will find the loop closed.
+  participate_safely(state->nextShare++);
+
+  std::unique_lock<std::mutex> lock(state->mutex);
+  state->finished.wait(lock, [&state, n] { return (state->numDone == n || state->failed) && state->numActive == 0; });
+  state->closed = true;
+
+  if (state->error != nullptr) {
+    std::rethrow_exception(state->error);
+  }
+}
+
+#endif
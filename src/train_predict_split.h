@@ -8,17 +8,21 @@
 class TrainPredictSplitter
 {
 private:
-  bool _explore, _full;
+  bool _explore, _full, _nestedLibraries;
   int _crossfold, _numObsUsable;
   std::vector<bool> _usable;
   std::vector<bool> _trainingRows, _predictionRows;
   std::vector<int> _crossfoldURank;
+  std::vector<double> _u;
+  int _uIter = -1;
   MtRng64 _rng;
 
 public:
-  TrainPredictSplitter(bool explore, bool full, int crossfold, std::vector<bool> usable, const std::string& rngState)
+  TrainPredictSplitter(bool explore, bool full, int crossfold, std::vector<bool> usable, const std::string& rngState,
+                       bool nestedLibraries = false)
     : _explore(explore)
     , _full(full)
+    , _nestedLibraries(nestedLibraries)
     , _crossfold(crossfold)
     , _usable(usable)
   {
@@ -116,12 +120,18 @@ public:
       return;
     }
 
-    std::vector<double> u;
-
-    for (int i = 0; i < _numObsUsable; i++) {
-      u.push_back(_rng.getReal2());
+    // With nested libraries (in xmap mode), the random numbers are only drawn once per replicate, so
+    // the training set for each library size is a subset of the training set for any larger library.
+    if (!(_nestedLibraries && !_explore && crossfoldIter == _uIter)) {
+      _u.clear();
+      for (int i = 0; i < _numObsUsable; i++) {
+        _u.push_back(_rng.getReal2());
+      }
+      _uIter = crossfoldIter;
     }
 
+    const std::vector<double>& u = _u;
+
     if (_explore) {
       double med = median(u);
 